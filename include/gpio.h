@@ -41,6 +41,11 @@ class GPIO {
 #endif
             );
 
+  // Instead of the hardware registers, write to "registers", which needs to
+  // have room for the GPIO register block (4kB). Allows to measure the
+  // output code on machines without the hardware.
+  bool InitWithRegisterMemory(volatile uint32_t *registers, int slowdown = 0);
+
   // Initialize outputs.
   // Returns the bits that are actually set.
   uint32_t InitOutputs(uint32_t outputs, bool adafruit_hack_needed = false);
@@ -102,8 +107,42 @@ public:
 
   // If SendPulse() is asynchronously implemented, wait for pulse to finish.
   virtual void WaitPulseFinished() {}
+
+  // Change the time periods, keeping the pins and registers set up by
+  // Create(): that might not be possible anymore once privileges are
+  // dropped. Needs as many as were passed to Create(). Call from the thread
+  // sending the pulses, with none going on; doesn't allocate.
+  virtual void SetTimings(const std::vector<int> &nano_wait_spec) = 0;
+};
+
+// The PinPulsers time pulses with a mix of nanosleep() and busy-waiting.
+// How fast the busy loop runs and how much nanosleep() oversleeps depends on
+// the Pi model, CPU frequency scaling and the kernel, so both are measured at
+// startup and re-checked while running.
+struct TimingCalibration {
+  int busy_loop_picoseconds;        // Time of one busy-wait loop iteration.
+  int nanosleep_overshoot_p50_us;   // Median time nanosleep() overslept.
+  int nanosleep_overshoot_p999_us;  // 99.9%-ile of that.
+  int nanosleep_overshoot_max_us;   // Largest observed (capped at 255).
+  uint32_t nanosleep_samples;       // Samples the above are based on.
+  int jitter_allowance_us;          // Time not nanosleep()ing, but busy-wait.
+  int calibration_count;            // Number of calibrations so far.
 };
 
+// Get the most recent timing calibration. Returns 'false' if the timers are
+// not initialized yet (e.g. no PinPulser created).
+bool GetTimingCalibration(TimingCalibration *result);
+
+// Re-measure the busy-loop speed and re-derive the jitter allowance from the
+// nanosleep() overshoot seen since the last calibration. Takes a few dozen
+// microseconds of busy-waiting, so the refresh thread calls this every couple
+// of seconds between frames.
+void RecalibrateTiming();
+
+// Copy the histogram of how many microseconds nanosleep() overslept while
+// timing pulses into "histogram_us", which has space for "buckets" values.
+void GetNanosleepOvershootHistogram(uint32_t *histogram_us, int buckets);
+
 }  // end namespace rgb_matrix
 
 #endif  // RPI_GPIO_H
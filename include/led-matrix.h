@@ -38,6 +38,47 @@ class Framebuffer;
 class PixelDesignatorMap;
 }
 
+// Feedback when a frame handed to SwapOnVSync() or SubmitFrame() was on the
+// screen. All times are CLOCK_MONOTONIC in microseconds, so they can be
+// compared with clock_gettime() timestamps of the producer.
+struct FramePresentation {
+  uint64_t sequence;         // Submission sequence, see FrameCanvas::sequence()
+  uint64_t submit_us;        // When it was handed over.
+
+  // Number of the first refresh showing the frame (see
+  // RGBMatrix::RefreshTelemetry::refresh_count) and when it started.
+  // Both zero if the frame was dropped.
+  uint64_t shown_refresh;
+  uint64_t shown_us;
+
+  // First refresh showing the next frame instead and when that started.
+  // Both zero if the frame was dropped.
+  uint64_t retired_refresh;
+  uint64_t retired_us;
+
+  // The frame was replaced by a newer SubmitFrame() before it was shown.
+  bool dropped;
+};
+
+// A layer of tiles over the tiles of a frame (see FrameCanvas::SetTilePtrs()),
+// composited while the refresh thread converts the frame for output. The
+// tiles have the same layout: width() / 16 x height() / 16 tile pointers,
+// row by row, each to 16x16 pixels of interleaved 16 bit RGB. A NULL tile is
+// transparent and costs nothing.
+struct TileLayer {
+  enum Blend {
+    kReplace,   // Covers what is below.
+    kKeyed,     // Like kReplace, but black pixels show what is below.
+    kAdd,       // Adds to what is below, saturating.
+    kMax,       // The brighter of each channel.
+  };
+  void **tiles;
+  Blend blend;
+
+  // Draw a tile of this layer over the tile "dst".
+  void Draw(const uint16_t *src, uint16_t *dst) const;
+};
+
 // The RGB matrix provides the framebuffer and the facilities to constantly
 // update the LED matrix.
 //
@@ -144,6 +185,53 @@ public:
     // to this matrix. A semicolon-separated list of pixel-mappers with optional
     // parameter.
     const char *pixel_mapper_config;   // Flag: --led-pixel-mapper
+
+    // Adaptive refresh governor. If > 0, the refresh rate is measured and
+    // kept at or above this many Hz by lowering the PWM bits and LSB
+    // nanoseconds and raising the dither bits, within the limits below.
+    // With enough headroom, it goes back towards the values configured
+    // above. Default: 0 (off).
+    int governor_refresh_hz;            // Flag: --led-governor-hz
+
+    // The governor limits. Defaults: 7 bits, 50ns, 2 dither bits.
+    int governor_min_pwm_bits;          // Flag: --led-governor-min-pwm-bits
+    int governor_min_lsb_nanoseconds;   // Flag: --led-governor-min-lsb-nanoseconds
+    int governor_max_dither_bits;       // Flag: --led-governor-max-dither-bits
+  };
+
+  // Health of the refresh loop. Continuously recorded by the refresh thread
+  // and available to other threads with GetRefreshTelemetry() at any time.
+  struct RefreshTelemetry {
+    enum {
+      kPeriodBucketUs = 100,   // Resolution of the refresh period histogram.
+      kPeriodBuckets = 256,
+      kOvershootBuckets = 256
+    };
+    uint64_t refresh_count;        // Number of refreshes so far.
+    uint64_t frames_swapped;       // Frames that became visible on VSync.
+    uint64_t refresh_time_sum_us;  // Sum of all refresh periods.
+    uint32_t last_period_us;       // Duration of the most recent refresh.
+
+    // Output parameters of the most recent refresh. They only differ from
+    // the Options if changed while running, e.g. by the refresh governor.
+    int pwm_bits;
+    int pwm_lsb_nanoseconds;
+    int pwm_dither_bits;
+
+    // Longest refresh observed. Like with --led-show-refresh, the first
+    // couple of seconds of start-up glitches are not considered.
+    uint32_t max_period_us;
+
+    // 99%-ile of the refresh period, with the resolution of the histogram.
+    uint32_t p99_period_us;
+
+    // Histogram of refresh periods in kPeriodBucketUs buckets. The last
+    // bucket collects all longer periods as well.
+    uint32_t period_histogram[kPeriodBuckets];
+
+    // How many microseconds nanosleep() overslept while timing the
+    // output-enable pulses. Recent samples weigh more (see gpio.h).
+    uint32_t pulse_overshoot_histogram_us[kOvershootBuckets];
   };
 
   // Create an RGBMatrix.
@@ -221,6 +309,29 @@ public:
   void SetBrightness(uint8_t brightness);
   uint8_t brightness();
 
+  // Change the output timing while running, without blanking: the pulse
+  // timings are prepared in the calling thread, and the refresh thread
+  // switches to them between two refreshes. A "pwm_bits" of 0 shows as many
+  // bits as the frames have, fewer cap them. The refresh governor, if
+  // enabled, keeps changing these too.
+  // Returns 'false' if the refresh thread is not running.
+  bool ChangeRefreshParameters(int pwm_bits, int pwm_lsb_nanoseconds,
+                               int pwm_dither_bits);
+
+  // Map the 16 bit values of all frames (tile pointers and SetPixelHDR()
+  // alike) through  out = brightness% * in^gamma  on their way to the
+  // panel, e.g. to dim the wall without the content changing. Unlike
+  // SetBrightness(), this also affects what is already drawn. The lookup
+  // table is computed in the calling thread, and the refresh thread
+  // switches to it between two refreshes. 100% and gamma 1.0 cost nothing.
+  // Returns 'false' if the refresh thread is not running.
+  bool SetOutputCurve(uint8_t brightness, float gamma);
+
+  // Get a snapshot of the refresh telemetry. This does not lock and does not
+  // disturb the refresh thread, so it is fine to call it often.
+  // Returns 'false' if the refresh thread is not running.
+  bool GetRefreshTelemetry(RefreshTelemetry *out) const;
+
   //-- Double- and Multibuffering.
 
   // Create a new buffer to be used for multi-buffering. The returned new
@@ -251,6 +362,37 @@ public:
   // 28Hz animation, nicely locked to the frame-rate).
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned framerate_fraction = 1);
 
+  // Non-blocking alternative to SwapOnVSync(): hand over "frame" to be
+  // shown on the next VSync and return immediately with a frame that is free
+  // to draw the next content into.
+  //
+  // Works like a mailbox: if the previously submitted frame was not shown
+  // yet when a new one is submitted, the newer one wins and the older one
+  // goes back to the pool of free frames, as does every frame once the next
+  // one is on the screen. So the producer never waits for the display and
+  // the freshest frame is always shown. This needs three FrameCanvas (drawn
+  // into, waiting for VSync, on the screen); the third one is created
+  // automatically when needed.
+  //
+  // Don't mix this with SwapOnVSync() in the same program: frames handed
+  // back from SwapOnVSync() are not managed by the pool.
+  //
+  // Without a refresh thread (see StartRefresh()), the frame is handed
+  // back as it is.
+  FrameCanvas *SubmitFrame(FrameCanvas *frame);
+
+  // Get presentation feedback of submitted frames once they have been
+  // retired from the screen (or dropped), oldest first. Fills up to
+  // "max_records" into "out" and returns the number of records. Records not
+  // picked up are kept for the last 64 frames.
+  int GetPresentationFeedback(FramePresentation *out, int max_records);
+
+  // Returns an eventfd that is signalled each time a new frame becomes
+  // visible; reading it returns the number of frames since the last read.
+  // Useful to pace producers with poll()/select(). It is non-blocking and
+  // owned by the RGBMatrix. Returns -1 if the refresh thread is not running.
+  int GetVSyncEventFd();
+
   // Apply a pixel mapper. This is used to re-map pixels according to some
   // scheme implemented by the PixelMapper. Does not take ownership of the
   // mapper. Mapper can be NULL, in which case nothing happens.
@@ -288,6 +430,8 @@ public:
 private:
   class UpdateThread;
   friend class UpdateThread;
+  class RefreshGovernor;
+  friend class RefreshGovernor;
 
   // Apply pixel mappers that have been passed down via a configuration
   // string.
@@ -309,6 +453,8 @@ private:
   CanvasTransformer *transformer_;  // deprecated. To be removed.
 #endif
   UpdateThread *updater_;
+  Thread *refresh_printer_;  // Only with show_refresh_rate
+  RefreshGovernor *governor_;  // Only with governor_refresh_hz
   std::vector<FrameCanvas*> created_frames_;
   internal::PixelDesignatorMap *shared_pixel_mapper_;
 };
@@ -353,6 +499,10 @@ public:
   // Copy content from other FrameCanvas owned by the same RGBMatrix.
   void CopyFrom(const FrameCanvas &other);
 
+  // Sequence number assigned when this frame was last handed to
+  // SwapOnVSync() or SubmitFrame(); matches FramePresentation::sequence.
+  uint64_t sequence() const { return presentation_.sequence; }
+
   // -- Canvas interface.
   virtual int width() const;
   virtual int height() const;
@@ -366,6 +516,13 @@ public:
 
   virtual void SetTilePtrs(void** ptrs);
 
+  // Layers shown over this frame, bottom first; copies up to
+  // kMaxTileLayers of them. The tiles must stay valid as long as the frame
+  // can be on the screen, like those of SetTilePtrs(). A count of 0 removes
+  // the layers.
+  static const int kMaxTileLayers = 4;
+  void SetTileLayers(const TileLayer *layers, int count);
+
 
   uint16_t *color_r_;
   uint16_t *color_g_;
@@ -374,6 +531,9 @@ public:
   void** tileptrs_;
   int tileptrs_w_;
   int tileptrs_h_;
+
+  TileLayer tile_layers_[kMaxTileLayers];
+  int tile_layer_count_;
   
 private:
   friend class RGBMatrix;
@@ -383,6 +543,7 @@ private:
   internal::Framebuffer *framebuffer() { return frame_; }
 
   internal::Framebuffer *const frame_;
+  FramePresentation presentation_;  // Maintained by the refresh thread.
 
 
   const int height_;   // rows * parallel
@@ -0,0 +1,121 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Low overhead event tracing, to see where the time between getting the
+// content and showing it goes.
+//
+// Each thread records into its own ring buffer, so there is no locking and
+// no system call involved (apart from reading the clock). When tracing is
+// not enabled, a tracepoint is a single load and branch.
+//
+// Events are keyed by frame, so that the steps of a frame can be followed
+// across threads. Frame numbers are only meaningful within a category: the
+// library uses category "matrix" with the FrameCanvas::sequence() number of
+// frames handed to SwapOnVSync() or SubmitFrame(). Applications use their
+// own category and connect their frame numbers to the library ones with
+// TraceLink().
+//
+// TraceDump() writes the binary trace, utils/trace-to-json converts it to
+// the Chrome trace event format (chrome://tracing or ui.perfetto.dev).
+#ifndef RPI_TRACE_H
+#define RPI_TRACE_H
+
+#include <stdint.h>
+
+namespace rgb_matrix {
+namespace internal {
+extern bool trace_enabled;
+void TraceRecord(char phase, const char *category, const char *name,
+                 uint32_t frame, uint32_t arg);
+}  // namespace internal
+
+// Start or stop recording. Each thread allocates its ring buffer with the
+// first event it records.
+void TraceEnable(bool enable);
+
+// Allocate the ring buffer of the calling thread now, so that the first
+// event doesn't: for threads that must not stall, like the refresh thread.
+// Call after naming the thread; the ring keeps the name it has then.
+void TracePrepareThread();
+
+inline bool TraceEnabled() {
+  return __builtin_expect(__atomic_load_n(&internal::trace_enabled,
+                                          __ATOMIC_RELAXED), 0);
+}
+
+// All strings passed to the tracepoints need to stay valid until the trace
+// is dumped; typically they are string literals.
+
+// Beginning and end of a step working on the given frame.
+inline void TraceBegin(const char *category, const char *name,
+                       uint32_t frame) {
+  if (TraceEnabled()) internal::TraceRecord('B', category, name, frame, 0);
+}
+inline void TraceEnd(const char *category, const char *name, uint32_t frame) {
+  if (TraceEnabled()) internal::TraceRecord('E', category, name, frame, 0);
+}
+
+// Something happened to the frame. The meaning of "arg" depends on the event.
+inline void TraceInstant(const char *category, const char *name,
+                         uint32_t frame, uint32_t arg = 0) {
+  if (TraceEnabled()) internal::TraceRecord('i', category, name, frame, arg);
+}
+
+// Frame "frame" in "category" is the same as "other_frame" in
+// "other_category" from now on.
+inline void TraceLink(const char *category, uint32_t frame,
+                      const char *other_category, uint32_t other_frame) {
+  if (TraceEnabled())
+    internal::TraceRecord('L', category, other_category, frame, other_frame);
+}
+
+// Begin and end of a step for the lifetime of this object.
+class TraceScope {
+public:
+  TraceScope(const char *category, const char *name, uint32_t frame)
+    : category_(category), name_(name), frame_(frame) {
+    TraceBegin(category_, name_, frame_);
+  }
+  ~TraceScope() { TraceEnd(category_, name_, frame_); }
+
+private:
+  const char *const category_;
+  const char *const name_;
+  const uint32_t frame_;
+};
+
+// Write all recorded events to "filename". The most recent events of each
+// thread are kept; best called after stopping with TraceEnable(false), as the
+// oldest events might be overwritten while dumping otherwise.
+// Returns 'false' if the file could not be written.
+bool TraceDump(const char *filename);
+
+// The file written by TraceDump(), in host byte order:
+//   TraceFileHeader
+//   string_count strings, each an uint16_t length followed by the characters.
+//   thread_count times a TraceFileThread followed by its records.
+struct TraceFileHeader {
+  char magic[8];          // "RGBTRACE"
+  uint32_t version;       // 1
+  uint32_t string_count;
+  uint32_t thread_count;
+  uint32_t reserved;
+};
+
+struct TraceFileThread {
+  uint32_t tid;
+  char name[16];
+  uint32_t record_count;
+};
+
+struct TraceFileRecord {
+  uint64_t timestamp_ns;  // CLOCK_MONOTONIC
+  uint32_t frame;
+  uint32_t arg;           // For 'L': other_frame
+  uint16_t category;      // Index into the strings.
+  uint16_t name;          // For 'L': other_category
+  char phase;             // 'B', 'E', 'i' or 'L'
+  uint8_t reserved[3];
+};
+}  // namespace rgb_matrix
+
+#endif  // RPI_TRACE_H
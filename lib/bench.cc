@@ -0,0 +1,312 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Microbenchmarks of the pixel conversion and refresh code paths, so that
+// optimizations can be compared on the Pi as well as on a workstation.
+//
+// The output goes to memory instead of the GPIO registers and output enable
+// pulses take no time, so the refresh rates are the upper bound the CPU
+// allows; the real panel adds the pulse times.
+//
+// Build and run with
+// $ make bench && ./bench
+
+#include "led-matrix.h"
+#include "gpio.h"
+#include "pixel-mapper.h"
+#include "framebuffer-internal.h"
+#include "multiplex-mappers-internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+using namespace rgb_matrix;
+using namespace rgb_matrix::internal;
+
+namespace {
+// Output enable pulses that take no time.
+class NoOpPinPulser : public PinPulser {
+public:
+  virtual void SendPulse(int time_spec_number) {}
+};
+
+struct Geometry {
+  const char *name;
+  int rows;
+  int cols;
+  int chain_length;
+  int parallel;
+  int multiplexing;
+};
+
+// The walls we run.
+static const Geometry kGeometries[] = {
+  { "64x48: 64x16 panels, 3 parallel, mux 7", 16, 64, 1, 3, 7 },
+  { "192x96: 64x32 panels, chain 3, 3 parallel", 32, 64, 3, 3, 0 },
+};
+
+static const double kMinBenchSeconds = 0.5;
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Base class for a benchmark; Run() is called until enough time passed.
+class Bench {
+public:
+  virtual ~Bench() {}
+  virtual void Run() = 0;
+
+  // Returns seconds per Run().
+  double Measure() {
+    Run();  // Warm up caches.
+    int iterations = 0;
+    const double start = Now();
+    double elapsed;
+    do {
+      Run();
+      ++iterations;
+    } while ((elapsed = Now() - start) < kMinBenchSeconds);
+    return elapsed / iterations;
+  }
+};
+
+static void Report(const char *name, double seconds, int pixels) {
+  printf("  %-36s %9.1f us %8.2f ns/pixel\n", name, seconds * 1e6,
+         seconds * 1e9 / pixels);
+}
+
+// Same as RGBMatrix::ApplyPixelMapper() does with the shared mapping.
+static void ApplyMapper(const PixelMapper *mapper, PixelDesignatorMap **map) {
+  const int old_width = (*map)->width();
+  const int old_height = (*map)->height();
+  int new_width, new_height;
+  if (!mapper->GetSizeMapping(old_width, old_height, &new_width, &new_height))
+    return;
+  PixelDesignatorMap *new_map = new PixelDesignatorMap(new_width, new_height);
+  for (int y = 0; y < new_height; ++y) {
+    for (int x = 0; x < new_width; ++x) {
+      int orig_x = -1, orig_y = -1;
+      mapper->MapVisibleToMatrix(old_width, old_height, x, y,
+                                 &orig_x, &orig_y);
+      const PixelDesignator *orig = (*map)->get(orig_x, orig_y);
+      if (orig) *new_map->get(x, y) = *orig;
+    }
+  }
+  delete *map;
+  *map = new_map;
+}
+
+class FillBench : public Bench {
+public:
+  FillBench(FrameCanvas *canvas) : canvas_(canvas) {}
+  virtual void Run() { canvas_->Fill(10, 20, 30); }
+private:
+  FrameCanvas *const canvas_;
+};
+
+class SetPixelHDRBench : public Bench {
+public:
+  SetPixelHDRBench(FrameCanvas *canvas) : canvas_(canvas) {}
+  virtual void Run() {
+    const int w = canvas_->width();
+    const int h = canvas_->height();
+    for (int y = 0; y < h; ++y)
+      for (int x = 0; x < w; ++x)
+        canvas_->SetPixelHDR(x, y, x * 500, y * 500, 12345);
+  }
+private:
+  FrameCanvas *const canvas_;
+};
+
+class SetPixelHDRToBitplaneBench : public Bench {
+public:
+  SetPixelHDRToBitplaneBench(Framebuffer *fb) : fb_(fb) {}
+  virtual void Run() {
+    const int w = fb_->width();
+    const int h = fb_->height();
+    for (int y = 0; y < h; ++y)
+      for (int x = 0; x < w; ++x)
+        fb_->SetPixelHDR_tobp(x, y, x * 500, y * 500, 12345);
+  }
+private:
+  Framebuffer *const fb_;
+};
+
+class PrepareDumpBench : public Bench {
+public:
+  PrepareDumpBench(Framebuffer *fb, uint16_t *r, uint16_t *g, uint16_t *b,
+                   void **tiles, int tiles_w, int tiles_h,
+                   const uint16_t *curve = NULL,
+                   const TileLayer *layers = NULL, int layer_count = 0)
+    : fb_(fb), r_(r), g_(g), b_(b),
+      tiles_(tiles), tiles_w_(tiles_w), tiles_h_(tiles_h), curve_(curve),
+      layers_(layers), layer_count_(layer_count) {}
+  virtual void Run() {
+    fb_->PrepareDump(r_, g_, b_, tiles_, tiles_w_, tiles_h_,
+                     layers_, layer_count_, curve_);
+  }
+private:
+  Framebuffer *const fb_;
+  uint16_t *const r_, *const g_, *const b_;
+  void **const tiles_;
+  const int tiles_w_, tiles_h_;
+  const uint16_t *const curve_;
+  const TileLayer *const layers_;
+  const int layer_count_;
+};
+
+class DumpToMatrixBench : public Bench {
+public:
+  DumpToMatrixBench(Framebuffer *fb, GPIO *io) : fb_(fb), io_(io) {}
+  virtual void Run() { fb_->DumpToMatrix(io_, 0); }
+private:
+  Framebuffer *const fb_;
+  GPIO *const io_;
+};
+
+class RefreshBench : public Bench {
+public:
+  RefreshBench(Bench *prepare, Bench *dump) : prepare_(prepare), dump_(dump) {}
+  virtual void Run() { prepare_->Run(); dump_->Run(); }
+private:
+  Bench *const prepare_;
+  Bench *const dump_;
+};
+
+static void RunGeometry(const Geometry &g, GPIO *io) {
+  printf("\n%s\n", g.name);
+  RGBMatrix::Options options;
+  options.hardware_mapping = "regular";
+  options.rows = g.rows;
+  options.cols = g.cols;
+  options.chain_length = g.chain_length;
+  options.parallel = g.parallel;
+  options.multiplexing = g.multiplexing;
+  options.disable_hardware_pulsing = true;
+
+  // The canvas as programs see it.
+  RGBMatrix *matrix = new RGBMatrix(NULL, options);
+  FrameCanvas *canvas = matrix->CreateFrameCanvas();
+  const int pixels = canvas->width() * canvas->height();
+  Report("FrameCanvas::Fill", FillBench(canvas).Measure(), pixels);
+  Report("FrameCanvas::SetPixelHDR", SetPixelHDRBench(canvas).Measure(),
+         pixels);
+
+  // The framebuffer the refresh thread works on, set up like RGBMatrix does.
+  int rows = g.rows;
+  int cols = g.cols;
+  const MultiplexMapper *mux = NULL;
+  if (g.multiplexing > 0) {
+    mux = GetRegisteredMultiplexMappers()[g.multiplexing - 1];
+    mux->EditColsRows(&cols, &rows);
+  }
+  delete Framebuffer::SetOutputEnablePulser(NULL);  // Re-initialize GPIO.
+  Framebuffer::InitGPIO(io, rows, g.parallel, false,
+                        options.pwm_lsb_nanoseconds, 0, 0);
+  delete Framebuffer::SetOutputEnablePulser(new NoOpPinPulser());
+
+  PixelDesignatorMap *map = NULL;
+  Framebuffer *fb = new Framebuffer(rows, cols * g.chain_length, g.parallel,
+                                    0, "RGB", false, &map);
+  if (mux) ApplyMapper(mux, &map);
+  Report("Framebuffer::SetPixelHDR_tobp",
+         SetPixelHDRToBitplaneBench(fb).Measure(), pixels);
+
+  // Big enough for either the visible or the physical size.
+  const int physical = rows * g.parallel * cols * g.chain_length;
+  const int planar_size = std::max(pixels, physical);
+  std::vector<uint16_t> r(planar_size, 1000), gr(planar_size, 2000),
+    b(planar_size, 3000);
+  PrepareDumpBench planar(fb, &r[0], &gr[0], &b[0], NULL, 0, 0);
+  Report("PrepareDump (planar)", planar.Measure(), pixels);
+
+  // Tiles as the UDP receiver gets them: 16x16 pixels, interleaved RGB.
+  const int tiles_w = canvas->width() / 16;
+  const int tiles_h = canvas->height() / 16;
+  std::vector<uint16_t> tile_data(tiles_w * tiles_h * 16 * 16 * 3);
+  for (size_t i = 0; i < tile_data.size(); ++i) tile_data[i] = i * 37;
+  std::vector<void*> tiles(tiles_w * tiles_h);
+  for (int i = 0; i < tiles_w * tiles_h; ++i)
+    tiles[i] = &tile_data[i * 16 * 16 * 3];
+  PrepareDumpBench tiled(fb, &r[0], &gr[0], &b[0], &tiles[0],
+                         tiles_w, tiles_h);
+  Report("PrepareDump (tile pointers)", tiled.Measure(), pixels);
+  uint16_t *curve = Framebuffer::CreateOutputCurve(50, 2.2f);
+  PrepareDumpBench curved(fb, &r[0], &gr[0], &b[0], &tiles[0],
+                          tiles_w, tiles_h, curve);
+  Report("PrepareDump (tiles, output curve)", curved.Measure(), pixels);
+  delete[] curve;
+
+  // An empty layer and a keyed ticker along the bottom row of tiles.
+  std::vector<void*> no_tiles(tiles_w * tiles_h, (void*)NULL);
+  std::vector<void*> ticker(tiles_w * tiles_h, (void*)NULL);
+  for (int i = (tiles_h - 1) * tiles_w; i < tiles_w * tiles_h; ++i)
+    ticker[i] = tiles[i];
+  TileLayer layers[2];
+  layers[0].tiles = &no_tiles[0];
+  layers[0].blend = TileLayer::kReplace;
+  layers[1].tiles = &ticker[0];
+  layers[1].blend = TileLayer::kKeyed;
+  PrepareDumpBench empty_layer(fb, &r[0], &gr[0], &b[0], &tiles[0],
+                               tiles_w, tiles_h, NULL, layers, 1);
+  Report("PrepareDump (tiles, empty layer)", empty_layer.Measure(), pixels);
+  PrepareDumpBench ticker_layer(fb, &r[0], &gr[0], &b[0], &tiles[0],
+                                tiles_w, tiles_h, NULL, layers, 2);
+  Report("PrepareDump (tiles, keyed ticker)", ticker_layer.Measure(), pixels);
+
+  DumpToMatrixBench dump(fb, io);
+  const double dump_seconds = dump.Measure();
+  Report("DumpToMatrix (11 bits, no-op GPIO)", dump_seconds, pixels);
+
+  const double refresh_seconds = RefreshBench(&tiled, &dump).Measure();
+  Report("Refresh (tiles + DumpToMatrix)", refresh_seconds, pixels);
+  printf("  %-36s %9.0f refreshes/s\n", "", 1 / refresh_seconds);
+  printf("  %-36s %9.0f refreshes/s\n", "DumpToMatrix only", 1 / dump_seconds);
+
+  delete fb;
+  delete map;
+  delete matrix;
+
+  // Setting up the multiplex mappings; done once at startup, but it is
+  // good to know if something went quadratic.
+  const MuxMapperList &muxers = GetRegisteredMultiplexMappers();
+  for (size_t i = 0; i < muxers.size(); ++i) {
+    RGBMatrix::Options mux_options = options;
+    mux_options.multiplexing = 0;
+    muxers[i]->EditColsRows(&mux_options.cols, &mux_options.rows);
+    if (!mux_options.Validate(NULL)) {
+      printf("  ApplyPixelMapper(%s): does not fit geometry.\n",
+             muxers[i]->GetName());
+      continue;
+    }
+    RGBMatrix *mux_matrix = new RGBMatrix(NULL, mux_options);
+    const double start = Now();
+    mux_matrix->ApplyPixelMapper(muxers[i]);
+    const double elapsed = Now() - start;
+    char name[64];
+    snprintf(name, sizeof(name), "ApplyPixelMapper(%s)", muxers[i]->GetName());
+    Report(name, elapsed, pixels);
+    delete mux_matrix;
+  }
+}
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  // Output goes here instead of the GPIO registers.
+  static uint32_t registers[1024];
+  GPIO io;
+  io.InitWithRegisterMemory(registers);
+  Framebuffer::InitHardwareMapping("regular");
+
+  for (size_t i = 0; i < sizeof(kGeometries) / sizeof(kGeometries[0]); ++i) {
+    RunGeometry(kGeometries[i], &io);
+  }
+  return 0;
+}
@@ -17,12 +17,14 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <vector>
 
 #include "hardware-mapping.h"
 
 namespace rgb_matrix {
 class GPIO;
 class PinPulser;
+struct TileLayer;
 namespace internal {
 class RowAddressSetter;
 
@@ -75,6 +77,24 @@ public:
                        int dither_bits,
                        int row_address_type);
 
+  // The bitplane timings for the given LSB time and dither bits. This can
+  // be prepared in any thread, but only be switched to by the refresh
+  // thread between refreshes with SetOutputEnableTimings().
+  static std::vector<int> OutputEnableTimings(int pwm_lsb_nanoseconds,
+                                              int dither_bits);
+
+  // Change the timings of the pulser InitGPIO() created. It keeps its
+  // hardware set up: after dropping privileges, it couldn't be again.
+  static void SetOutputEnableTimings(const std::vector<int> &timings);
+
+  // Lookup table PrepareDump() maps the 16 bit values through: indexed by
+  // the value shifted right by kOutputCurveShift, so it stays small enough
+  // for the cache. Returns NULL for brightness 100 and gamma 1, which need
+  // no table. Slow; prepare it outside the refresh thread. Free with
+  // delete[].
+  static const int kOutputCurveShift = 4;
+  static uint16_t *CreateOutputCurve(uint8_t brightness, float gamma);
+
   // Set PWM bits used for output. Default is 11, but if you only deal with
   // simple comic-colors, 1 might be sufficient. Lower require less CPU.
   // Returns boolean to signify if value was within range.
@@ -92,6 +112,9 @@ public:
   }
   uint8_t brightness() { return brightness_; }
 
+  // The "layers" are composited over the tiles, bottom first; tiles no
+  // layer covers go straight from the frame. "curve", if not NULL, is from
+  // CreateOutputCurve().
   void PrepareDump(
     uint16_t *color_r_,
     uint16_t *color_g_,
@@ -99,7 +122,10 @@ public:
 
     void** tileptrs_,
     int tileptrs_w_,
-    int tileptrs_h_
+    int tileptrs_h_,
+    const TileLayer *layers,
+    int layer_count,
+    const uint16_t *curve
   );
 
   void DumpToMatrix(GPIO *io, int pwm_bits_to_show);
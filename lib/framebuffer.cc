@@ -18,6 +18,7 @@
 // to manipulate the content.
 
 #include "framebuffer-internal.h"
+#include "led-matrix.h"
 
 #include <assert.h>
 #include <ctype.h>
@@ -336,15 +337,47 @@ Framebuffer::~Framebuffer() {
   const uint32_t result = io->InitOutputs(all_used_bits, is_some_adafruit_hat);
   assert(result == all_used_bits);  // Impl: all bits declared in gpio.cc ?
 
+  sOutputEnablePulser = PinPulser::Create(io, h.output_enable,
+                                          allow_hardware_pulsing,
+                                          OutputEnableTimings(
+                                            pwm_lsb_nanoseconds,
+                                            dither_bits));
+}
+
+/* static */ std::vector<int> Framebuffer::OutputEnableTimings(
+  int pwm_lsb_nanoseconds, int dither_bits) {
   std::vector<int> bitplane_timings;
   uint32_t timing_ns = pwm_lsb_nanoseconds;
   for (int b = 0; b < kBitPlanes; ++b) {
     bitplane_timings.push_back(timing_ns);
     if (b >= dither_bits) timing_ns *= 2;
   }
-  sOutputEnablePulser = PinPulser::Create(io, h.output_enable,
-                                          allow_hardware_pulsing,
-                                          bitplane_timings);
+  return bitplane_timings;
+}
+
+/* static */ void Framebuffer::SetOutputEnableTimings(
+  const std::vector<int> &timings) {
+  if (sOutputEnablePulser == NULL) return;
+  // The last pulse of the previous refresh might still be going on.
+  sOutputEnablePulser->WaitPulseFinished();
+  sOutputEnablePulser->SetTimings(timings);
+}
+
+/* static */ uint16_t *Framebuffer::CreateOutputCurve(uint8_t brightness,
+                                                      float gamma) {
+  if (brightness == 0) brightness = 1;
+  if (brightness > 100) brightness = 100;
+  if (brightness == 100 && gamma == 1.0f) return NULL;
+  const int entries = 65536 >> kOutputCurveShift;
+  uint16_t *curve = new uint16_t[entries];
+  for (int i = 0; i < entries; ++i) {
+    // The middle of the values the entry stands for.
+    const float in = ((i << kOutputCurveShift)
+                      + (1 << kOutputCurveShift) / 2) / 65535.0f;
+    const float out = 65535.0f * brightness / 100.0f * powf(in, gamma);
+    curve[i] = out < 65535.0f ? (uint16_t)out : 65535;
+  }
+  return curve;
 }
 
 bool Framebuffer::SetPWMBits(uint8_t value) {
@@ -417,7 +450,7 @@ inline void Framebuffer::MapColors(
 int Framebuffer::width() const { return (*shared_mapper_)->width(); }
 int Framebuffer::height() const { return (*shared_mapper_)->height(); }
 
-inline void Framebuffer::SetPixelHDR_tobp(int x, int y, uint16_t red, uint16_t green, uint16_t blue) {
+void Framebuffer::SetPixelHDR_tobp(int x, int y, uint16_t red, uint16_t green, uint16_t blue) {
   
   //static int n = 0;
   //n = (n+x+y+(rand()&3))&31;
@@ -555,6 +588,12 @@ void Framebuffer::CopyFrom(const Framebuffer *other) {
   memcpy(bitplane_buffer_, other->bitplane_buffer_, buffer_size_);
 }
 
+static const int kTileValues = 16 * 16 * 3;
+
+static inline const uint16_t *LayerTile(const TileLayer &layer, int index) {
+  return layer.tiles ? (const uint16_t *)layer.tiles[index] : NULL;
+}
+
 void Framebuffer::PrepareDump(
   uint16_t *color_r_,
   uint16_t *color_g_,
@@ -564,7 +603,10 @@ void Framebuffer::PrepareDump(
 
   void** tileptrs_,
   int tileptrs_w_,
-  int tileptrs_h_
+  int tileptrs_h_,
+  const TileLayer *layers,
+  int layer_count,
+  const uint16_t *curve
 ) {
 
 #if 0
@@ -584,8 +626,9 @@ void Framebuffer::PrepareDump(
 #endif
 
 #if 1
-  if (tileptrs_)
+  if (tileptrs_ || layer_count > 0)
   {
+    uint16_t composite[kTileValues];
     for (int ty = 0; ty < tileptrs_h_; ty++)
     {
 #if 0
@@ -599,7 +642,60 @@ void Framebuffer::PrepareDump(
 #endif
       for (int tx = 0; tx < tileptrs_w_; tx++)
       {
-        uint16_t* tiledata = (uint16_t *)tileptrs_[ty * tileptrs_w_ + tx];
+        const int index = ty * tileptrs_w_ + tx;
+        const uint16_t* tiledata =
+          tileptrs_ ? (const uint16_t *)tileptrs_[index] : NULL;
+
+        // Layers only cost something where they have tiles. Below the
+        // topmost kReplace tile, nothing needs to be looked at.
+        int first = -1;
+        for (int l = layer_count - 1; l >= 0; l--) {
+          if (LayerTile(layers[l], index)) {
+            first = l;
+            if (layers[l].blend == TileLayer::kReplace) break;
+          }
+        }
+        if (first >= 0)
+        {
+          int l = first;
+          const uint16_t *below = tiledata;
+          if (layers[first].blend == TileLayer::kReplace)
+            below = LayerTile(layers[l++], index);
+          int above = l;
+          while (above < layer_count && !LayerTile(layers[above], index))
+            above++;
+
+          if (above == layer_count)
+          {
+            tiledata = below;    // A kReplace tile with nothing over it.
+          }
+          else
+          {
+            if (below)
+            {
+              memcpy(composite, below, sizeof(composite));
+            }
+            else
+            {
+              for (int y = 0; y < 16; y++)
+                for (int x = 0; x < 16; x++)
+                {
+                  const int offu = (y+ty*16)*columns_+(x+tx*16);
+                  composite[(y*16+x)*3+0] = color_r_[offu];
+                  composite[(y*16+x)*3+1] = color_g_[offu];
+                  composite[(y*16+x)*3+2] = color_b_[offu];
+                }
+            }
+            for (; l < layer_count; l++)
+            {
+              const uint16_t *tile = LayerTile(layers[l], index);
+              if (tile)
+                layers[l].Draw(tile, composite);
+            }
+            tiledata = composite;
+          }
+        }
+
         if (tiledata)
         {
           for (int y = 0; y < 16; y++)
@@ -609,6 +705,12 @@ void Framebuffer::PrepareDump(
               uint16_t r = tiledata[offu+0];
               uint16_t g = tiledata[offu+1];
               uint16_t b = tiledata[offu+2];
+              if (curve)
+              {
+                r = curve[r >> kOutputCurveShift];
+                g = curve[g >> kOutputCurveShift];
+                b = curve[b >> kOutputCurveShift];
+              }
       
               SetPixelHDR_tobp(x+tx*16, y+ty*16, r, g, b);
               //SetPixelHDR_tobp(x, y, x*2, y*2, 0);
@@ -621,8 +723,17 @@ void Framebuffer::PrepareDump(
            for (int x = 0; x < 16; x++)
            {
              int offu = (y+ty*16)*columns_+(x+tx*16);
-
-             SetPixelHDR_tobp((x+tx*16), (y+ty*16), color_r_[offu], color_g_[offu], color_b_[offu]);
+             uint16_t r = color_r_[offu];
+             uint16_t g = color_g_[offu];
+             uint16_t b = color_b_[offu];
+             if (curve)
+             {
+               r = curve[r >> kOutputCurveShift];
+               g = curve[g >> kOutputCurveShift];
+               b = curve[b >> kOutputCurveShift];
+             }
+
+             SetPixelHDR_tobp((x+tx*16), (y+ty*16), r, g, b);
            }
 
         }
@@ -638,8 +749,17 @@ void Framebuffer::PrepareDump(
      for (int x = 0; x < columns_; x++)
      {
        int offu = y*columns_+x;
+        uint16_t r = color_r_[offu];
+        uint16_t g = color_g_[offu];
+        uint16_t b = color_b_[offu];
+        if (curve)
+        {
+          r = curve[r >> kOutputCurveShift];
+          g = curve[g >> kOutputCurveShift];
+          b = curve[b >> kOutputCurveShift];
+        }
 
-        SetPixelHDR_tobp(x, y, color_r_[offu], color_g_[offu], color_b_[offu]);
+        SetPixelHDR_tobp(x, y, r, g, b);
         //SetPixelHDR_tobp(x, y, x*2, 1000+sin(y*0.5f+off)*1000, 0);
       }
   }
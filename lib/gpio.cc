@@ -17,6 +17,7 @@
 #include <inttypes.h>
 
 #include "gpio.h"
+#include "thread.h"
 
 #include <assert.h>
 #include <fcntl.h>
@@ -34,14 +35,14 @@
  * we substract this value whenever we do nanosleep(); the remaining time
  * we then busy wait to get a good accurate result.
  *
- * You can measure the overhead using DEBUG_SLEEP_JITTER below.
+ * This is only the starting point: at startup, we measure the actual
+ * overshoot distribution of nanosleep() and keep recording it while running,
+ * so the allowance follows what the kernel actually does (see
+ * Timers::Calibrate() and RecalibrateTiming()).
  *
  * Note: A higher value here will result in more CPU use because of more busy
  * waiting inching towards the real value (for all the cases that nanosleep()
  * actually was better than this overhead).
- *
- * This might be interesting to tweak in particular if you have a realtime
- * kernel with different characteristics.
  */
 #define EMPIRICAL_NANOSLEEP_OVERHEAD_US 25
 
@@ -54,15 +55,14 @@
  * or Pi Zeros. They rely for us to sleep when possible for it to do work.
  * So we only enable it, if we have have a newer Pi where we anyway burn
  * away on one core (And are isolated there with isolcpus=3).
+ *
+ * Once calibrated, the same choice is made between the measured 99.9%-ile
+ * and 99.999%-ile.
  */
 #define EMPIRICAL_NANOSLEEP_EXTRA_OVERHEAD_US 35
 
-/* In order to determine useful values for above, set this to 1 and use the
- * hardware pin-pulser.
- * It will output a histogram atexit() of how much how often we were over
- * the requested time.
- * (The full histogram will be shifted by the EMPIRICAL_NANOSLEEP_OVERHEAD_US
- *  value above. To get a full histogram of OS overhead, set it to 0 first).
+/* If set to 1, outputs the measured nanosleep() overshoot histogram atexit()
+ * (how much how often we were over the requested time).
  */
 #define DEBUG_SLEEP_JITTER 0
 
@@ -189,12 +189,20 @@ static bool IsRaspberryPi2() {
   return ispi2;
 }
 
-static uint32_t JitterAllowanceMicroseconds() {
-  // If this is a Raspberry Pi2 or 3, we can allow to burn a bit more busy-wait
-  // CPU cycles to get the timing accurate as we have more CPU to spare.
-  static int allowance_us = EMPIRICAL_NANOSLEEP_OVERHEAD_US
-    + (IsRaspberryPi2() ? EMPIRICAL_NANOSLEEP_EXTRA_OVERHEAD_US : 0);
-  return allowance_us;
+// The nanosleep() jitter allowance currently in use. Starts out with the
+// empirical values above and is replaced by the measured one whenever we
+// calibrate.
+static int jitter_allowance_us = -1;
+
+static int JitterAllowanceMicroseconds() {
+  if (jitter_allowance_us < 0) {
+    // If this is a Raspberry Pi2 or 3, we can allow to burn a bit more
+    // busy-wait CPU cycles to get the timing accurate as we have more CPU to
+    // spare.
+    jitter_allowance_us = EMPIRICAL_NANOSLEEP_OVERHEAD_US
+      + (IsRaspberryPi2() ? EMPIRICAL_NANOSLEEP_EXTRA_OVERHEAD_US : 0);
+  }
+  return jitter_allowance_us;
 }
 
 static uint32_t *mmap_bcm_register(bool isRPi2, off_t register_offset) {
@@ -237,6 +245,18 @@ bool GPIO::Init(int slowdown) {
   return true;
 }
 
+bool GPIO::InitWithRegisterMemory(volatile uint32_t *registers,
+                                  int slowdown) {
+  slowdown_ = slowdown;
+  gpio_port_ = registers;
+  if (gpio_port_ == NULL) {
+    return false;
+  }
+  gpio_set_bits_ = gpio_port_ + (0x1C / sizeof(uint32_t));
+  gpio_clr_bits_ = gpio_port_ + (0x28 / sizeof(uint32_t));
+  return true;
+}
+
 /*
  * We support also other pinouts that don't have the OE- on the hardware
  * PWM output pin, so we need to provide (impefect) 'manual' timing as well.
@@ -250,6 +270,11 @@ class Timers {
 public:
   static bool Init();
   static void sleep_nanos(long t);
+
+  // Measure the busy-loop speed and derive the jitter allowance from the
+  // nanosleep() overshoot histogram. At startup, this also takes a couple of
+  // nanosleep() samples first, as we don't have any yet.
+  static void Calibrate(bool startup);
 };
 
 // Simplest of PinPulsers. Uses somewhat jittery and manual timers
@@ -266,10 +291,15 @@ public:
     io_->SetBits(bits_);
   }
 
+  virtual void SetTimings(const std::vector<int> &nano_specs) {
+    for (size_t i = 0; i < nano_specs_.size(); ++i)
+      nano_specs_[i] = nano_specs[i];
+  }
+
 private:
   GPIO *const io_;
   const uint32_t bits_;
-  const std::vector<int> nano_specs_;
+  std::vector<int> nano_specs_;
 };
 
 static bool LinuxHasModuleLoaded(const char *name) {
@@ -290,10 +320,57 @@ static bool LinuxHasModuleLoaded(const char *name) {
 
 static volatile uint32_t *timer1Mhz = NULL;
 
+static void busy_loop_rpi_1(uint32_t loops);
+static void busy_loop_rpi_2(uint32_t loops);
 static void sleep_nanos_rpi_1(long nanos);
 static void sleep_nanos_rpi_2(long nanos);
+static void (*busy_loop_impl)(uint32_t) = busy_loop_rpi_1;
 static void (*busy_sleep_impl)(long) = sleep_nanos_rpi_1;
 
+// Busy loop iterations per nanosecond, fixed point with 10 bits fraction.
+// Starts out with what was determined empirically on a 700Mhz RPi
+// (4ns per loop) and is measured in Timers::Calibrate().
+static uint32_t busy_loops_per_ns_q10 = 256;
+
+// Histogram of how much longer than requested nanosleep() actually took,
+// in microseconds. This is what we derive the jitter allowance from.
+// Only written by the thread doing the sleeping (the refresh thread); decays
+// with every calibration so that it follows changing conditions.
+static const int kOvershootBuckets = 256;
+static uint32_t overshoot_histogram_us[kOvershootBuckets] = {0};
+
+// We need at least that many samples to trust the higher percentiles.
+static const uint32_t kMinOvershootSamples = 1000;
+
+static Mutex calibration_lock;
+static TimingCalibration last_calibration;  // Guarded by calibration_lock
+static bool timers_initialized = false;
+
+static inline void RecordOvershoot(int overshoot_us) {
+  if (overshoot_us < 0) overshoot_us = 0;
+  if (overshoot_us >= kOvershootBuckets) overshoot_us = kOvershootBuckets - 1;
+  // Only one thread writes, but GetNanosleepOvershootHistogram() reads.
+  __atomic_store_n(&overshoot_histogram_us[overshoot_us],
+                   overshoot_histogram_us[overshoot_us] + 1, __ATOMIC_RELAXED);
+}
+
+// Smallest overshoot value that covers the given fraction of samples.
+static int OvershootPercentile(uint64_t total, double fraction) {
+  const uint64_t needed = (uint64_t) (total * fraction);
+  uint64_t running_count = 0;
+  for (int us = 0; us < kOvershootBuckets; ++us) {
+    running_count += overshoot_histogram_us[us];
+    if (running_count >= needed && running_count > 0) return us;
+  }
+  return kOvershootBuckets - 1;
+}
+
+static int64_t MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 // By default, the kernel applies some throtteling for realtime
 // threads to prevent starvation of non-RT threads. But we
 // really want all we can get iff the machine has more cores and
@@ -308,6 +385,7 @@ static void DisableRealtimeThrottling() {
 }
 
 bool Timers::Init() {
+  if (timers_initialized) return true;  // Multiple PinPulsers share these.
   const bool isRPi2 = IsRaspberryPi2();
   uint32_t *timereg = mmap_bcm_register(isRPi2, COUNTER_1Mhz_REGISTER_OFFSET);
   if (timereg == NULL) {
@@ -315,11 +393,80 @@ bool Timers::Init() {
   }
   timer1Mhz = timereg + 1;
 
+  busy_loop_impl = isRPi2 ? busy_loop_rpi_2 : busy_loop_rpi_1;
   busy_sleep_impl = isRPi2 ? sleep_nanos_rpi_2 : sleep_nanos_rpi_1;
+  if (isRPi2) busy_loops_per_ns_q10 = 931;  // 1.1ns on a 900Mhz RPi 2
   if (isRPi2) DisableRealtimeThrottling();
+  Calibrate(true);
+  timers_initialized = true;
   return true;
 }
 
+void Timers::Calibrate(bool startup) {
+  // Busy loop speed. Take the fastest of a couple of runs; the slower ones
+  // were interrupted.
+  const uint32_t kLoops = startup ? 200000 : 20000;
+  int64_t best_nanos = -1;
+  for (int run = 0; run < (startup ? 5 : 2); ++run) {
+    const int64_t start = MonotonicNanos();
+    busy_loop_impl(kLoops);
+    const int64_t duration = MonotonicNanos() - start;
+    if (duration > 0 && (best_nanos < 0 || duration < best_nanos))
+      best_nanos = duration;
+  }
+  if (best_nanos > 0) {
+    busy_loops_per_ns_q10 = (uint32_t) (((int64_t) kLoops << 10) / best_nanos);
+  }
+
+  // At startup, we don't have any real-world nanosleep() overshoot yet, so
+  // sample a couple of short sleeps. Takes a few dozen milliseconds.
+  if (startup) {
+    for (int i = 0; i < 250; ++i) {
+      const int kRequestUs = 50;
+      struct timespec sleep_time = { 0, kRequestUs * 1000 };
+      const int64_t start = MonotonicNanos();
+      nanosleep(&sleep_time, NULL);
+      RecordOvershoot((MonotonicNanos() - start) / 1000 - kRequestUs);
+    }
+  }
+
+  uint64_t total = 0;
+  int max_us = 0;
+  for (int us = 0; us < kOvershootBuckets; ++us) {
+    total += overshoot_histogram_us[us];
+    if (overshoot_histogram_us[us]) max_us = us;
+  }
+
+  TimingCalibration result;
+  result.busy_loop_picoseconds = busy_loops_per_ns_q10
+    ? (int) ((1000 << 10) / busy_loops_per_ns_q10) : 0;
+  result.nanosleep_overshoot_p50_us = OvershootPercentile(total, 0.5);
+  result.nanosleep_overshoot_p999_us = OvershootPercentile(total, 0.999);
+  result.nanosleep_overshoot_max_us = max_us;
+  result.nanosleep_samples = total;
+
+  // Same trade-off as with the empirical values: on multi-core Pis we
+  // busy-wait for the 99.999%-ile, otherwise for the 99.9%-ile.
+  // With too few samples, the startup sampling has to do.
+  if (startup || total >= kMinOvershootSamples) {
+    const int allowance = IsRaspberryPi2()
+      ? OvershootPercentile(total, 0.99999)
+      : result.nanosleep_overshoot_p999_us;
+    jitter_allowance_us = allowance + 1;  // Round up partial microseconds.
+  }
+  result.jitter_allowance_us = JitterAllowanceMicroseconds();
+
+  // Let older samples fade out, so that we adapt to changing conditions.
+  if (total >= 2 * kMinOvershootSamples) {
+    for (int us = 0; us < kOvershootBuckets; ++us)
+      overshoot_histogram_us[us] /= 2;
+  }
+
+  MutexLock l(&calibration_lock);
+  result.calibration_count = last_calibration.calibration_count + 1;
+  last_calibration = result;
+}
+
 void Timers::sleep_nanos(long nanos) {
   // For smaller durations, we go straight to busy wait.
 
@@ -328,20 +475,21 @@ void Timers::sleep_nanos(long nanos) {
   // However, these timings have a lot of jitter, so we do a two way
   // approach: we use nanosleep(), but for some shorter time period so
   // that we can tolerate some jitter (also, we need at least an offset of
-  // EMPIRICAL_NANOSLEEP_OVERHEAD_US as the nanosleep implementations on RPi
+  // the jitter allowance as the nanosleep implementations on RPi
   // actually have such offset).
   //
   // We use the global 1Mhz hardware timer to measure the actual time period
   // that has passed, and then inch forward for the remaining time with
   // busy wait.
-  static long kJitterAllowanceNanos = JitterAllowanceMicroseconds() * 1000;
-  if (nanos > kJitterAllowanceNanos + 5000) {
+  const long jitter_allowance_nanos = JitterAllowanceMicroseconds() * 1000;
+  if (nanos > jitter_allowance_nanos + 5000) {
     const uint32_t before = *timer1Mhz;
     struct timespec sleep_time
-      = { 0, nanos - kJitterAllowanceNanos };
+      = { 0, nanos - jitter_allowance_nanos };
     nanosleep(&sleep_time, NULL);
     const uint32_t after = *timer1Mhz;
     const long nanoseconds_passed = 1000 * (uint32_t)(after - before);
+    RecordOvershoot((nanoseconds_passed - sleep_time.tv_nsec) / 1000);
     if (nanoseconds_passed > nanos) {
       return;  // darn, missed it.
     } else {
@@ -352,32 +500,38 @@ void Timers::sleep_nanos(long nanos) {
   busy_sleep_impl(nanos);
 }
 
-static void sleep_nanos_rpi_1(long nanos) {
-  if (nanos < 70) return;
-  // The following loop is determined empirically on a 700Mhz RPi
-  for (uint32_t i = (nanos - 70) >> 2; i != 0; --i) {
+static void busy_loop_rpi_1(uint32_t loops) {
+  for (uint32_t i = loops; i != 0; --i) {
     asm("nop");
   }
 }
 
-static void sleep_nanos_rpi_2(long nanos) {
-  if (nanos < 20) return;
-  // The following loop is determined empirically on a 900Mhz RPi 2
-  for (uint32_t i = (nanos - 20) * 100 / 110; i != 0; --i) {
+static void busy_loop_rpi_2(uint32_t loops) {
+  for (uint32_t i = loops; i != 0; --i) {
     asm("");
   }
 }
 
+static void sleep_nanos_rpi_1(long nanos) {
+  if (nanos < 70) return;
+  busy_loop_rpi_1(((int64_t) (nanos - 70) * busy_loops_per_ns_q10) >> 10);
+}
+
+static void sleep_nanos_rpi_2(long nanos) {
+  if (nanos < 20) return;
+  busy_loop_rpi_2(((int64_t) (nanos - 20) * busy_loops_per_ns_q10) >> 10);
+}
+
 #if DEBUG_SLEEP_JITTER
-static int overshoot_histogram_us[256] = {0};
 static void print_overshoot_histogram() {
-  fprintf(stderr, "Overshoot histogram >= empirical overhead of %dus\n"
+  fprintf(stderr, "nanosleep() overshoot histogram (allowance now %dus)\n"
           "%6s | %7s | %7s\n",
           JitterAllowanceMicroseconds(), "usec", "count", "accum");
   int total_count = 0;
-  for (int i = 0; i < 256; ++i) total_count += overshoot_histogram_us[i];
+  for (int i = 0; i < kOvershootBuckets; ++i)
+    total_count += overshoot_histogram_us[i];
   int running_count = 0;
-  for (int us = 0; us < 256; ++us) {
+  for (int us = 0; us < kOvershootBuckets; ++us) {
     const int count = overshoot_histogram_us[us];
     if (count > 0) {
       running_count += count;
@@ -401,7 +555,7 @@ public:
   }
 
   HardwarePinPulser(uint32_t pins, const std::vector<int> &specs)
-    : triggered_(false) {
+    : divider_(0), clock_initialized_(false), triggered_(false) {
     assert(CanHandle(pins));
 #if DEBUG_SLEEP_JITTER
     atexit(print_overshoot_histogram);
@@ -420,12 +574,10 @@ public:
       exit(1);
     }
 
-    for (size_t i = 0; i < specs.size(); ++i) {
-      // Hints how long to nanosleep, already corrected for system overhead.
-      sleep_hints_.push_back(specs[i] / 1000 - JitterAllowanceMicroseconds());
-    }
+    pulse_us_.resize(specs.size());
+    pwm_range_.resize(specs.size());
+    SetTimings(specs);
 
-    const int base = specs[0];
     // Get relevant registers
     const bool isPI2 = IsRaspberryPi2();
     volatile uint32_t *gpioReg = mmap_bcm_register(isPI2, GPIO_REGISTER_OFFSET);
@@ -435,13 +587,38 @@ public:
     assert((clk_reg_ != NULL) && (pwm_reg_ != NULL));  // init error.
 
     SetGPIOMode(gpioReg, 18, 2); // set GPIO 18 to PWM0 mode (Alternative 5)
-    InitPWMDivider((base/2) / PWM_BASE_TIME_NS);
-    for (size_t i = 0; i < specs.size(); ++i) {
-      pwm_range_.push_back(2 * specs[i] / base);
+    munmap((void*) gpioReg, REGISTER_BLOCK_SIZE);
+  }
+
+  virtual ~HardwarePinPulser() {
+    munmap((void*) pwm_reg_, REGISTER_BLOCK_SIZE);
+    munmap((void*) clk_reg_, REGISTER_BLOCK_SIZE);
+  }
+
+  virtual void SetTimings(const std::vector<int> &specs) {
+    for (size_t i = 0; i < pulse_us_.size(); ++i) {
+      // Pulse length in microseconds. Corrected for system overhead when
+      // used, as the jitter allowance can change while running.
+      pulse_us_[i] = specs[i] / 1000;
+    }
+
+    // The PWM clock is only set up with the next pulse.
+    const int base = specs[0];
+    const uint32_t divider = (base/2) / PWM_BASE_TIME_NS;
+    if (divider != divider_) {
+      divider_ = divider;
+      clock_initialized_ = false;
+    }
+    for (size_t i = 0; i < pwm_range_.size(); ++i) {
+      pwm_range_[i] = 2 * specs[i] / base;
     }
   }
 
   virtual void SendPulse(int c) {
+    if (!clock_initialized_) {
+      InitPWMDivider(divider_);
+      clock_initialized_ = true;
+    }
     if (pwm_range_[c] < 16) {
       pwm_reg_[PWM_RNG1] = pwm_range_[c];
 
@@ -480,7 +657,8 @@ public:
      */
     *fifo_ = 0;
 
-    sleep_hint_ = sleep_hints_[c];
+    // Hint how long to nanosleep, corrected for system overhead.
+    sleep_hint_ = pulse_us_[c] - JitterAllowanceMicroseconds();
     start_time_ = *timer1Mhz;
     triggered_ = true;
     pwm_reg_[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_PWEN1 | PWM_CTL_POLA1;
@@ -501,18 +679,11 @@ public:
         struct timespec sleep_time = { 0, 1000 * to_sleep };
         nanosleep(&sleep_time, NULL);
 
-#if DEBUG_SLEEP_JITTER
-        {
-          // Record histogram of realtime jitter how much longer we actually
-          // took.
-          const int total_us = *timer1Mhz - start_time_;
-          const int nanoslept = total_us - already_elapsed_usec;
-          int overshoot = nanoslept - (to_sleep + JitterAllowanceMicroseconds());
-          if (overshoot < 0) overshoot = 0;
-          if (overshoot > 255) overshoot = 255;
-          overshoot_histogram_us[overshoot]++;
-        }
-#endif
+        // Record how much longer we actually took; the jitter allowance is
+        // derived from that.
+        const int total_us = *timer1Mhz - start_time_;
+        const int nanoslept = total_us - already_elapsed_usec;
+        RecordOvershoot(nanoslept - to_sleep);
       }
     }
 
@@ -550,10 +721,12 @@ private:
 
 private:
   std::vector<uint32_t> pwm_range_;
-  std::vector<int> sleep_hints_;
+  std::vector<int> pulse_us_;
   volatile uint32_t *pwm_reg_;
   volatile uint32_t *fifo_;
   volatile uint32_t *clk_reg_;
+  uint32_t divider_;
+  bool clock_initialized_;
   uint32_t start_time_;
   int sleep_hint_;
   bool triggered_;
@@ -577,4 +750,24 @@ uint32_t GetMicrosecondCounter() {
   return timer1Mhz ? *timer1Mhz : 0;
 }
 
+void RecalibrateTiming() {
+  if (!timers_initialized) return;
+  Timers::Calibrate(false);
+}
+
+void GetNanosleepOvershootHistogram(uint32_t *histogram_us, int buckets) {
+  for (int us = 0; us < buckets; ++us) {
+    histogram_us[us] = (us < kOvershootBuckets)
+      ? __atomic_load_n(&overshoot_histogram_us[us], __ATOMIC_RELAXED)
+      : 0;
+  }
+}
+
+bool GetTimingCalibration(TimingCalibration *result) {
+  if (!timers_initialized) return false;
+  MutexLock l(&calibration_lock);
+  *result = last_calibration;
+  return true;
+}
+
 } // namespace rgb_matrix
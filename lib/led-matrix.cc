@@ -15,6 +15,8 @@
 
 #include "led-matrix.h"
 
+#include <algorithm>
+
 #include <assert.h>
 #include <math.h>
 #include <pthread.h>
@@ -23,10 +25,13 @@
 #include <string.h>
 #include <time.h>
 #include <stdio.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include "gpio.h"
 #include "thread.h"
+#include "trace.h"
 #include "framebuffer-internal.h"
 #include "multiplex-mappers-internal.h"
 
@@ -52,31 +57,48 @@ namespace rgb_matrix {
 // purposes declared here (defined in gpio.cc).
 uint32_t GetMicrosecondCounter();
 
+// Timestamps handed out to users are CLOCK_MONOTONIC, so that they can be
+// compared to their own clock_gettime().
+static uint64_t MonotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 using namespace internal;
 
+static const char kTraceCategory[] = "matrix";
+
 // Pump pixels to screen. Needs to be high priority real-time because jitter
 class RGBMatrix::UpdateThread : public Thread {
 public:
   UpdateThread(GPIO *io, FrameCanvas *initial_frame,
-               int pwm_dither_bits, bool show_refresh)
-    : io_(io), show_refresh_(show_refresh), running_(true),
+               int pwm_lsb_nanoseconds, int pwm_dither_bits)
+    : io_(io), running_(true),
       current_frame_(initial_frame), next_frame_(NULL),
-      requested_frame_multiple_(1) {
+      next_from_mailbox_(false),
+      submit_sequence_(0), feedback_start_(0), feedback_count_(0),
+      vsync_eventfd_(-1), requested_frame_multiple_(1),
+      parameters_pending_(false),
+      pending_pwm_bits_(0), pending_lsb_nanoseconds_(0),
+      pending_dither_bits_(0),
+      curve_pending_(false), pending_curve_(NULL), retired_curve_(NULL),
+      forced_pwm_bits_(0), lsb_nanoseconds_(pwm_lsb_nanoseconds),
+      dither_bits_(pwm_dither_bits), curve_(NULL),
+      telemetry_sequence_(0) {
     pthread_cond_init(&frame_done_, NULL);
-    switch (pwm_dither_bits) {
-    case 0:
-      start_bit_[0] = 0; start_bit_[1] = 0;
-      start_bit_[2] = 0; start_bit_[3] = 0;
-      break;
-    case 1:
-      start_bit_[0] = 0; start_bit_[1] = 1;
-      start_bit_[2] = 0; start_bit_[3] = 1;
-      break;
-    case 2:
-      start_bit_[0] = 0; start_bit_[1] = 1;
-      start_bit_[2] = 2; start_bit_[3] = 2;
-      break;
-    }
+    // Avoid allocations in the refresh thread when frames are returned to
+    // the pool. We typically only ever have one or two in there.
+    free_frames_.reserve(8);
+    memset(&telemetry_, 0, sizeof(telemetry_));
+    SetDitherBits(pwm_dither_bits);
+  }
+
+  virtual ~UpdateThread() {
+    if (vsync_eventfd_ >= 0) close(vsync_eventfd_);
+    delete[] pending_curve_;
+    delete[] retired_curve_;
+    delete[] curve_;
   }
 
   void Stop() {
@@ -85,9 +107,12 @@ public:
   }
 
   virtual void Run() {
+    pthread_setname_np(pthread_self(), "matrix refresh");
+    // 640kB allocated in the loop on the first tracepoint would be a
+    // visible glitch.
+    if (TraceEnabled()) TracePrepareThread();
     unsigned frame_count = 0;
     unsigned low_bit_sequence = 0;
-    uint32_t largest_time = 0;
 
     // Let's start measure max time only after a we were running for a few
     // seconds to not pick up start-up glitches.
@@ -95,9 +120,26 @@ public:
     uint32_t initial_holdoff_start = GetMicrosecondCounter();
     bool max_measure_enabled = false;
 
+    // Busy-loop speed and nanosleep() jitter change with CPU frequency
+    // scaling and system load, so re-check the timing every once in a while.
+    static const uint32_t kTimingRecheckIntervalUs = 10 * 1000 * 1000;
+    uint32_t last_timing_check = initial_holdoff_start;
+
     while (running()) {
       const uint32_t start_time_us = GetMicrosecondCounter();
 
+      // Fewer PWM bits than the frame asks for: skip the lowest bitplanes.
+      uint32_t low_bit = start_bit_[low_bit_sequence % 4];
+      const int frame_pwm_bits = current_frame_->pwmbits();
+      int shown_pwm_bits = frame_pwm_bits;
+      if (forced_pwm_bits_ > 0 && forced_pwm_bits_ < frame_pwm_bits) {
+        shown_pwm_bits = forced_pwm_bits_;
+        if (low_bit < (uint32_t)(kMaxPWMBits - forced_pwm_bits_))
+          low_bit = kMaxPWMBits - forced_pwm_bits_;
+      }
+
+      const uint32_t trace_frame = current_frame_->presentation_.sequence;
+      TraceBegin(kTraceCategory, "PrepareDump", trace_frame);
       current_frame_->framebuffer()
         ->PrepareDump(
           current_frame_->color_r_,
@@ -105,12 +147,20 @@ public:
           current_frame_->color_b_,
           current_frame_->tileptrs_,
           current_frame_->tileptrs_w_,
-          current_frame_->tileptrs_h_
+          current_frame_->tileptrs_h_,
+          current_frame_->tile_layers_,
+          current_frame_->tile_layer_count_,
+          curve_
           );
+      TraceEnd(kTraceCategory, "PrepareDump", trace_frame);
 
+      TraceBegin(kTraceCategory, "DumpToMatrix", trace_frame);
       current_frame_->framebuffer()
-        ->DumpToMatrix(io_, start_bit_[low_bit_sequence % 4]);
+        ->DumpToMatrix(io_, low_bit);
+      TraceEnd(kTraceCategory, "DumpToMatrix", trace_frame);
 
+      bool swapped = false;
+      int vsync_eventfd = -1;
       {
         MutexLock l(&frame_sync_);
         // Do fast equality test first (likely due to frame_count reset).
@@ -120,11 +170,40 @@ public:
           // run-time iff requested_frame_multiple_ is not a factor of 2^32.
           frame_count = 0;
           if (next_frame_ != NULL) {
+            // The new frame is shown starting with the next refresh.
+            const uint64_t now_us = MonotonicMicros();
+            const uint64_t next_refresh = telemetry_.refresh_count + 1;
+            FramePresentation *const retired = &current_frame_->presentation_;
+            retired->retired_refresh = next_refresh;
+            retired->retired_us = now_us;
+            AddFeedback(*retired);
+            if (next_from_mailbox_) {
+              // Nobody is waiting for the retired frame, so it is free to
+              // be used for the next SubmitFrame().
+              free_frames_.push_back(current_frame_);
+            }
             current_frame_ = next_frame_;
             next_frame_ = NULL;
+            current_frame_->presentation_.shown_refresh = next_refresh;
+            current_frame_->presentation_.shown_us = now_us;
+            TraceInstant(kTraceCategory, "VSync",
+                         current_frame_->presentation_.sequence, next_refresh);
+            swapped = true;
+            vsync_eventfd = vsync_eventfd_;
           }
           pthread_cond_signal(&frame_done_);
         }
+        if (parameters_pending_) {
+          ApplyPendingParameters();
+        }
+        if (curve_pending_) {
+          ApplyPendingCurve();
+        }
+      }
+
+      if (vsync_eventfd >= 0) {
+        const uint64_t one = 1;
+        write(vsync_eventfd, &one, sizeof(one));
       }
 
       ++frame_count;
@@ -136,36 +215,214 @@ public:
       }
 #endif
       const uint32_t end_time_us = GetMicrosecondCounter();
-      if (show_refresh_) {
-        uint32_t usec = end_time_us - start_time_us;
-        printf("\b\b\b\b\b\b\b\b%6.1fHz", 1e6 / usec);
-        if (usec > largest_time && max_measure_enabled) {
-          largest_time = usec;
-          printf(" max: %uusec\b\b\b\b\b\b\b\b\b\b\b\b\b\b", largest_time);
-        } else {
-          max_measure_enabled = (end_time_us - initial_holdoff_start) > kHoldffTimeUs;
-        }
+      if (end_time_us - last_timing_check > kTimingRecheckIntervalUs) {
+        RecalibrateTiming();
+        last_timing_check = end_time_us;
+      }
+      if (!max_measure_enabled) {
+        max_measure_enabled = (end_time_us - initial_holdoff_start) > kHoldffTimeUs;
       }
+      RecordRefresh(end_time_us - start_time_us, swapped, max_measure_enabled,
+                    shown_pwm_bits);
     }
   }
 
+  // Called from any thread. Retries while the refresh thread is in the
+  // middle of an update, which only ever is a couple of stores.
+  void GetTelemetry(RefreshTelemetry *out) {
+    uint32_t before, after;
+    do {
+      before = __atomic_load_n(&telemetry_sequence_, __ATOMIC_ACQUIRE);
+      *out = telemetry_;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      after = __atomic_load_n(&telemetry_sequence_, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+  }
+
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned frame_fraction) {
     MutexLock l(&frame_sync_);
     FrameCanvas *previous = current_frame_;
+    if (other) StartPresentation(other);
     next_frame_ = other;
+    next_from_mailbox_ = false;
     requested_frame_multiple_ = frame_fraction;
+    const uint32_t trace_frame = other ? other->presentation_.sequence : 0;
+    TraceBegin(kTraceCategory, "SwapOnVSync wait", trace_frame);
     frame_sync_.WaitOn(&frame_done_);
+    TraceEnd(kTraceCategory, "SwapOnVSync wait", trace_frame);
     return previous;
   }
 
+  // Non-blocking: hand over the frame to be shown on the next VSync. If the
+  // previously submitted frame did not make it to the screen yet, it is
+  // replaced and goes back to the pool of free frames.
+  // Returns a free frame from the pool, or NULL if the pool is empty.
+  FrameCanvas *SubmitFrame(FrameCanvas *frame) {
+    MutexLock l(&frame_sync_);
+    if (next_frame_ != NULL && next_from_mailbox_) {
+      next_frame_->presentation_.dropped = true;
+      TraceInstant(kTraceCategory, "Dropped",
+                   next_frame_->presentation_.sequence);
+      AddFeedback(next_frame_->presentation_);
+      free_frames_.push_back(next_frame_);
+    }
+    StartPresentation(frame);
+    TraceInstant(kTraceCategory, "SubmitFrame", frame->presentation_.sequence);
+    next_frame_ = frame;
+    next_from_mailbox_ = true;
+    requested_frame_multiple_ = 1;
+    if (free_frames_.empty())
+      return NULL;
+    FrameCanvas *result = free_frames_.back();
+    free_frames_.pop_back();
+    return result;
+  }
+
+  int GetPresentationFeedback(FramePresentation *out, int max_records) {
+    MutexLock l(&frame_sync_);
+    int count = 0;
+    while (count < max_records && feedback_count_ > 0) {
+      out[count++] = feedback_[feedback_start_];
+      feedback_start_ = (feedback_start_ + 1) % kFeedbackRecords;
+      feedback_count_--;
+    }
+    return count;
+  }
+
+  // Called from any thread. The parameters, and the pulse timings
+  // prepared to match them, are switched to by the refresh thread between
+  // two refreshes. A "pwm_bits" of 0 shows as many bits as the frames have.
+  void RequestParameters(int pwm_bits, int pwm_lsb_nanoseconds,
+                         int pwm_dither_bits,
+                         const std::vector<int> &timings) {
+    MutexLock l(&frame_sync_);
+    pending_timings_ = timings;
+    pending_pwm_bits_ = pwm_bits;
+    pending_lsb_nanoseconds_ = pwm_lsb_nanoseconds;
+    pending_dither_bits_ = pwm_dither_bits;
+    parameters_pending_ = true;
+  }
+
+  // Called from any thread. Like RequestParameters(), for the output curve;
+  // NULL for none. Takes ownership of the curve.
+  void RequestCurve(uint16_t *curve) {
+    uint16_t *unused_curve = NULL;
+    uint16_t *replaced_curve = NULL;
+    {
+      MutexLock l(&frame_sync_);
+      unused_curve = retired_curve_;
+      retired_curve_ = NULL;
+      replaced_curve = pending_curve_;
+      pending_curve_ = curve;
+      curve_pending_ = true;
+    }
+    delete[] unused_curve;
+    delete[] replaced_curve;
+  }
+
+  int GetVSyncEventFd() {
+    MutexLock l(&frame_sync_);
+    if (vsync_eventfd_ < 0) {
+      vsync_eventfd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    return vsync_eventfd_;
+  }
+
 private:
   inline bool running() {
     MutexLock l(&running_mutex_);
     return running_;
   }
 
+  void SetDitherBits(int pwm_dither_bits) {
+    switch (pwm_dither_bits) {
+    case 0:
+      start_bit_[0] = 0; start_bit_[1] = 0;
+      start_bit_[2] = 0; start_bit_[3] = 0;
+      break;
+    case 1:
+      start_bit_[0] = 0; start_bit_[1] = 1;
+      start_bit_[2] = 0; start_bit_[3] = 1;
+      break;
+    case 2:
+      start_bit_[0] = 0; start_bit_[1] = 1;
+      start_bit_[2] = 2; start_bit_[3] = 2;
+      break;
+    }
+    dither_bits_ = pwm_dither_bits;
+  }
+
+  // Needs frame_sync_ held. Called by the refresh thread between refreshes,
+  // so the dither sequence and the pulse timings always change together.
+  void ApplyPendingParameters() {
+    Framebuffer::SetOutputEnableTimings(pending_timings_);
+    parameters_pending_ = false;
+    forced_pwm_bits_ = pending_pwm_bits_;
+    lsb_nanoseconds_ = pending_lsb_nanoseconds_;
+    SetDitherBits(pending_dither_bits_);
+  }
+
+  // Needs frame_sync_ held. Called by the refresh thread between refreshes.
+  // Freeing the old curve is left to the next RequestCurve().
+  void ApplyPendingCurve() {
+    if (retired_curve_ == NULL) {
+      retired_curve_ = curve_;
+    } else {
+      delete[] curve_;
+    }
+    curve_ = pending_curve_;
+    pending_curve_ = NULL;
+    curve_pending_ = false;
+  }
+
+  // Needs frame_sync_ held.
+  void StartPresentation(FrameCanvas *frame) {
+    FramePresentation *p = &frame->presentation_;
+    memset(p, 0, sizeof(*p));
+    p->sequence = ++submit_sequence_;
+    p->submit_us = MonotonicMicros();
+  }
+
+  // Needs frame_sync_ held. If nobody reads the feedback, the oldest
+  // records are dropped.
+  void AddFeedback(const FramePresentation &record) {
+    if (record.sequence == 0) return;  // Never submitted (initial frame).
+    if (feedback_count_ == kFeedbackRecords) {
+      feedback_start_ = (feedback_start_ + 1) % kFeedbackRecords;
+      feedback_count_--;
+    }
+    feedback_[(feedback_start_ + feedback_count_) % kFeedbackRecords] = record;
+    feedback_count_++;
+  }
+
+  // The telemetry is only written by the refresh thread. Readers don't
+  // lock, but use the sequence number to detect an update in progress
+  // (odd sequence) or one that happened while they were copying.
+  void RecordRefresh(uint32_t period_us, bool swapped, bool measure_max,
+                     int pwm_bits) {
+    __atomic_store_n(&telemetry_sequence_, telemetry_sequence_ + 1,
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    telemetry_.refresh_count++;
+    if (swapped) telemetry_.frames_swapped++;
+    telemetry_.refresh_time_sum_us += period_us;
+    telemetry_.last_period_us = period_us;
+    if (measure_max && period_us > telemetry_.max_period_us)
+      telemetry_.max_period_us = period_us;
+    int bucket = period_us / RefreshTelemetry::kPeriodBucketUs;
+    if (bucket >= RefreshTelemetry::kPeriodBuckets)
+      bucket = RefreshTelemetry::kPeriodBuckets - 1;
+    telemetry_.period_histogram[bucket]++;
+    telemetry_.pwm_bits = pwm_bits;
+    telemetry_.pwm_lsb_nanoseconds = lsb_nanoseconds_;
+    telemetry_.pwm_dither_bits = dither_bits_;
+    __atomic_store_n(&telemetry_sequence_, telemetry_sequence_ + 1,
+                     __ATOMIC_RELEASE);
+  }
+
+  static const int kMaxPWMBits = 11;  // Bitplanes in the framebuffer.
+
   GPIO *const io_;
-  const bool show_refresh_;
   uint32_t start_bit_[4];
   Mutex running_mutex_;
   bool running_;
@@ -174,7 +431,219 @@ private:
   pthread_cond_t frame_done_;
   FrameCanvas *current_frame_;
   FrameCanvas *next_frame_;
+  bool next_from_mailbox_;  // next_frame_ was handed over with SubmitFrame()
+  std::vector<FrameCanvas*> free_frames_;  // Retired SubmitFrame() frames.
+
+  static const int kFeedbackRecords = 64;
+  uint64_t submit_sequence_;
+  FramePresentation feedback_[kFeedbackRecords];  // Ring buffer.
+  int feedback_start_;
+  int feedback_count_;
+  int vsync_eventfd_;
   unsigned requested_frame_multiple_;
+
+  // Output parameter change handed over by RequestParameters().
+  bool parameters_pending_;
+  std::vector<int> pending_timings_;
+  int pending_pwm_bits_;
+  int pending_lsb_nanoseconds_;
+  int pending_dither_bits_;
+
+  // Output curve change handed over by RequestCurve().
+  bool curve_pending_;
+  uint16_t *pending_curve_;
+  uint16_t *retired_curve_;  // Replaced by the refresh thread.
+
+  // Only accessed by the refresh thread.
+  int forced_pwm_bits_;  // 0: as set in the FrameCanvas.
+  int lsb_nanoseconds_;
+  int dither_bits_;
+  uint16_t *curve_;  // NULL: none.
+
+  uint32_t telemetry_sequence_;
+  RefreshTelemetry telemetry_;
+};
+
+namespace {
+// Prints the refresh rate for --led-show-refresh. This runs in its own,
+// non-realtime thread, so that the refresh thread never waits on stdio.
+class RefreshRatePrinter : public Thread {
+public:
+  RefreshRatePrinter(const RGBMatrix *matrix)
+    : matrix_(matrix), running_(true) {}
+
+  void Stop() {
+    MutexLock l(&running_mutex_);
+    running_ = false;
+  }
+
+  virtual void Run() {
+    uint32_t largest_time = 0;
+    RGBMatrix::RefreshTelemetry telemetry;
+    while (running()) {
+      usleep(100 * 1000);
+      if (!matrix_->GetRefreshTelemetry(&telemetry)
+          || telemetry.last_period_us == 0)
+        continue;
+      printf("\b\b\b\b\b\b\b\b%6.1fHz", 1e6 / telemetry.last_period_us);
+      if (telemetry.max_period_us > largest_time) {
+        largest_time = telemetry.max_period_us;
+        printf(" max: %uusec\b\b\b\b\b\b\b\b\b\b\b\b\b\b", largest_time);
+      }
+      fflush(stdout);
+    }
+  }
+
+private:
+  inline bool running() {
+    MutexLock l(&running_mutex_);
+    return running_;
+  }
+
+  const RGBMatrix *const matrix_;
+  Mutex running_mutex_;
+  bool running_;
+};
+}  // anonymous namespace
+
+// Keeps the refresh rate at or above the configured minimum by trading color
+// depth for speed. Looks at the mean refresh period over the last second and
+// steps one parameter at a time: first more dither bits (cheapest, only
+// slight flicker in the dark colors), then shorter LSB pulses (less
+// brightness), and only then fewer PWM bits. When there is clearly enough
+// headroom, steps back in reverse order. A step back that didn't work out
+// makes it wait longer before the next attempt, to avoid oscillating.
+class RGBMatrix::RefreshGovernor : public Thread {
+public:
+  RefreshGovernor(RGBMatrix *matrix)
+    : matrix_(matrix), running_(true),
+      pwm_bits_(matrix->params_.pwm_bits),
+      lsb_nanoseconds_(matrix->params_.pwm_lsb_nanoseconds),
+      dither_bits_(matrix->params_.pwm_dither_bits),
+      restore_holdoff_(kMinRestoreHoldoff), seconds_since_change_(0),
+      last_change_was_restore_(false), at_limit_reported_(false) {}
+
+  void Stop() {
+    MutexLock l(&running_mutex_);
+    running_ = false;
+  }
+
+  virtual void Run() {
+    const RGBMatrix::Options &opts = matrix_->params_;
+    const uint32_t target_period_us = 1000000 / opts.governor_refresh_hz;
+    RGBMatrix::RefreshTelemetry telemetry;
+    uint64_t last_count = 0;
+    uint64_t last_sum_us = 0;
+    while (running()) {
+      usleep(1000 * 1000);
+      if (!matrix_->GetRefreshTelemetry(&telemetry))
+        continue;
+      const uint64_t refreshes = telemetry.refresh_count - last_count;
+      const uint64_t period_sum_us = telemetry.refresh_time_sum_us - last_sum_us;
+      last_count = telemetry.refresh_count;
+      last_sum_us = telemetry.refresh_time_sum_us;
+      if (refreshes == 0 || period_sum_us == 0)
+        continue;  // No refresh, or no timer to measure it.
+      const uint32_t mean_period_us = period_sum_us / refreshes;
+      ++seconds_since_change_;
+
+      if (mean_period_us > target_period_us) {
+        if (last_change_was_restore_
+            && seconds_since_change_ <= kMinRestoreHoldoff) {
+          // Stepping back up was too much; wait longer next time.
+          restore_holdoff_ = std::min(2 * restore_holdoff_, kMaxRestoreHoldoff);
+        }
+        if (Degrade(opts)) {
+          Apply(mean_period_us, false);
+        } else if (!at_limit_reported_) {
+          fprintf(stderr, "Refresh governor: %.1fHz is below %dHz, but "
+                  "already at the limits.\n",
+                  1e6 / mean_period_us, opts.governor_refresh_hz);
+          at_limit_reported_ = true;
+        }
+      } else if (mean_period_us * 5 / 4 < target_period_us
+                 && seconds_since_change_ >= restore_holdoff_) {
+        if (Restore(opts)) {
+          Apply(mean_period_us, true);
+        } else {
+          restore_holdoff_ = kMinRestoreHoldoff;  // Back to the configuration.
+        }
+      }
+    }
+  }
+
+private:
+  static const int kMinRestoreHoldoff = 2;     // Seconds
+  static const int kMaxRestoreHoldoff = 128;
+
+  inline bool running() {
+    MutexLock l(&running_mutex_);
+    return running_;
+  }
+
+  // Step towards faster refresh. Returns false if there is nothing left.
+  bool Degrade(const RGBMatrix::Options &opts) {
+    if (dither_bits_ < opts.governor_max_dither_bits
+        && dither_bits_ < pwm_bits_ - 1) {
+      ++dither_bits_;
+      return true;
+    }
+    if (lsb_nanoseconds_ > opts.governor_min_lsb_nanoseconds) {
+      lsb_nanoseconds_ = std::max(lsb_nanoseconds_ * 3 / 4,
+                                  opts.governor_min_lsb_nanoseconds);
+      return true;
+    }
+    if (pwm_bits_ > opts.governor_min_pwm_bits && pwm_bits_ > 1) {
+      --pwm_bits_;
+      return true;
+    }
+    return false;
+  }
+
+  // Step back towards the configured parameters, in reverse order.
+  bool Restore(const RGBMatrix::Options &opts) {
+    if (pwm_bits_ < opts.pwm_bits) {
+      ++pwm_bits_;
+      return true;
+    }
+    if (lsb_nanoseconds_ < opts.pwm_lsb_nanoseconds) {
+      lsb_nanoseconds_ = std::min(lsb_nanoseconds_ * 4 / 3 + 1,
+                                  opts.pwm_lsb_nanoseconds);
+      return true;
+    }
+    if (dither_bits_ > opts.pwm_dither_bits) {
+      --dither_bits_;
+      return true;
+    }
+    return false;
+  }
+
+  void Apply(uint32_t mean_period_us, bool is_restore) {
+    const RGBMatrix::Options &opts = matrix_->params_;
+    // Full PWM bits: leave it to whatever the FrameCanvas has.
+    const int forced_bits = (pwm_bits_ < opts.pwm_bits) ? pwm_bits_ : 0;
+    matrix_->ChangeRefreshParameters(forced_bits, lsb_nanoseconds_,
+                                     dither_bits_);
+    fprintf(stderr, "Refresh governor: %.1fHz (target %dHz); now pwm-bits=%d "
+            "pwm-lsb-nanoseconds=%d pwm-dither-bits=%d\n",
+            1e6 / mean_period_us, opts.governor_refresh_hz,
+            pwm_bits_, lsb_nanoseconds_, dither_bits_);
+    seconds_since_change_ = 0;
+    last_change_was_restore_ = is_restore;
+    at_limit_reported_ = false;
+  }
+
+  RGBMatrix *const matrix_;
+  Mutex running_mutex_;
+  bool running_;
+
+  int pwm_bits_;
+  int lsb_nanoseconds_;
+  int dither_bits_;
+  int restore_holdoff_;
+  int seconds_since_change_;
+  bool last_change_was_restore_;
+  bool at_limit_reported_;
 };
 
 // Some defaults. See options-initialize.cc for the command line parsing.
@@ -226,13 +695,18 @@ RGBMatrix::Options::Options() :
     inverse_colors(false),
 #endif
   led_rgb_sequence("RGB"),
-  pixel_mapper_config(NULL)
+  pixel_mapper_config(NULL),
+  governor_refresh_hz(0),
+  governor_min_pwm_bits(7),
+  governor_min_lsb_nanoseconds(50),
+  governor_max_dither_bits(2)
 {
   // Nothing to see here.
 }
 
 RGBMatrix::RGBMatrix(GPIO *io, const Options &options)
-  : params_(options), io_(NULL), updater_(NULL), shared_pixel_mapper_(NULL) {
+  : params_(options), io_(NULL), updater_(NULL), refresh_printer_(NULL),
+    governor_(NULL), shared_pixel_mapper_(NULL) {
   assert(params_.Validate(NULL));
   const MultiplexMapper *multiplex_mapper = NULL;
   if (params_.multiplexing > 0) {
@@ -285,7 +759,8 @@ RGBMatrix::RGBMatrix(GPIO *io, const Options &options)
 
 RGBMatrix::RGBMatrix(GPIO *io, int rows, int chained_displays,
                      int parallel_displays)
-  : params_(Options()), io_(NULL), updater_(NULL), shared_pixel_mapper_(NULL) {
+  : params_(Options()), io_(NULL), updater_(NULL), refresh_printer_(NULL),
+    governor_(NULL), shared_pixel_mapper_(NULL) {
   params_.rows = rows;
   params_.chain_length = chained_displays;
   params_.parallel = parallel_displays;
@@ -297,9 +772,22 @@ RGBMatrix::RGBMatrix(GPIO *io, int rows, int chained_displays,
 }
 
 RGBMatrix::~RGBMatrix() {
-  updater_->Stop();
-  updater_->WaitStopped();
-  delete updater_;
+  if (refresh_printer_) {
+    static_cast<RefreshRatePrinter*>(refresh_printer_)->Stop();
+    refresh_printer_->WaitStopped();
+    delete refresh_printer_;
+  }
+  if (governor_) {
+    governor_->Stop();
+    governor_->WaitStopped();
+    delete governor_;
+  }
+
+  if (updater_) {
+    updater_->Stop();
+    updater_->WaitStopped();
+    delete updater_;
+  }
 
   // Make sure LEDs are off.
   active_->Clear();
@@ -351,8 +839,8 @@ void RGBMatrix::SetGPIO(GPIO *io, bool start_thread) {
 
 bool RGBMatrix::StartRefresh() {
   if (updater_ == NULL && io_ != NULL) {
-    updater_ = new UpdateThread(io_, active_, params_.pwm_dither_bits,
-                                params_.show_refresh_rate);
+    updater_ = new UpdateThread(io_, active_, params_.pwm_lsb_nanoseconds,
+                                params_.pwm_dither_bits);
     // If we have multiple processors, the kernel
     // jumps around between these, creating some global flicker.
     // So let's tie it to the last CPU available.
@@ -361,10 +849,38 @@ bool RGBMatrix::StartRefresh() {
     // The Raspberry Pi1 only has one core, so this affinity
     //   call will simply fail and we keep using the only core.
     updater_->Start(99, (1<<3));  // Prio: high. Also: put on last CPU.
+
+    if (params_.show_refresh_rate) {
+      refresh_printer_ = new RefreshRatePrinter(this);
+      refresh_printer_->Start();
+    }
+    if (params_.governor_refresh_hz > 0) {
+      governor_ = new RefreshGovernor(this);
+      governor_->Start();
+    }
   }
   return updater_ != NULL;
 }
 
+bool RGBMatrix::ChangeRefreshParameters(int pwm_bits, int pwm_lsb_nanoseconds,
+                                        int pwm_dither_bits) {
+  if (updater_ == NULL)
+    return false;
+  // Only the timings change: the pulser, set up before privileges were
+  // dropped, stays.
+  updater_->RequestParameters(
+    pwm_bits, pwm_lsb_nanoseconds, pwm_dither_bits,
+    Framebuffer::OutputEnableTimings(pwm_lsb_nanoseconds, pwm_dither_bits));
+  return true;
+}
+
+bool RGBMatrix::SetOutputCurve(uint8_t brightness, float gamma) {
+  if (updater_ == NULL)
+    return false;
+  updater_->RequestCurve(Framebuffer::CreateOutputCurve(brightness, gamma));
+  return true;
+}
+
 FrameCanvas *RGBMatrix::CreateFrameCanvas() {
   FrameCanvas *result =
     new FrameCanvas(new Framebuffer(params_.rows,
@@ -395,6 +911,29 @@ FrameCanvas *RGBMatrix::SwapOnVSync(FrameCanvas *other,
   return previous;
 }
 
+int RGBMatrix::GetPresentationFeedback(FramePresentation *out,
+                                       int max_records) {
+  if (updater_ == NULL) return 0;
+  return updater_->GetPresentationFeedback(out, max_records);
+}
+
+int RGBMatrix::GetVSyncEventFd() {
+  if (updater_ == NULL) return -1;
+  return updater_->GetVSyncEventFd();
+}
+
+FrameCanvas *RGBMatrix::SubmitFrame(FrameCanvas *frame) {
+  if (updater_ == NULL) return frame;  // Not refreshing; nothing shows it.
+  FrameCanvas *result = updater_->SubmitFrame(frame);
+  active_ = frame;
+  if (result == NULL) {
+    // Producer, VSync mailbox and screen each hold one frame: the pool is
+    // empty until the first frame was retired, so we need a third frame.
+    result = CreateFrameCanvas();
+  }
+  return result;
+}
+
 bool RGBMatrix::SetPWMBits(uint8_t value) {
   const bool success = active_->framebuffer()->SetPWMBits(value);
   if (success) {
@@ -424,6 +963,31 @@ uint8_t RGBMatrix::brightness() {
   return params_.brightness;
 }
 
+bool RGBMatrix::GetRefreshTelemetry(RefreshTelemetry *out) const {
+  if (updater_ == NULL) return false;
+  updater_->GetTelemetry(out);
+
+  // Percentile is determined here, so that the refresh thread only has to
+  // count.
+  uint64_t total = 0;
+  for (int i = 0; i < RefreshTelemetry::kPeriodBuckets; ++i)
+    total += out->period_histogram[i];
+  const uint64_t needed = total - total / 100;
+  uint64_t running_count = 0;
+  out->p99_period_us = 0;
+  for (int i = 0; i < RefreshTelemetry::kPeriodBuckets && total > 0; ++i) {
+    running_count += out->period_histogram[i];
+    if (running_count >= needed) {
+      out->p99_period_us = (i + 1) * RefreshTelemetry::kPeriodBucketUs;
+      break;
+    }
+  }
+
+  GetNanosleepOvershootHistogram(out->pulse_overshoot_histogram_us,
+                                 RefreshTelemetry::kOvershootBuckets);
+  return true;
+}
+
 // -- Implementation of RGBMatrix Canvas: delegation to ContentBuffer
 int RGBMatrix::width() const {
   return active_->width();
@@ -574,7 +1138,10 @@ height_(frame->height())
   color_b_ = new uint16_t[height_ * columns_];
 
   tileptrs_ = NULL;
-
+  tileptrs_w_ = columns_ / 16;
+  tileptrs_h_ = height_ / 16;
+  tile_layer_count_ = 0;
+  memset(&presentation_, 0, sizeof(presentation_));
 }
 
 FrameCanvas::~FrameCanvas() {
@@ -619,6 +1186,44 @@ void FrameCanvas::SetTilePtrs(void** ptrs)
   tileptrs_h_ = height_ / 16;
 }
 
+void FrameCanvas::SetTileLayers(const TileLayer *layers, int count)
+{
+  if (count > kMaxTileLayers)
+    count = kMaxTileLayers;
+  for (int i = 0; i < count; i++)
+    tile_layers_[i] = layers[i];
+  tile_layer_count_ = count;
+}
+
+static const int kTileLayerValues = 16 * 16 * 3;
+
+void TileLayer::Draw(const uint16_t *src, uint16_t *dst) const {
+  switch (blend) {
+  case kReplace:
+    memcpy(dst, src, kTileLayerValues * sizeof(*dst));
+    break;
+  case kKeyed:
+    for (int i = 0; i < kTileLayerValues; i += 3) {
+      if (src[i] | src[i+1] | src[i+2]) {
+        dst[i] = src[i];
+        dst[i+1] = src[i+1];
+        dst[i+2] = src[i+2];
+      }
+    }
+    break;
+  case kAdd:
+    for (int i = 0; i < kTileLayerValues; i++) {
+      const uint32_t sum = dst[i] + src[i];
+      dst[i] = sum < 65535 ? sum : 65535;
+    }
+    break;
+  case kMax:
+    for (int i = 0; i < kTileLayerValues; i++)
+      dst[i] = std::max(dst[i], src[i]);
+    break;
+  }
+}
+
 
 void FrameCanvas::Clear() {
     Fill(0, 0, 0);
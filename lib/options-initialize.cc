@@ -175,6 +175,18 @@ static bool FlagInit(int &argc, char **&argv,
       if (ConsumeIntFlag("row-addr-type", it, end,
                          &mopts->row_address_type, &err))
         continue;
+      if (ConsumeIntFlag("governor-hz", it, end,
+                         &mopts->governor_refresh_hz, &err))
+        continue;
+      if (ConsumeIntFlag("governor-min-pwm-bits", it, end,
+                         &mopts->governor_min_pwm_bits, &err))
+        continue;
+      if (ConsumeIntFlag("governor-min-lsb-nanoseconds", it, end,
+                         &mopts->governor_min_lsb_nanoseconds, &err))
+        continue;
+      if (ConsumeIntFlag("governor-max-dither-bits", it, end,
+                         &mopts->governor_max_dither_bits, &err))
+        continue;
       if (ConsumeBoolFlag("show-refresh", it, &mopts->show_refresh_rate))
         continue;
       if (ConsumeBoolFlag("inverse", it, &mopts->inverse_colors))
@@ -399,6 +411,14 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           "(Default: %d)\n"
           "\t--led-pwm-dither-bits=<0..2> : Time dithering of lower bits "
           "(Default: 0)\n"
+          "\t--led-governor-hz=<hz>    : Keep refresh rate above this by "
+          "reducing color depth (Default: 0 = off)\n"
+          "\t--led-governor-min-pwm-bits=<1..11> : Governor: lowest PWM bits "
+          "(Default: %d)\n"
+          "\t--led-governor-min-lsb-nanoseconds : Governor: shortest LSB "
+          "(Default: %d)\n"
+          "\t--led-governor-max-dither-bits=<0..2> : Governor: most dither "
+          "bits (Default: %d)\n"
           "\t--led-%shardware-pulse   : %sse hardware pin-pulse generation.\n",
           d.hardware_mapping,
           d.rows, d.cols, d.chain_length, d.parallel,
@@ -408,6 +428,8 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           d.show_refresh_rate ? "no-" : "", d.show_refresh_rate ? "Don't s" : "S",
           d.inverse_colors ? "no-" : "",    d.inverse_colors ? "off" : "on",
           d.pwm_lsb_nanoseconds,
+          d.governor_min_pwm_bits, d.governor_min_lsb_nanoseconds,
+          d.governor_max_dither_bits,
           !d.disable_hardware_pulsing ? "no-" : "",
           !d.disable_hardware_pulsing ? "Don't u" : "U");
 
@@ -494,6 +516,28 @@ bool RGBMatrix::Options::Validate(std::string *err_in) const {
     success = false;
   }
 
+  if (governor_refresh_hz < 0 || governor_refresh_hz > 10000) {
+    err->append("Invalid range of governor-hz (0..10000 allowed).\n");
+    success = false;
+  }
+
+  if (governor_min_pwm_bits <= 0 || governor_min_pwm_bits > 11) {
+    err->append("Invalid range of governor-min-pwm-bits (1..11 allowed).\n");
+    success = false;
+  }
+
+  if (governor_min_lsb_nanoseconds < 50
+      || governor_min_lsb_nanoseconds > 3000) {
+    err->append("Invalid range of governor-min-lsb-nanoseconds "
+                "(50..3000 allowed).\n");
+    success = false;
+  }
+
+  if (governor_max_dither_bits < 0 || governor_max_dither_bits > 2) {
+    err->append("Invalid range of governor-max-dither-bits (0..2 allowed).\n");
+    success = false;
+  }
+
   if (led_rgb_sequence == NULL || strlen(led_rgb_sequence) != 3) {
     err->append("led-sequence needs to be three characters long.\n");
     success = false;
@@ -0,0 +1,175 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Per-thread ring buffers for the tracepoints in trace.h
+
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace rgb_matrix {
+namespace internal {
+bool trace_enabled = false;
+}
+
+namespace {
+// Per thread. At 40 bytes per record, that is 640kB; a couple of seconds
+// worth of events even for the busy receive threads.
+static const uint32_t kRecordsPerThread = 16384;
+
+struct Record {
+  uint64_t timestamp_ns;
+  const char *category;
+  const char *name;
+  uint32_t frame;
+  uint32_t arg;
+  char phase;
+};
+
+struct ThreadRing {
+  ThreadRing *next;
+  uint32_t tid;
+  char name[16];
+  uint32_t written;  // Total records written; only the owning thread writes.
+  Record records[kRecordsPerThread];
+};
+
+// All rings ever created. They are never freed, as the dump might still be
+// reading from a ring of a thread that is just exiting.
+static ThreadRing *sRings = NULL;
+static __thread ThreadRing *tThreadRing = NULL;
+
+// Zeroed by new, so all of it is paged in before the first record.
+static ThreadRing *CreateThreadRing() {
+  ThreadRing *ring = new ThreadRing();
+  ring->tid = syscall(SYS_gettid);
+  pthread_getname_np(pthread_self(), ring->name, sizeof(ring->name));
+  ring->written = 0;
+  ring->next = __atomic_load_n(&sRings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&sRings, &ring->next, ring, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    // ring->next was updated with the current head; retry.
+  }
+  return ring;
+}
+
+static uint16_t StringIndex(const char *str,
+                            std::map<std::string, uint16_t> *index,
+                            std::vector<std::string> *strings) {
+  const std::string s(str ? str : "");
+  std::map<std::string, uint16_t>::const_iterator found = index->find(s);
+  if (found != index->end())
+    return found->second;
+  const uint16_t result = strings->size();
+  (*index)[s] = result;
+  strings->push_back(s);
+  return result;
+}
+}  // anonymous namespace
+
+namespace internal {
+void TraceRecord(char phase, const char *category, const char *name,
+                 uint32_t frame, uint32_t arg) {
+  ThreadRing *ring = tThreadRing;
+  if (ring == NULL) {
+    ring = tThreadRing = CreateThreadRing();
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  const uint32_t pos = ring->written;
+  Record *r = &ring->records[pos % kRecordsPerThread];
+  r->timestamp_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  r->category = category;
+  r->name = name;
+  r->frame = frame;
+  r->arg = arg;
+  r->phase = phase;
+  __atomic_store_n(&ring->written, pos + 1, __ATOMIC_RELEASE);
+}
+}  // namespace internal
+
+void TraceEnable(bool enable) {
+  __atomic_store_n(&internal::trace_enabled, enable, __ATOMIC_RELAXED);
+}
+
+void TracePrepareThread() {
+  if (tThreadRing == NULL) tThreadRing = CreateThreadRing();
+}
+
+bool TraceDump(const char *filename) {
+  // Snapshot first, so that the time the rings can change under us is short.
+  std::vector<ThreadRing*> rings;
+  std::vector<std::vector<Record> > snapshot;
+  for (ThreadRing *ring = __atomic_load_n(&sRings, __ATOMIC_ACQUIRE);
+       ring != NULL; ring = ring->next) {
+    const uint32_t written = __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE);
+    uint32_t first = 0;
+    if (written > kRecordsPerThread) {
+      // Leave out the oldest records: they might be overwritten while we
+      // are copying.
+      first = written - kRecordsPerThread + kRecordsPerThread / 16;
+    }
+    rings.push_back(ring);
+    snapshot.push_back(std::vector<Record>());
+    for (uint32_t i = first; i != written; ++i) {
+      snapshot.back().push_back(ring->records[i % kRecordsPerThread]);
+    }
+  }
+
+  std::map<std::string, uint16_t> string_index;
+  std::vector<std::string> strings;
+  std::vector<std::vector<TraceFileRecord> > records(snapshot.size());
+  for (size_t t = 0; t < snapshot.size(); ++t) {
+    for (size_t i = 0; i < snapshot[t].size(); ++i) {
+      const Record &r = snapshot[t][i];
+      TraceFileRecord out;
+      memset(&out, 0, sizeof(out));
+      out.timestamp_ns = r.timestamp_ns;
+      out.frame = r.frame;
+      out.arg = r.arg;
+      out.category = StringIndex(r.category, &string_index, &strings);
+      out.name = StringIndex(r.name, &string_index, &strings);
+      out.phase = r.phase;
+      records[t].push_back(out);
+    }
+  }
+
+  FILE *out = fopen(filename, "wb");
+  if (out == NULL) {
+    perror("Opening trace file");
+    return false;
+  }
+  TraceFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "RGBTRACE", sizeof(header.magic));
+  header.version = 1;
+  header.string_count = strings.size();
+  header.thread_count = rings.size();
+  fwrite(&header, sizeof(header), 1, out);
+  for (size_t i = 0; i < strings.size(); ++i) {
+    const uint16_t len = strings[i].size();
+    fwrite(&len, sizeof(len), 1, out);
+    fwrite(strings[i].data(), 1, len, out);
+  }
+  for (size_t t = 0; t < rings.size(); ++t) {
+    TraceFileThread thread;
+    memset(&thread, 0, sizeof(thread));
+    thread.tid = rings[t]->tid;
+    memcpy(thread.name, rings[t]->name, sizeof(thread.name));
+    thread.record_count = records[t].size();
+    fwrite(&thread, sizeof(thread), 1, out);
+    if (!records[t].empty()) {
+      fwrite(&records[t][0], sizeof(TraceFileRecord), records[t].size(), out);
+    }
+  }
+  return fclose(out) == 0;
+}
+}  // namespace rgb_matrix
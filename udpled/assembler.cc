@@ -0,0 +1,42 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+
+#include "assembler.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static size_t framebytes(const assembler_t *a)
+{
+  return (size_t)a->tiles_x * a->tiles_y * tilepayloadsize;
+}
+
+assembler_t *assembler_create(int tiles_x, int tiles_y)
+{
+  assembler_t *a = (assembler_t*)calloc(1, sizeof(assembler_t));
+  a->tiles_x = tiles_x;
+  a->tiles_y = tiles_y;
+  a->width = tiles_x * tilesize_x;
+  a->height = tiles_y * tilesize_y;
+  const int tiles = tiles_x * tiles_y;
+  a->slab = tileslab_create(framebytes(a), assembler_frames);
+  for (int f = 0; f < assembler_frames; f++)
+  {
+    a->pixels[f] = (uint16_t*)tileslab_buf(a->slab, f);
+    a->tileptrs[f] = (uint16_t**)malloc(tiles * sizeof(uint16_t*));
+    for (int t = 0; t < tiles; t++)
+      a->tileptrs[f][t] = a->pixels[f] + t * tilesize_x * tilesize_y * 3;
+  }
+  a->current = tileslab_alloc(a->slab);
+  return a;
+}
+
+uint16_t **assembler_flip(assembler_t *a)
+{
+  const int next = tileslab_alloc(a->slab);
+  if (next < 0)
+    return NULL;
+  const int done = a->current;
+  a->current = next;
+  memcpy(a->pixels[a->current], a->pixels[done], framebytes(a));
+  return a->tileptrs[done];
+}
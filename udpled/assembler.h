@@ -0,0 +1,57 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+Assembles frames from pixels that arrive in pieces (DMX universes, DDP
+packets), in the tile layout the frametuuper hands to the matrix.
+
+Pixels not written since the last flip keep their value from the frame
+before. The frames live in a tileslab (tileslab.h): a frame handed out
+by assembler_flip() comes with one reference to it, and isn't written
+again until the last reference is dropped. Take those for showing it,
+then drop that one with tileslab_unref().
+
+Only one thread may write and flip.
+*/
+#ifndef UDPLED_ASSEMBLER_H
+#define UDPLED_ASSEMBLER_H
+
+#include "protocol.h"
+#include "tileslab.h"
+
+#include <stdint.h>
+
+const int assembler_frames = 8;
+
+typedef struct
+{
+  int tiles_x;
+  int tiles_y;
+  int width;                // In pixels.
+  int height;
+  tileslab_t *slab;         // Of the frames.
+  int current;              // Frame being written.
+  uint16_t *pixels[assembler_frames];    // Tile after tile.
+  uint16_t **tileptrs[assembler_frames];
+} assembler_t;
+
+// Creates a slab, so like tileslab_create(), before the threads taking
+// references run.
+assembler_t *assembler_create(int tiles_x, int tiles_y);
+
+inline void assembler_set(assembler_t *a, int x, int y,
+                          uint16_t r, uint16_t g, uint16_t b)
+{
+  if ((unsigned)x >= (unsigned)a->width || (unsigned)y >= (unsigned)a->height)
+    return;
+  int tile = (y / tilesize_y) * a->tiles_x + x / tilesize_x;
+  int offs = (y % tilesize_y) * tilesize_x + x % tilesize_x;
+  uint16_t *p = a->pixels[a->current] + (tile * tilesize_x * tilesize_y + offs) * 3;
+  p[0] = r;
+  p[1] = g;
+  p[2] = b;
+}
+
+// Finish the current frame and return its tiles, to show them. NULL if
+// every other frame is still referenced; the current one then goes on
+// being written, and the next flip shows it.
+uint16_t **assembler_flip(assembler_t *a);
+
+#endif
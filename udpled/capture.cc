@@ -0,0 +1,150 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Double buffered capture writer: the receive threads append to the fill
+// buffer, the writer thread writes out the other one.
+
+#include "capture.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static FILE *capfile = NULL;
+static pthread_t capthread;
+static pthread_mutex_t caplock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t capcond = PTHREAD_COND_INITIALIZER;
+
+static size_t capbufsize;
+static char *fillbuf;
+static size_t filllen;
+static char *writebuf;
+static size_t writelen;       // Non-zero while the writer has work.
+static bool capclosing = false;
+
+static uint64_t cappackets;
+static uint64_t capbytes;
+static uint64_t capdropped;
+
+static void *capturewriter(void *)
+{
+  pthread_setname_np(pthread_self(), "udp: capture");
+
+  pthread_mutex_lock(&caplock);
+  while (!capclosing || writelen > 0)
+  {
+    if (writelen == 0)
+    {
+      pthread_cond_wait(&capcond, &caplock);
+      continue;
+    }
+    size_t len = writelen;
+    pthread_mutex_unlock(&caplock);
+    if (fwrite(writebuf, 1, len, capfile) != len)
+      perror("capture write");
+    pthread_mutex_lock(&caplock);
+    writelen = 0;
+  }
+  pthread_mutex_unlock(&caplock);
+  return NULL;
+}
+
+bool capture_open(const char *filename, size_t buffersize)
+{
+  capfile = fopen(filename, "wb");
+  if (capfile == NULL)
+  {
+    perror(filename);
+    return false;
+  }
+
+  captureheader_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "UDPCAPT1", sizeof(header.magic));
+  header.version = 1;
+  fwrite(&header, sizeof(header), 1, capfile);
+
+  // Touch the buffers now, so there are no page faults while receiving.
+  capbufsize = buffersize / 2;
+  fillbuf = (char*)malloc(capbufsize);
+  writebuf = (char*)malloc(capbufsize);
+  memset(fillbuf, 0, capbufsize);
+  memset(writebuf, 0, capbufsize);
+  filllen = 0;
+  writelen = 0;
+
+  pthread_create(&capthread, NULL, capturewriter, NULL);
+  return true;
+}
+
+void capture_packet(uint64_t timestamp_ns, const void *hdr, size_t hdrlen,
+                    const void *payload, size_t payloadlen)
+{
+  capturerecord_t rec;
+  rec.timestamp_ns = timestamp_ns;
+  rec.len = hdrlen + payloadlen;
+  rec.reserved = 0;
+  size_t reclen = sizeof(rec) + rec.len;
+
+  pthread_mutex_lock(&caplock);
+  if (fillbuf == NULL || capclosing)
+  {
+    pthread_mutex_unlock(&caplock);
+    return;
+  }
+  if (filllen + reclen > capbufsize)
+  {
+    if (writelen > 0 || filllen == 0)
+    {
+      // The writer is still busy with the other buffer.
+      capdropped++;
+      pthread_mutex_unlock(&caplock);
+      return;
+    }
+    char *tmp = writebuf;
+    writebuf = fillbuf;
+    writelen = filllen;
+    fillbuf = tmp;
+    filllen = 0;
+    pthread_cond_signal(&capcond);
+  }
+  char *p = fillbuf + filllen;
+  memcpy(p, &rec, sizeof(rec));
+  memcpy(p + sizeof(rec), hdr, hdrlen);
+  memcpy(p + sizeof(rec) + hdrlen, payload, payloadlen);
+  filllen += reclen;
+  cappackets++;
+  capbytes += rec.len;
+  pthread_mutex_unlock(&caplock);
+}
+
+void capture_close()
+{
+  if (capfile == NULL)
+    return;
+
+  pthread_mutex_lock(&caplock);
+  // Wait for the writer to be done with its buffer, then hand it the rest.
+  while (writelen > 0)
+  {
+    pthread_mutex_unlock(&caplock);
+    usleep(1000);
+    pthread_mutex_lock(&caplock);
+  }
+  char *tmp = writebuf;
+  writebuf = fillbuf;
+  writelen = filllen;
+  fillbuf = tmp;
+  filllen = 0;
+  capclosing = true;
+  pthread_cond_signal(&capcond);
+  pthread_mutex_unlock(&caplock);
+
+  pthread_join(capthread, NULL);
+  fclose(capfile);
+  capfile = NULL;
+  printf("captured %llu packets, %llu bytes, %llu dropped\n",
+         (unsigned long long)cappackets, (unsigned long long)capbytes,
+         (unsigned long long)capdropped);
+}
@@ -0,0 +1,42 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+Capture of the received datagrams, for replaying them later with udpreplay.
+
+The capture file, in host byte order:
+  captureheader_t
+  for each datagram: capturerecord_t, followed by "len" bytes of the
+  datagram as received (packethdr_t and payload).
+*/
+#ifndef UDPLED_CAPTURE_H
+#define UDPLED_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+  char magic[8];          // "UDPCAPT1"
+  uint32_t version;       // 1
+  uint32_t reserved;
+} captureheader_t;
+
+typedef struct
+{
+  uint64_t timestamp_ns;  // CLOCK_MONOTONIC when received.
+  uint32_t len;
+  uint32_t reserved;
+} capturerecord_t;
+
+// Start capturing to "filename". Datagrams are copied to a buffer of
+// "buffersize" bytes and written out by a background thread, so the
+// receive threads never wait for the disk; if the disk can't keep up,
+// datagrams are left out of the capture and counted.
+bool capture_open(const char *filename, size_t buffersize);
+
+// Add a datagram, received in two pieces as recvloop() does.
+void capture_packet(uint64_t timestamp_ns, const void *hdr, size_t hdrlen,
+                    const void *payload, size_t payloadlen);
+
+// Write out what's left and close the file.
+void capture_close();
+
+#endif
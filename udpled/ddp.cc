@@ -0,0 +1,78 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+
+#include "ddp.h"
+
+// Header flags.
+const uint8_t ddp_version_mask = 0xc0;
+const uint8_t ddp_version_1 = 0x40;
+const uint8_t ddp_timecode = 0x10;
+const uint8_t ddp_query = 0x02;
+const uint8_t ddp_push = 0x01;
+
+// Destinations.
+const uint8_t ddp_id_display = 1;
+const uint8_t ddp_id_all = 255;
+
+static uint16_t cie1931[256];
+
+uint16_t **ddp_packet(const uint8_t *buf, size_t len, assembler_t *a)
+{
+  if (len < 10)
+    return NULL;
+  const uint8_t flags = buf[0];
+  const uint8_t datatype = buf[2];
+  const uint8_t id = buf[3];
+  if ((flags & ddp_version_mask) != ddp_version_1 || (flags & ddp_query))
+    return NULL;
+  if (id != ddp_id_display && id != ddp_id_all)
+    return NULL;
+
+  size_t hdrlen = (flags & ddp_timecode) ? 14 : 10;
+  if (len < hdrlen)
+    return NULL;
+  const uint32_t offset =
+    (uint32_t)buf[4] << 24 | buf[5] << 16 | buf[6] << 8 | buf[7];
+  size_t datalen = buf[8] << 8 | buf[9];
+  if (datalen > len - hdrlen)
+    datalen = len - hdrlen;
+  const uint8_t *data = buf + hdrlen;
+
+  // Data type 0bCRTTTSSS: TTT 1 is RGB, SSS 3 is 8 bits and 4 is 16 bits
+  // per color. Many senders leave it 0 or send the old 1 for 8 bit RGB.
+  int bytesperpixel;
+  if (datatype == 0x00 || datatype == 0x01 || datatype == 0x0b)
+    bytesperpixel = 3;
+  else if (datatype == 0x0c)
+    bytesperpixel = 6;
+  else
+    return NULL;
+
+  uint32_t pixel = (offset + bytesperpixel - 1) / bytesperpixel;
+  size_t skip = pixel * bytesperpixel - offset;
+  if (skip > datalen)
+    skip = datalen;
+  const uint8_t *in = data + skip;
+  const uint8_t *end = data + datalen;
+  const int w = a->width;
+  if (bytesperpixel == 3)
+  {
+    if (cie1931[255] == 0)
+    {
+      for (int c = 0; c < 256; c++)
+        cie1931[c] = cie1931_16(c);
+    }
+    for (; in + 3 <= end; in += 3, pixel++)
+      assembler_set(a, pixel % w, pixel / w,
+                    cie1931[in[0]], cie1931[in[1]], cie1931[in[2]]);
+  }
+  else
+  {
+    for (; in + 6 <= end; in += 6, pixel++)
+      assembler_set(a, pixel % w, pixel / w, in[0] << 8 | in[1],
+                    in[2] << 8 | in[3], in[4] << 8 | in[5]);
+  }
+
+  if (flags & ddp_push)
+    return assembler_flip(a);
+  return NULL;
+}
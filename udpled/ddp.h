@@ -0,0 +1,27 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+DDP (Distributed Display Protocol, http://www.3waylabs.com/ddp/) input.
+
+The data of the default output device (id 1) is the wall row by row, from
+the top left pixel: 3 bytes per pixel for 8 bit RGB, 6 bytes (big endian)
+for 16 bit. 8 bit colors get the library's CIE1931 luminance correction,
+16 bit colors are taken as linear, like the tile protocol. A packet with
+the push flag shows the frame.
+
+Packets are expected to start and end at pixel boundaries, as common
+senders do; the bytes of a pixel split between packets are left out.
+*/
+#ifndef UDPLED_DDP_H
+#define UDPLED_DDP_H
+
+#include "assembler.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+const int ddp_port = 4048;
+
+// Parse a datagram. Returns the tiles to show when it had the push flag,
+// NULL otherwise.
+uint16_t **ddp_packet(const uint8_t *buf, size_t len, assembler_t *a);
+
+#endif
@@ -0,0 +1,267 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+
+#include "dmx.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <map>
+#include <vector>
+
+typedef struct
+{
+  int channel;              // 0 based.
+  int x;
+  int y;
+  int count;
+  int dx;
+  int dy;
+  int order[3];             // Channel offset of red, green and blue.
+} dmxpatch_t;
+
+typedef struct
+{
+  std::vector<dmxpatch_t> patches;
+  bool hasseq;
+  uint8_t lastseq;
+  bool seen;                // Got data since the last flip.
+} dmxuniverse_t;
+
+static std::map<uint16_t, dmxuniverse_t> patchmap;
+static int seencount = 0;
+static uint64_t lastsync_ns = 0;
+static uint16_t cie1931[256];
+
+// Without a sync for this long, the sender doesn't do sync (anymore).
+static const uint64_t synctimeout_ns = 4000000000ull;
+
+static uint64_t nowns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void addpatch(uint16_t universe, const dmxpatch_t &p)
+{
+  if (cie1931[255] == 0)
+  {
+    for (int c = 0; c < 256; c++)
+      cie1931[c] = cie1931_16(c);
+  }
+  patchmap[universe].patches.push_back(p);
+}
+
+bool dmx_loadpatch(const char *filename)
+{
+  FILE *f = fopen(filename, "r");
+  if (f == NULL)
+  {
+    perror(filename);
+    return false;
+  }
+  char line[256];
+  int lineno = 0;
+  while (fgets(line, sizeof(line), f))
+  {
+    lineno++;
+    char *s = line + strspn(line, " \t");
+    if (*s == '#' || *s == '\n' || *s == 0)
+      continue;
+
+    char *tok[9];
+    int ntok = 0;
+    for (char *t = strtok(s, " \t\n"); t && ntok < 9; t = strtok(NULL, " \t\n"))
+      tok[ntok++] = t;
+
+    dmxpatch_t p;
+    const char *order = "RGB";
+    p.dx = 1;
+    p.dy = 0;
+    if (ntok == 6 || ntok == 8)
+      order = tok[ntok - 1];
+    if (ntok >= 7)
+    {
+      p.dx = atoi(tok[5]);
+      p.dy = atoi(tok[6]);
+    }
+    const int universe = ntok >= 5 ? atoi(tok[0]) : -1;
+    const int channel = ntok >= 5 ? atoi(tok[1]) : 0;
+    if (ntok >= 5)
+    {
+      p.x = atoi(tok[2]);
+      p.y = atoi(tok[3]);
+      p.count = atoi(tok[4]);
+    }
+    const char *r = strchr(order, 'R');
+    const char *g = strchr(order, 'G');
+    const char *b = strchr(order, 'B');
+    if (ntok < 5 || ntok > 8 || universe < 0 || universe > 65535
+        || channel < 1 || p.count < 1 || channel + p.count * 3 - 1 > 512
+        || strlen(order) != 3 || !r || !g || !b)
+    {
+      fprintf(stderr, "%s:%d: invalid patch\n", filename, lineno);
+      fclose(f);
+      return false;
+    }
+    p.channel = channel - 1;
+    p.order[0] = r - order;
+    p.order[1] = g - order;
+    p.order[2] = b - order;
+    addpatch(universe, p);
+  }
+  fclose(f);
+  return true;
+}
+
+void dmx_defaultpatch(int width, int height, int firstuniverse)
+{
+  const int pixelsperuniverse = 170;
+  for (int i = 0; i < width * height; )
+  {
+    dmxpatch_t p;
+    p.channel = (i % pixelsperuniverse) * 3;
+    p.x = i % width;
+    p.y = i / width;
+    p.count = pixelsperuniverse - i % pixelsperuniverse;
+    if (p.count > width - p.x)
+      p.count = width - p.x;
+    p.dx = 1;
+    p.dy = 0;
+    p.order[0] = 0;
+    p.order[1] = 1;
+    p.order[2] = 2;
+    addpatch(firstuniverse + i / pixelsperuniverse, p);
+    i += p.count;
+  }
+}
+
+int dmx_universes(uint16_t *universes, int max)
+{
+  int n = 0;
+  for (std::map<uint16_t, dmxuniverse_t>::const_iterator it = patchmap.begin();
+       it != patchmap.end() && n < max; ++it)
+    universes[n++] = it->first;
+  return n;
+}
+
+static uint16_t **flip(assembler_t *a)
+{
+  for (std::map<uint16_t, dmxuniverse_t>::iterator it = patchmap.begin();
+       it != patchmap.end(); ++it)
+    it->second.seen = false;
+  seencount = 0;
+  return assembler_flip(a);
+}
+
+static uint16_t **syncreceived(assembler_t *a)
+{
+  lastsync_ns = nowns();
+  return flip(a);
+}
+
+static uint16_t **universereceived(assembler_t *a, uint16_t universe,
+                                   bool numbered, uint8_t seq,
+                                   const uint8_t *data, int len)
+{
+  std::map<uint16_t, dmxuniverse_t>::iterator found = patchmap.find(universe);
+  if (found == patchmap.end())
+    return NULL;
+  dmxuniverse_t *u = &found->second;
+
+  if (numbered && u->hasseq)
+  {
+    // Out of order, as E1.31 says: up to 20 behind is late, not restarted.
+    int8_t diff = seq - u->lastseq;
+    if (diff <= 0 && diff > -20)
+      return NULL;
+  }
+  u->hasseq = numbered;
+  u->lastseq = seq;
+
+  const bool synced = lastsync_ns != 0
+    && nowns() - lastsync_ns < synctimeout_ns;
+  uint16_t **show = NULL;
+  if (!synced && u->seen)
+    show = flip(a);
+
+  for (size_t i = 0; i < u->patches.size(); i++)
+  {
+    const dmxpatch_t &p = u->patches[i];
+    int count = p.count;
+    if (p.channel + count * 3 > len)
+      count = (len - p.channel) / 3;
+    const uint8_t *in = data + p.channel;
+    for (int n = 0; n < count; n++, in += 3)
+      assembler_set(a, p.x + n * p.dx, p.y + n * p.dy,
+                    cie1931[in[p.order[0]]], cie1931[in[p.order[1]]],
+                    cie1931[in[p.order[2]]]);
+  }
+
+  if (!u->seen)
+  {
+    u->seen = true;
+    seencount++;
+  }
+  if (!synced && seencount == (int)patchmap.size())
+    show = flip(a);
+  return show;
+}
+
+static uint16_t get16be(const uint8_t *p)
+{
+  return p[0] << 8 | p[1];
+}
+
+static uint32_t get32be(const uint8_t *p)
+{
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+uint16_t **dmx_artnet(const uint8_t *buf, size_t len, assembler_t *a)
+{
+  if (len < 10 || memcmp(buf, "Art-Net", 8) != 0)
+    return NULL;
+  const uint16_t opcode = buf[8] | buf[9] << 8;
+  if (opcode == 0x5200)  // ArtSync
+    return syncreceived(a);
+  if (opcode != 0x5000 || len < 18)  // ArtDmx
+    return NULL;
+
+  const uint8_t seq = buf[12];
+  const uint16_t universe = buf[14] | (buf[15] & 0x7f) << 8;
+  int datalen = get16be(buf + 16);
+  if (datalen > (int)len - 18)
+    datalen = len - 18;
+  // Sequence 0: the sender doesn't number its packets.
+  return universereceived(a, universe, seq != 0, seq, buf + 18, datalen);
+}
+
+uint16_t **dmx_sacn(const uint8_t *buf, size_t len, assembler_t *a)
+{
+  static const uint8_t acnid[12] = "ASC-E1.17\0\0";
+  if (len < 49 || get16be(buf) != 0x0010 || memcmp(buf + 4, acnid, 12) != 0)
+    return NULL;
+
+  const uint32_t rootvector = get32be(buf + 18);
+  const uint32_t framingvector = get32be(buf + 40);
+  if (rootvector == 0x00000008 && framingvector == 0x00000001)
+    return syncreceived(a);
+  if (rootvector != 0x00000004 || framingvector != 0x00000002 || len < 126)
+    return NULL;
+
+  const uint8_t options = buf[112];
+  if (options & 0xc0)
+    return NULL;  // Preview data or stream terminated.
+  if (buf[117] != 0x02 || buf[125] != 0)
+    return NULL;  // Not DMX levels.
+
+  const uint8_t seq = buf[111];
+  const uint16_t universe = get16be(buf + 113);
+  int datalen = get16be(buf + 123) - 1;
+  if (datalen > (int)len - 126)
+    datalen = len - 126;
+  return universereceived(a, universe, true, seq, buf + 126, datalen);
+}
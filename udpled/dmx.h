@@ -0,0 +1,41 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+Art-Net and sACN (E1.31) input: DMX universes are patched to pixels of the
+wall and written to an assembler.
+
+The patch file has one line per run of pixels:
+  <universe> <channel> <x> <y> <count> [<dx> <dy>] [<order>]
+"count" RGB pixels starting at DMX channel "channel" (1..512) of the
+universe go to x,y, x+dx,y+dy, ... (dx,dy default to 1,0; a snake is two
+lines). "order" is the order of the colors in the channels, default RGB.
+Empty lines and lines starting with # are ignored.
+
+Frames are shown when a sync packet (ArtSync, E1.31 synchronization)
+arrives. Without syncs in the last 4 seconds, a frame is shown as soon as
+all patched universes got new data, or a universe repeats before that.
+*/
+#ifndef UDPLED_DMX_H
+#define UDPLED_DMX_H
+
+#include "assembler.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+const int artnet_port = 6454;
+const int sacn_port = 5568;
+
+// Returns false and prints why if the file can't be used.
+bool dmx_loadpatch(const char *filename);
+
+// Patch the wall row by row, 170 pixels per universe from "firstuniverse".
+void dmx_defaultpatch(int width, int height, int firstuniverse);
+
+// Universes in the patch; for joining the sACN multicast groups.
+int dmx_universes(uint16_t *universes, int max);
+
+// Parse a datagram. Returns the tiles to show when it completed a frame,
+// NULL otherwise.
+uint16_t **dmx_artnet(const uint8_t *buf, size_t len, assembler_t *a);
+uint16_t **dmx_sacn(const uint8_t *buf, size_t len, assembler_t *a);
+
+#endif
@@ -0,0 +1,167 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// The refresh daemon: drives the matrix with the frames published in a
+// shared memory ring (see shmring.h) and does nothing else, so the refresh
+// doesn't share a process with the network threads, fonts and allocations
+// of the receiver. The receiver runs unprivileged, as a user of the ring's
+// group, and can be restarted while the last frame it sent stays on the
+// wall:
+//
+// $ sudo ./led-refreshd --shm-group=led &
+// $ ./udp --output=/udpled
+
+#include "led-matrix.h"
+#include "protocol.h"
+#include "shmring.h"
+#include "wall.h"
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using rgb_matrix::RGBMatrix;
+
+const char *shmname = "/udpled";
+const char *shmgroup = NULL;
+const int shmslots = 8;
+
+// The slots of the frames handed to the matrix, until its presentation
+// feedback says it's done with them: dropped, or off the screen again. It
+// keeps that for the last 64 frames.
+const int pendingcount = 64;
+uint64_t pendingsequence[pendingcount];
+int pendingslot[pendingcount];
+
+void releaseshown(RGBMatrix *matrix, shmring_t *r)
+{
+  rgb_matrix::FramePresentation feedback[8];
+  int n;
+  while ((n = matrix->GetPresentationFeedback(feedback, 8)) > 0)
+  {
+    for (int i = 0; i < n; i++)
+    {
+      int p = feedback[i].sequence % pendingcount;
+      if (pendingsequence[p] != feedback[i].sequence)
+        continue;
+      shmring_release(r, pendingslot[p]);
+      pendingsequence[p] = 0;
+    }
+  }
+}
+
+volatile bool interrupt_received = false;
+static void InterruptHandler(int signo)
+{
+  interrupt_received = true;
+}
+
+int usage(const char *progname, const RGBMatrix::Options &defaults,
+          const rgb_matrix::RuntimeOptions &runtime_defaults)
+{
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Options:\n"
+          "\t--shm=<name>    : Shared memory to take the frames from\n"
+          "\t                  (Default: /udpled).\n"
+          "\t--shm-group=<group>: Let the receiver use it as a user of this\n"
+          "\t                  group (Default: only root).\n\n");
+  rgb_matrix::PrintMatrixFlags(stderr, defaults, runtime_defaults);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  RGBMatrix::Options defaults;
+  rgb_matrix::RuntimeOptions runtime_defaults;
+  setmatrixdefaults(&defaults, &runtime_defaults);
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
+                                         &defaults, &runtime_defaults))
+    return usage(argv[0], defaults, runtime_defaults);
+
+  static const struct option longopts[] =
+  {
+    { "shm", required_argument, NULL, 'M' },
+    { "shm-group", required_argument, NULL, 'G' },
+    { NULL, 0, NULL, 0 },
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1)
+  {
+    switch (opt)
+    {
+    case 'M':
+      shmname = optarg;
+      break;
+    case 'G':
+      shmgroup = optarg;
+      break;
+    default:
+      return usage(argv[0], defaults, runtime_defaults);
+    }
+  }
+
+  // Before the matrix drops our privileges, so an old ring of ours can be
+  // removed.
+  shmring_t *r = shmring_create(shmname, screentiles_x, screentiles_y,
+                                shmslots, shmgroup);
+  if (!r)
+    return 1;
+
+  RGBMatrix *matrix =
+    rgb_matrix::CreateMatrixFromOptions(defaults, runtime_defaults);
+  if (matrix == NULL)
+  {
+    shmring_destroy(r);
+    return usage(argv[0], defaults, runtime_defaults);
+  }
+  matrix->Clear();
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = InterruptHandler;
+  sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT,  &sa, NULL);
+
+  const int tiles = screentiles_x * screentiles_y;
+  const int slots = shmring_slots(r);
+  uint16_t **tileptrs = (uint16_t**)malloc(slots * tiles * sizeof(uint16_t*));
+  for (int slot = 0; slot < slots; slot++)
+  {
+    for (int i = 0; i < tiles; i++)
+      tileptrs[slot * tiles + i] = shmring_frame(r, slot)
+        + i * tilepayloadsize / sizeof(uint16_t);
+  }
+
+  // Without new frames, the last one stays on.
+  rgb_matrix::FrameCanvas *canvas = matrix->CreateFrameCanvas();
+  while (!interrupt_received)
+  {
+    releaseshown(matrix, r);
+    uint64_t published;
+    int slot = shmring_take(r, 100000000, &published);
+    if (slot < 0)
+      continue;
+    // The slot count is the one we created the ring with, not what
+    // anyone may have written into its header since; never index
+    // tileptrs past it.
+    if (slot >= slots)
+    {
+      shmring_release(r, slot);
+      continue;
+    }
+
+    canvas->SetTilePtrs((void**)&tileptrs[slot * tiles]);
+    rgb_matrix::FrameCanvas *submitted = canvas;
+    canvas = matrix->SubmitFrame(canvas);
+    int p = submitted->sequence() % pendingcount;
+    pendingsequence[p] = submitted->sequence();
+    pendingslot[p] = slot;
+  }
+
+  delete matrix;
+  shmring_destroy(r);
+  free(tileptrs);
+  return 0;
+}
@@ -0,0 +1,202 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+
+#include "packetring.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/net_tstamp.h>
+#include <net/if.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// 16 blocks of 128 kB: 80 frames of a 4x3 wall, 16 of a 12x6 one.
+const unsigned blocksize = 128 << 10;
+const unsigned blockcount = 16;
+const unsigned framesize = 2048;    // Only a sanity check with TPACKET_V3.
+
+struct packetring
+{
+  int fd;
+  uint8_t *map;
+  size_t mapsize;
+  unsigned current;                 // Block we're at.
+  struct tpacket_block_desc *block; // Being read, NULL if none.
+  uint32_t left;                    // Packets left in it.
+  struct tpacket3_hdr *packet;      // Next one.
+};
+
+void packetring_close(packetring_t *r)
+{
+  if (r->map)
+    munmap(r->map, r->mapsize);
+  if (r->fd >= 0)
+    close(r->fd);
+  free(r);
+}
+
+packetring_t *packetring_open(const char *ifname, int port,
+                              bool hwtimestamps)
+{
+  packetring_t *r = (packetring_t*)calloc(1, sizeof(packetring_t));
+  r->fd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IP));
+  if (r->fd < 0)
+  {
+    printf("no packet socket: %s\n", strerror(errno));
+    packetring_close(r);
+    return NULL;
+  }
+
+  // The packets start at the IP header.
+  struct sock_filter code[] =
+  {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+             (uint32_t)(SKF_AD_OFF + SKF_AD_PKTTYPE)),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 10, 0),
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),          // Version, length.
+    BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xf0),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x40, 0, 7),
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),          // Protocol.
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 5),
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),          // Fragment.
+    BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3fff, 3, 0),
+    BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),         // Header length.
+    BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),          // Destination port.
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned)port, 1, 0),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+    BPF_STMT(BPF_RET | BPF_K, 0xffff),
+  };
+  struct sock_fprog filter = { sizeof(code) / sizeof(code[0]), code };
+  int version = TPACKET_V3;
+  struct tpacket_req3 req;
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = blocksize;
+  req.tp_block_nr = blockcount;
+  req.tp_frame_size = framesize;
+  req.tp_frame_nr = blocksize / framesize * blockcount;
+  req.tp_retire_blk_tov = packetring_blockms;
+  if (setsockopt(r->fd, SOL_SOCKET, SO_ATTACH_FILTER,
+                 &filter, sizeof(filter)) < 0
+      || setsockopt(r->fd, SOL_PACKET, PACKET_VERSION,
+                    &version, sizeof(version)) < 0
+      || setsockopt(r->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+  {
+    printf("can't set up the packet ring: %s\n", strerror(errno));
+    packetring_close(r);
+    return NULL;
+  }
+  int tsflags = SOF_TIMESTAMPING_RAW_HARDWARE;
+  if (hwtimestamps
+      && setsockopt(r->fd, SOL_PACKET, PACKET_TIMESTAMP,
+                    &tsflags, sizeof(tsflags)) < 0)
+    printf("no hardware timestamps in the packet ring: %s\n",
+           strerror(errno));
+
+  r->mapsize = (size_t)blocksize * blockcount;
+  void *map = mmap(NULL, r->mapsize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_LOCKED | MAP_POPULATE, r->fd, 0);
+  if (map == MAP_FAILED)
+    map = mmap(NULL, r->mapsize, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, r->fd, 0);
+  if (map == MAP_FAILED)
+  {
+    printf("can't map the packet ring: %s\n", strerror(errno));
+    packetring_close(r);
+    return NULL;
+  }
+  r->map = (uint8_t*)map;
+
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_IP);
+  addr.sll_ifindex = ifname ? if_nametoindex(ifname) : 0;
+  if ((ifname && addr.sll_ifindex == 0)
+      || bind(r->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    printf("can't bind the packet ring to %s: %s\n",
+           ifname ? ifname : "all interfaces", strerror(errno));
+    packetring_close(r);
+    return NULL;
+  }
+  return r;
+}
+
+int packetring_next(packetring_t *r, const uint8_t **data, size_t *len,
+                    uint64_t *stamp_ns, uint64_t timeout_ns)
+{
+  bool polled = false;
+  for (;;)
+  {
+    while (r->block && r->left > 0)
+    {
+      struct tpacket3_hdr *p = r->packet;
+      r->left--;
+      r->packet = (struct tpacket3_hdr*)((uint8_t*)p + p->tp_next_offset);
+
+      const uint8_t *ip = (const uint8_t*)p + p->tp_net;
+      size_t iplen = p->tp_snaplen - (p->tp_net - p->tp_mac);
+      size_t ihl = (ip[0] & 15) * 4;
+      if (iplen < ihl + 8)
+        continue;
+      const uint8_t *udp = ip + ihl;
+      size_t udplen = udp[4] << 8 | udp[5];
+      if (udplen < 8 || udplen > iplen - ihl)
+        continue;
+      *data = udp + 8;
+      *len = udplen - 8;
+      *stamp_ns = (uint64_t)p->tp_sec * 1000000000 + p->tp_nsec;
+      return 1;
+    }
+
+    if (r->block)
+    {
+      __atomic_store_n(&r->block->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                       __ATOMIC_RELEASE);
+      r->block = NULL;
+      r->current = (r->current + 1) % blockcount;
+    }
+
+    struct tpacket_block_desc *block = (struct tpacket_block_desc*)
+      (r->map + (size_t)r->current * blocksize);
+    if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+          & TP_STATUS_USER))
+    {
+      if (polled)
+        return 0;
+      struct pollfd pfd;
+      pfd.fd = r->fd;
+      pfd.events = POLLIN | POLLERR;
+      pfd.revents = 0;
+      struct timespec ts;
+      ts.tv_sec = timeout_ns / 1000000000;
+      ts.tv_nsec = timeout_ns % 1000000000;
+      if (ppoll(&pfd, 1, &ts, NULL) < 0 && errno != EINTR)
+        return -1;
+      polled = true;
+      continue;
+    }
+    r->block = block;
+    r->left = block->hdr.bh1.num_pkts;
+    r->packet = (struct tpacket3_hdr*)
+      ((uint8_t*)block + block->hdr.bh1.offset_to_first_pkt);
+  }
+}
+
+bool packetring_dropfilter(int s)
+{
+  struct sock_filter code[] =
+  {
+    BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog filter = { 1, code };
+  return setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER,
+                    &filter, sizeof(filter)) == 0;
+}
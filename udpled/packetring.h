@@ -0,0 +1,45 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+Receiving UDP datagrams from an AF_PACKET TPACKET_V3 ring.
+
+The kernel writes the IPv4 packets a BPF filter lets through (UDP to our
+port, not fragmented, not sent by us) into blocks of a ring mapped into our
+memory, and hands over a block when it's full or "packetring_blockms"
+milliseconds old. The datagrams are read from the blocks in place: no
+syscall or socket layer per datagram, one poll() per block.
+
+Fragmented datagrams don't make it through the filter, so the link's MTU
+has to fit the datagrams, like on loopback, veth or with jumbo frames.
+Needs CAP_NET_RAW. The datagrams still reach a socket bound to the port
+too; attach packetring_dropfilter() to it.
+*/
+#ifndef UDPLED_PACKETRING_H
+#define UDPLED_PACKETRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The most a datagram waits in a block that isn't full.
+const int packetring_blockms = 1;
+
+typedef struct packetring packetring_t;
+
+// Receive the datagrams to "port" on interface "ifname", NULL for all,
+// timestamped by the NIC if "hwtimestamps" and it's been told to.
+// Returns NULL and prints why if the ring can't be set up.
+packetring_t *packetring_open(const char *ifname, int port,
+                              bool hwtimestamps);
+
+// The next datagram, waiting up to "timeout_ns" for one. It stays valid
+// until the next call. Returns 1 with the UDP payload in "data" and "len"
+// and when it was received in "stamp_ns" (CLOCK_REALTIME, or the NIC's
+// clock), 0 on timeout, -1 on errors.
+int packetring_next(packetring_t *r, const uint8_t **data, size_t *len,
+                    uint64_t *stamp_ns, uint64_t timeout_ns);
+
+void packetring_close(packetring_t *r);
+
+// Make socket "s" drop everything it gets, so datagrams read from the ring
+// don't queue up there. Returns false if it can't.
+bool packetring_dropfilter(int s);
+
+#endif
@@ -0,0 +1,98 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+The UDP tile protocol, shared by the receiver (udp.cc) and the tools
+that send to it.
+
+Every datagram starts with a packethdr_t:
+  type 1: tile. xpos/ypos is the top left pixel of the tile, the payload
+          are 16x16 pixels of 16 bit red, green, blue, row by row.
+  type 2: pageflip. Show all tiles of the frame. The payload is optional:
+          a pageflippayload_t.
+  type 3: parity. The payloads of a group of tiles XORed together, so the
+          receiver can rebuild one lost tile of the group. xpos is the
+          first tile of the group (tiles counted row by row from the top
+          left), ypos the number of tiles in it. Sent before the pageflip.
+  type 4: control. Change how the wall shows the frames, with a
+          controlpayload_t; the frame number is not used. Applied between
+          two refreshes, without blanking.
+Frames are numbered by the sender; the receiver keeps the tiles of the
+last 16 frames apart by "frame & 15".
+
+Layers (udp --layer) are shown over the frames, each receiving on a port of
+its own. Their tiles stay until they're sent again, so a layer only sends
+the tiles that change, and the pageflip shows them; the frame numbers are
+not used. A tile without payload clears it, making it transparent again.
+*/
+#ifndef UDPLED_PROTOCOL_H
+#define UDPLED_PROTOCOL_H
+
+#include <math.h>
+#include <stdint.h>
+
+typedef struct
+{
+  union
+  {
+  struct
+  {
+    uint8_t type;
+    uint8_t frame;
+    union
+    {
+      struct
+      {
+        uint16_t xpos;
+        uint16_t ypos;
+      };
+      struct
+      {
+      };
+    };
+  };
+    char siz[8];
+  };
+} packethdr_t;
+
+enum
+{
+  packettype_tile = 1,
+  packettype_pageflip = 2,
+  packettype_parity = 3,
+  packettype_control = 4,
+};
+
+// What a pageflip can carry: when the sender started sending the frame, in
+// CLOCK_REALTIME nanoseconds. With the clocks of sender and receiver kept
+// together (PTP, NTP), the receiver can tell the one-way latency.
+typedef struct
+{
+  uint64_t sent_ns;
+} pageflippayload_t;
+
+// What a control packet sets; each field left at 0 stays as it is.
+typedef struct
+{
+  uint8_t brightness;       // 1..100 percent of the frames' values.
+  uint8_t pwm_bits;         // 1..11: show at most this many bits.
+  uint8_t dither_bits;      // 1..3: 0..2 bits time-dithered.
+  uint8_t pad;
+  uint16_t gamma;           // In hundredths, applied to the frames' values.
+  uint16_t idle_s;          // Show the idle screen after this many seconds
+                            // without frames; 65535: never.
+} controlpayload_t;
+
+const int udp_port = 9998;
+
+const int tilesize_x = 16;
+const int tilesize_y = 16;
+const int tilepayloadsize = tilesize_x*tilesize_y*3*sizeof(uint16_t);
+
+// The 16 bit linear value the tiles carry for an 8 bit color, with the
+// CIE1931 luminance correction luminance_cie1931() in lib/framebuffer.cc
+// does at "brightness" percent. Slow; meant for filling lookup tables.
+inline uint16_t cie1931_16(uint8_t c, int brightness = 100)
+{
+  float v = c * brightness / 255.0;
+  return 65504 * ((v <= 8) ? v / 902.3 : pow((v + 16) / 116.0, 3));
+}
+
+#endif
@@ -0,0 +1,335 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+
+#include "shmring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+const uint32_t shmmagic = 0x52444c55;   // "ULDR"
+const size_t pagesize = 4096;
+
+enum
+{
+  slot_free,
+  slot_writing,           // By a producer.
+  slot_ready,             // Published.
+  slot_held,              // By the receiver.
+};
+
+// At the start of the shared memory, followed by the frames, each starting
+// on a page.
+struct shmheader
+{
+  uint32_t magic;         // Written last.
+  uint32_t tiles_x;
+  uint32_t tiles_y;
+  uint32_t slots;
+  uint32_t doorbell;      // Futex word, bumped by each publish.
+  uint32_t pad;
+  uint64_t sequence;      // Of the last frame published.
+  uint32_t state[shmring_maxslots];
+  uint64_t published[shmring_maxslots];     // Its sequence.
+  uint64_t published_ns[shmring_maxslots];
+};
+
+// Anyone allowed to open the ring can write the header, so the sizes in it
+// are only read once, checked, and kept here.
+struct shmring
+{
+  int fd;
+  char *name;             // The receiver's, to remove it.
+  struct shmheader *hdr;
+  uint8_t *map;
+  size_t mapsize;
+  size_t framestride;
+  int tiles_x;
+  int tiles_y;
+  int slots;
+};
+
+static size_t framestride(int tiles_x, int tiles_y)
+{
+  size_t bytes = (size_t)tiles_x * tiles_y * 16 * 16 * 3 * sizeof(uint16_t);
+  return (bytes + pagesize - 1) / pagesize * pagesize;
+}
+
+static uint64_t clockns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Not FUTEX_PRIVATE_FLAG: the word is shared between processes.
+static void futexwait(uint32_t *word, uint32_t value, uint64_t timeout_ns)
+{
+  struct timespec ts;
+  ts.tv_sec = timeout_ns / 1000000000;
+  ts.tv_nsec = timeout_ns % 1000000000;
+  syscall(SYS_futex, word, FUTEX_WAIT, value, &ts, NULL, 0);
+}
+
+static void futexwake(uint32_t *word)
+{
+  syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// The 64 bit fields are written while others read them; atomic, so a
+// 32 bit CPU doesn't see half of a sequence number.
+static uint64_t published(const shmring_t *r, int slot)
+{
+  return __atomic_load_n(&r->hdr->published[slot], __ATOMIC_RELAXED);
+}
+
+static bool claim(shmring_t *r, int slot, uint32_t from, uint32_t to)
+{
+  return __atomic_compare_exchange_n(&r->hdr->state[slot], &from, to, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+shmring_t *shmring_create(const char *name, int tiles_x, int tiles_y,
+                          int slots, const char *group)
+{
+  if (slots < 2 || slots > shmring_maxslots)
+  {
+    printf("%s: can't have %d slots\n", name, slots);
+    return NULL;
+  }
+  struct group *gr = NULL;
+  if (group && !(gr = getgrnam(group)))
+  {
+    printf("%s: no group %s\n", name, group);
+    return NULL;
+  }
+  shm_unlink(name);
+  const mode_t mode = gr ? 0660 : 0600;
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, mode);
+  if (fd < 0)
+  {
+    printf("can't create %s: %s\n", name, strerror(errno));
+    return NULL;
+  }
+  if (gr && fchown(fd, -1, gr->gr_gid) < 0)
+  {
+    printf("can't give %s to group %s: %s\n", name, group, strerror(errno));
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+  fchmod(fd, mode);     // Regardless of the umask.
+
+  const size_t stride = framestride(tiles_x, tiles_y);
+  const size_t size = pagesize + stride * slots;
+  void *map = MAP_FAILED;
+  if (ftruncate(fd, size) == 0)
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    printf("can't map %s: %s\n", name, strerror(errno));
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+
+  shmring_t *r = (shmring_t*)calloc(1, sizeof(shmring_t));
+  r->fd = fd;
+  r->name = strdup(name);
+  r->map = (uint8_t*)map;
+  r->mapsize = size;
+  r->framestride = stride;
+  r->tiles_x = tiles_x;
+  r->tiles_y = tiles_y;
+  r->slots = slots;
+  r->hdr = (struct shmheader*)map;
+  r->hdr->tiles_x = tiles_x;
+  r->hdr->tiles_y = tiles_y;
+  r->hdr->slots = slots;
+  __atomic_store_n(&r->hdr->magic, shmmagic, __ATOMIC_RELEASE);
+  return r;
+}
+
+shmring_t *shmring_open(const char *name)
+{
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0)
+  {
+    printf("no frame ring %s: %s\n", name, strerror(errno));
+    return NULL;
+  }
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size > pagesize)
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    printf("can't map %s: %s\n", name, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  struct shmheader *hdr = (struct shmheader*)map;
+  const uint32_t magic = __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE);
+  const uint32_t tiles_x = hdr->tiles_x;
+  const uint32_t tiles_y = hdr->tiles_y;
+  const uint32_t slots = hdr->slots;
+  const size_t stride = framestride(tiles_x, tiles_y);
+  if (magic != shmmagic || tiles_x > 1024 || tiles_y > 1024
+      || slots < 2 || slots > (uint32_t)shmring_maxslots
+      || pagesize + stride * slots > (size_t)st.st_size)
+  {
+    printf("%s isn't a frame ring\n", name);
+    munmap(map, st.st_size);
+    close(fd);
+    return NULL;
+  }
+
+  shmring_t *r = (shmring_t*)calloc(1, sizeof(shmring_t));
+  r->fd = fd;
+  r->map = (uint8_t*)map;
+  r->mapsize = st.st_size;
+  r->framestride = stride;
+  r->tiles_x = tiles_x;
+  r->tiles_y = tiles_y;
+  r->slots = slots;
+  r->hdr = hdr;
+  return r;
+}
+
+int shmring_width(const shmring_t *r)
+{
+  return r->tiles_x * 16;
+}
+
+int shmring_height(const shmring_t *r)
+{
+  return r->tiles_y * 16;
+}
+
+int shmring_slots(const shmring_t *r)
+{
+  return r->slots;
+}
+
+uint16_t *shmring_frame(shmring_t *r, int slot)
+{
+  if (slot < 0 || slot >= r->slots)
+    return NULL;
+  return (uint16_t*)(r->map + pagesize + slot * r->framestride);
+}
+
+int shmring_acquire(shmring_t *r)
+{
+  const int slots = r->slots;
+  for (int tries = 0; tries < 4; tries++)
+  {
+    int oldest = -1;
+    for (int i = 0; i < slots; i++)
+    {
+      uint32_t state = __atomic_load_n(&r->hdr->state[i], __ATOMIC_RELAXED);
+      if (state == slot_free && claim(r, i, slot_free, slot_writing))
+        return i;
+      if (state == slot_ready
+          && (oldest < 0 || published(r, i) < published(r, oldest)))
+        oldest = i;
+    }
+    if (oldest >= 0 && claim(r, oldest, slot_ready, slot_writing))
+      return oldest;
+  }
+  return -1;
+}
+
+void shmring_publish(shmring_t *r, int slot)
+{
+  if (slot < 0 || slot >= r->slots)
+    return;
+  struct shmheader *hdr = r->hdr;
+  __atomic_store_n(&hdr->published[slot],
+                   __atomic_add_fetch(&hdr->sequence, 1, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&hdr->published_ns[slot], clockns(CLOCK_REALTIME),
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&hdr->state[slot], slot_ready, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&hdr->doorbell, 1, __ATOMIC_RELEASE);
+  futexwake(&hdr->doorbell);
+}
+
+int shmring_take(shmring_t *r, uint64_t timeout_ns, uint64_t *published_ns)
+{
+  struct shmheader *hdr = r->hdr;
+  const int slots = r->slots;
+  const uint64_t deadline = clockns(CLOCK_MONOTONIC) + timeout_ns;
+  for (;;)
+  {
+    uint32_t bell = __atomic_load_n(&hdr->doorbell, __ATOMIC_ACQUIRE);
+    int newest = -1;
+    for (int i = 0; i < slots; i++)
+    {
+      if (__atomic_load_n(&hdr->state[i], __ATOMIC_ACQUIRE) == slot_ready
+          && (newest < 0 || published(r, i) > published(r, newest)))
+        newest = i;
+    }
+    // A producer may take the slot back in between; look again.
+    if (newest >= 0 && claim(r, newest, slot_ready, slot_held))
+    {
+      // Drop the older frames. A slot is held while looking at it, so a
+      // producer can't publish a newer frame in it before it's freed.
+      const uint64_t taken = published(r, newest);
+      for (int i = 0; i < slots; i++)
+      {
+        if (i == newest || !claim(r, i, slot_ready, slot_held))
+          continue;
+        __atomic_store_n(&hdr->state[i],
+                         published(r, i) < taken ? slot_free : slot_ready,
+                         __ATOMIC_RELEASE);
+      }
+      *published_ns = __atomic_load_n(&hdr->published_ns[newest],
+                                      __ATOMIC_RELAXED);
+      return newest;
+    }
+    if (newest >= 0)
+      continue;
+
+    uint64_t now = clockns(CLOCK_MONOTONIC);
+    if (now >= deadline)
+      return -1;
+    futexwait(&hdr->doorbell, bell, deadline - now);
+  }
+}
+
+bool shmring_stale(shmring_t *r)
+{
+  struct stat st;
+  return fstat(r->fd, &st) < 0 || st.st_nlink == 0;
+}
+
+void shmring_release(shmring_t *r, int slot)
+{
+  if (slot < 0 || slot >= r->slots)
+    return;
+  __atomic_store_n(&r->hdr->state[slot], slot_free, __ATOMIC_RELEASE);
+}
+
+void shmring_close(shmring_t *r)
+{
+  munmap(r->map, r->mapsize);
+  close(r->fd);
+  free(r->name);
+  free(r);
+}
+
+void shmring_destroy(shmring_t *r)
+{
+  shm_unlink(r->name);
+  shmring_close(r);
+}
@@ -0,0 +1,99 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+A ring of frames in shared memory, for content sources on the same machine
+as the receiver (udp --shm=<name>).
+
+The receiver creates the ring. Producers draw straight into a free slot in
+the layout the tile packets have (see protocol.h): tile after tile, row by
+row from the top left, each 16x16 pixels of 16 bit linear red, green and
+blue. Then they publish the slot. The receiver hands its tiles to the
+matrix where they are, without copying them, and rings no bell back: a
+producer never waits. If no slot is free, it gets the oldest one published
+but not shown yet, so the newest frame wins.
+
+Publishing bumps a futex word in the ring, which the receiver sleeps on.
+
+  shmring_t *r = shmring_open("/udpled");
+  const int width = shmring_width(r);
+  for (;;)
+  {
+    int slot = shmring_acquire(r);
+    if (slot < 0)
+      continue;     // The receiver holds them all.
+    uint16_t *frame = shmring_frame(r, slot);
+    uint16_t *p = frame + shmring_pixel(width, x, y);  // For each pixel.
+    p[0] = red; p[1] = green; p[2] = blue;
+    shmring_publish(r, slot);
+    wait_for_the_next_frame();
+  }
+
+The ring is readable and writable by the receiver's user and, if it was
+given one, a group of producers. Either can write the ring's header, so the
+receiver trusts nothing in it but the slot states. Link with -lrt on glibc
+before 2.34. A producer has to open the ring again when the
+receiver was restarted; shmring_stale() tells.
+*/
+#ifndef UDPLED_SHMRING_H
+#define UDPLED_SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+const int shmring_maxslots = 16;
+
+typedef struct shmring shmring_t;
+
+// Producers.
+
+// Returns NULL and prints why if there's no ring "name" of a receiver.
+shmring_t *shmring_open(const char *name);
+
+// Size of the frames in pixels.
+int shmring_width(const shmring_t *r);
+int shmring_height(const shmring_t *r);
+
+// A slot to draw the next frame into; it's the producer's until published.
+// Returns -1 if the receiver holds all of them.
+int shmring_acquire(shmring_t *r);
+
+// The pixels of "slot"; NULL if there's no such slot.
+uint16_t *shmring_frame(shmring_t *r, int slot);
+
+// Where pixel "x", "y" is in a frame "width" pixels wide, in uint16_t.
+inline size_t shmring_pixel(int width, int x, int y)
+{
+  return ((size_t)((y / 16) * (width / 16) + x / 16) * 256
+          + (y % 16) * 16 + x % 16) * 3;
+}
+
+// Hand the frame in "slot" to the receiver.
+void shmring_publish(shmring_t *r, int slot);
+
+// Whether the receiver has gone and removed the ring, so frames published
+// don't get anywhere.
+bool shmring_stale(shmring_t *r);
+
+void shmring_close(shmring_t *r);
+
+// The receiver.
+
+// Create ring "name" with "slots" frames of "tiles_x" by "tiles_y" tiles,
+// replacing any old one. Only our user can open it, and "group" too if
+// not NULL. Returns NULL and prints why if it can't.
+shmring_t *shmring_create(const char *name, int tiles_x, int tiles_y,
+                          int slots, const char *group);
+
+int shmring_slots(const shmring_t *r);
+
+// Take the newest frame published, waiting up to "timeout_ns" for one.
+// Older ones not taken yet are dropped. Returns its slot, which stays
+// the receiver's until released, and when it was published in
+// "published_ns" (CLOCK_REALTIME); always less than shmring_slots().
+// Returns -1 on timeout.
+int shmring_take(shmring_t *r, uint64_t timeout_ns, uint64_t *published_ns);
+
+void shmring_release(shmring_t *r, int slot);
+
+// Remove the ring; producers still having it open can't tell.
+void shmring_destroy(shmring_t *r);
+
+#endif
@@ -0,0 +1,369 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// The tiles of a frame are packed into one buffer, packet after packet, so
+// a run of tiles can go out as one GSO send as well as one message each.
+
+#include "tile-sender.h"
+#include "protocol.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+const size_t tilepacketsize = sizeof(packethdr_t) + tilepayloadsize;
+
+// A GSO send is at most 64kB, in at most 64 segments.
+const int maxgsotiles = 65507 / tilepacketsize;
+
+struct tilesender
+{
+  int s;
+  tilesender_options_t opts;
+  int tiles_x;
+  int tiles_y;
+  int tiles;
+  int paritypackets;        // After the tiles in "packets".
+  uint8_t frame;
+  bool gso;
+  char *packets;            // tiles + paritypackets of tilepacketsize.
+  struct mmsghdr *msgs;
+  struct iovec *iovs;
+  uint16_t cie1931[256];
+};
+
+static uint64_t nowns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t realns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleepuntil(uint64_t ns)
+{
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+  {
+  }
+}
+
+void tilesender_defaults(tilesender_options_t *opts)
+{
+  memset(opts, 0, sizeof(*opts));
+  opts->host = "127.0.0.1";
+  opts->port = udp_port;
+  opts->fps = 60;
+  opts->groups = 8;
+  opts->gso = true;
+  opts->multicast_ttl = 1;
+}
+
+tilesender_t *tilesender_open(const tilesender_options_t *opts)
+{
+  if (opts->width <= 0 || opts->height <= 0 || opts->groups <= 0
+      || opts->paritygroup < 0)
+  {
+    fprintf(stderr, "tilesender: invalid frame size or groups\n");
+    return NULL;
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  char portstr[16];
+  snprintf(portstr, sizeof(portstr), "%d", opts->port);
+  struct addrinfo *addr;
+  int err = getaddrinfo(opts->host, portstr, &hints, &addr);
+  if (err != 0)
+  {
+    fprintf(stderr, "tilesender: %s: %s\n", opts->host, gai_strerror(err));
+    return NULL;
+  }
+
+  int s = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s < 0)
+  {
+    perror("tilesender: socket");
+    freeaddrinfo(addr);
+    return NULL;
+  }
+
+  struct sockaddr_in *sin = (struct sockaddr_in *)addr->ai_addr;
+  if (IN_MULTICAST(ntohl(sin->sin_addr.s_addr)))
+  {
+    unsigned char ttl = opts->multicast_ttl;
+    setsockopt(s, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    if (opts->multicast_if)
+    {
+      struct in_addr ifaddr;
+      if (inet_pton(AF_INET, opts->multicast_if, &ifaddr) != 1
+          || setsockopt(s, IPPROTO_IP, IP_MULTICAST_IF,
+                        &ifaddr, sizeof(ifaddr)) < 0)
+      {
+        fprintf(stderr, "tilesender: can't send from %s\n",
+                opts->multicast_if);
+        close(s);
+        freeaddrinfo(addr);
+        return NULL;
+      }
+    }
+  }
+
+  if (connect(s, addr->ai_addr, addr->ai_addrlen) < 0)
+  {
+    perror("tilesender: connect");
+    close(s);
+    freeaddrinfo(addr);
+    return NULL;
+  }
+  freeaddrinfo(addr);
+
+  tilesender_t *ts = (tilesender_t*)calloc(1, sizeof(tilesender_t));
+  ts->s = s;
+  ts->opts = *opts;
+  ts->tiles_x = (opts->width + tilesize_x - 1) / tilesize_x;
+  ts->tiles_y = (opts->height + tilesize_y - 1) / tilesize_y;
+  ts->tiles = ts->tiles_x * ts->tiles_y;
+  ts->paritypackets = opts->paritygroup > 0
+    ? (ts->tiles + opts->paritygroup - 1) / opts->paritygroup : 0;
+  const int packets = ts->tiles + ts->paritypackets;
+  ts->packets = (char*)calloc(packets, tilepacketsize);
+  ts->msgs = (struct mmsghdr*)calloc(packets, sizeof(struct mmsghdr));
+  ts->iovs = (struct iovec*)calloc(packets, sizeof(struct iovec));
+
+  // Room for a whole frame, so a burst doesn't block.
+  int sndbuf = ts->tiles * tilepacketsize * 2;
+  setsockopt(s, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+  int segment = tilepacketsize;
+  ts->gso = opts->gso
+    && setsockopt(s, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0;
+
+  for (int c = 0; c < 256; c++)
+    ts->cie1931[c] = cie1931_16(c);
+
+  for (int i = 0; i < ts->tiles; i++)
+  {
+    packethdr_t *hdr = (packethdr_t*)(ts->packets + i * tilepacketsize);
+    hdr->type = packettype_tile;
+    hdr->xpos = (i % ts->tiles_x) * tilesize_x;
+    hdr->ypos = (i / ts->tiles_x) * tilesize_y;
+  }
+  for (int p = 0; p < ts->paritypackets; p++)
+  {
+    packethdr_t *hdr =
+      (packethdr_t*)(ts->packets + (ts->tiles + p) * tilepacketsize);
+    const int first = p * opts->paritygroup;
+    hdr->type = packettype_parity;
+    hdr->xpos = first;
+    hdr->ypos = first + opts->paritygroup <= ts->tiles
+      ? opts->paritygroup : ts->tiles - first;
+  }
+  return ts;
+}
+
+// Send packets [first, last); returns the number not sent.
+static int sendtiles(tilesender_t *ts, int first, int last)
+{
+  int msgcount = 0;
+  for (int i = first; i < last; )
+  {
+    int n = ts->gso ? last - i : 1;
+    if (n > maxgsotiles)
+      n = maxgsotiles;
+    struct iovec *iov = &ts->iovs[msgcount];
+    iov->iov_base = ts->packets + i * tilepacketsize;
+    iov->iov_len = n * tilepacketsize;
+    struct msghdr *hdr = &ts->msgs[msgcount].msg_hdr;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_iov = iov;
+    hdr->msg_iovlen = 1;
+    msgcount++;
+    i += n;
+  }
+
+  int failed = 0;
+  for (int done = 0; done < msgcount; )
+  {
+    int sent = sendmmsg(ts->s, &ts->msgs[done], msgcount - done, 0);
+    if (sent > 0)
+    {
+      done += sent;
+      continue;
+    }
+    if (ts->gso && (errno == EIO || errno == EINVAL))
+    {
+      // No GSO on this route after all; send one by one from now on.
+      int off = 0;
+      setsockopt(ts->s, SOL_UDP, UDP_SEGMENT, &off, sizeof(off));
+      ts->gso = false;
+      int sentbefore = 0;
+      for (int m = 0; m < done; m++)
+        sentbefore += ts->iovs[m].iov_len / tilepacketsize;
+      return failed + sendtiles(ts, first + sentbefore, last);
+    }
+    failed += ts->iovs[done].iov_len / tilepacketsize;
+    done++;
+  }
+  return failed;
+}
+
+static void computeparity(tilesender_t *ts)
+{
+  const int words = tilepayloadsize / sizeof(uint64_t);
+  for (int p = 0; p < ts->paritypackets; p++)
+  {
+    char *packet = ts->packets + (ts->tiles + p) * tilepacketsize;
+    packethdr_t *hdr = (packethdr_t*)packet;
+    hdr->frame = ts->frame;
+    uint64_t *out = (uint64_t*)(packet + sizeof(packethdr_t));
+    memset(out, 0, tilepayloadsize);
+    for (int t = hdr->xpos; t < hdr->xpos + hdr->ypos; t++)
+    {
+      const uint64_t *in = (const uint64_t*)
+        (ts->packets + t * tilepacketsize + sizeof(packethdr_t));
+      for (int w = 0; w < words; w++)
+        out[w] ^= in[w];
+    }
+  }
+}
+
+static int sendframe(tilesender_t *ts)
+{
+  computeparity(ts);
+
+  const int groups = ts->opts.groups < ts->tiles ? ts->opts.groups : ts->tiles;
+  const uint64_t pace_ns = ts->opts.fps > 0
+    ? 750000000ull / ts->opts.fps : 0;
+  const uint64_t start = nowns();
+  const uint64_t sent = realns();
+  int failed = 0;
+  for (int g = 0; g < groups; g++)
+  {
+    if (pace_ns > 0 && g > 0)
+      sleepuntil(start + pace_ns * g / groups);
+    failed += sendtiles(ts, ts->tiles * g / groups,
+                        ts->tiles * (g + 1) / groups);
+  }
+  failed += sendtiles(ts, ts->tiles, ts->tiles + ts->paritypackets);
+
+  struct
+  {
+    packethdr_t hdr;
+    pageflippayload_t payload;
+  } __attribute__((packed)) flip;
+  memset(&flip, 0, sizeof(flip));
+  flip.hdr.type = packettype_pageflip;
+  flip.hdr.frame = ts->frame;
+  flip.payload.sent_ns = sent;
+  if (send(ts->s, &flip, sizeof(flip), 0) < 0)
+    failed++;
+
+  ts->frame++;
+  return failed;
+}
+
+int tilesender_send16(tilesender_t *ts, const uint16_t *rgb, int stride)
+{
+  const int w = ts->opts.width;
+  const int h = ts->opts.height;
+  if (stride == 0)
+    stride = w;
+  for (int i = 0; i < ts->tiles; i++)
+  {
+    char *packet = ts->packets + i * tilepacketsize;
+    ((packethdr_t*)packet)->frame = ts->frame;
+    uint16_t *out = (uint16_t*)(packet + sizeof(packethdr_t));
+    const int x0 = (i % ts->tiles_x) * tilesize_x;
+    const int y0 = (i / ts->tiles_x) * tilesize_y;
+    for (int y = 0; y < tilesize_y; y++, out += tilesize_x * 3)
+    {
+      const int cols = x0 + tilesize_x <= w ? tilesize_x : w - x0;
+      if (y0 + y >= h)
+      {
+        memset(out, 0, tilesize_x * 3 * sizeof(uint16_t));
+        continue;
+      }
+      memcpy(out, rgb + ((y0 + y) * stride + x0) * 3,
+             cols * 3 * sizeof(uint16_t));
+      if (cols < tilesize_x)
+        memset(out + cols * 3, 0, (tilesize_x - cols) * 3 * sizeof(uint16_t));
+    }
+  }
+  return sendframe(ts);
+}
+
+int tilesender_send8(tilesender_t *ts, const uint8_t *rgb, int stride)
+{
+  const int w = ts->opts.width;
+  const int h = ts->opts.height;
+  if (stride == 0)
+    stride = w;
+  for (int i = 0; i < ts->tiles; i++)
+  {
+    char *packet = ts->packets + i * tilepacketsize;
+    ((packethdr_t*)packet)->frame = ts->frame;
+    uint16_t *out = (uint16_t*)(packet + sizeof(packethdr_t));
+    const int x0 = (i % ts->tiles_x) * tilesize_x;
+    const int y0 = (i / ts->tiles_x) * tilesize_y;
+    for (int y = 0; y < tilesize_y; y++)
+      for (int x = 0; x < tilesize_x; x++, out += 3)
+      {
+        if (x0 + x >= w || y0 + y >= h)
+        {
+          out[0] = out[1] = out[2] = 0;
+          continue;
+        }
+        const uint8_t *in = rgb + ((y0 + y) * stride + x0 + x) * 3;
+        out[0] = ts->cie1931[in[0]];
+        out[1] = ts->cie1931[in[1]];
+        out[2] = ts->cie1931[in[2]];
+      }
+  }
+  return sendframe(ts);
+}
+
+int tilesender_control(tilesender_t *ts, const controlpayload_t *control)
+{
+  struct
+  {
+    packethdr_t hdr;
+    controlpayload_t payload;
+  } __attribute__((packed)) packet;
+  memset(&packet, 0, sizeof(packet));
+  packet.hdr.type = packettype_control;
+  packet.payload = *control;
+  return send(ts->s, &packet, sizeof(packet), 0) < 0 ? -1 : 0;
+}
+
+void tilesender_close(tilesender_t *ts)
+{
+  if (ts == NULL)
+    return;
+  close(ts->s);
+  free(ts->packets);
+  free(ts->msgs);
+  free(ts->iovs);
+  free(ts);
+}
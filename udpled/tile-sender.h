@@ -0,0 +1,72 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+Sender side of the UDP tile protocol (see protocol.h), for content sources.
+
+A frame is split into the receiver's 16x16 tiles, which are sent with
+sendmmsg(), optionally as UDP GSO batches, followed by the pageflip, which
+carries when the frame was started for the receiver's latency figures. With
+"fps" set, the tiles are spread evenly over 3/4 of the frame interval
+instead of sent in one burst, so the receiver's socket buffer doesn't
+overflow; the rest of the interval is left to render the next frame.
+
+  tilesender_options_t opts;
+  tilesender_defaults(&opts);
+  opts.host = "239.1.2.3";      // Unicast or multicast.
+  opts.width = 64;
+  opts.height = 48;
+  tilesender_t *s = tilesender_open(&opts);
+  for (;;)
+  {
+    render(pixels);
+    tilesender_send8(s, pixels, 0);
+  }
+*/
+#ifndef UDPLED_TILE_SENDER_H
+#define UDPLED_TILE_SENDER_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+typedef struct
+{
+  const char *host;         // Receiver, or multicast group.
+  int port;                 // Default: udp_port.
+  int width;                // Of the frames in pixels.
+  int height;
+  int fps;                  // For pacing; 0 sends each frame in one burst.
+  int groups;               // Pacing steps per frame. Default: 8.
+  int paritygroup;          // Tiles per parity packet, so the receiver can
+                            // rebuild one lost tile of each group.
+                            // Default: 0, no parity.
+  bool gso;                 // Use UDP_SEGMENT if the kernel has it.
+  int multicast_ttl;        // Default: 1, stay in the local network.
+  const char *multicast_if; // Address of the interface to send from.
+} tilesender_options_t;
+
+typedef struct tilesender tilesender_t;
+
+void tilesender_defaults(tilesender_options_t *opts);
+
+// Returns NULL and prints why if the target can't be set up.
+tilesender_t *tilesender_open(const tilesender_options_t *opts);
+
+// Send a frame of interleaved red, green and blue; "stride" is the distance
+// of the rows in pixels, 0 for "width". Frames smaller than the wall leave
+// the tiles outside of it alone; partial tiles at the right and bottom
+// edge are filled with black.
+// Returns the number of packets that couldn't be sent.
+
+// 16 bits per color, linear, as the receiver shows them.
+int tilesender_send16(tilesender_t *s, const uint16_t *rgb, int stride);
+
+// 8 bits per color, with the same CIE1931 luminance correction the
+// library applies to SetPixel().
+int tilesender_send8(tilesender_t *s, const uint8_t *rgb, int stride);
+
+// Change how the receiver shows the frames: the fields of "control" that
+// aren't 0. Returns 0, or -1 if it couldn't be sent.
+int tilesender_control(tilesender_t *s, const controlpayload_t *control);
+
+void tilesender_close(tilesender_t *s);
+
+#endif
@@ -0,0 +1,113 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+
+#include "tileslab.h"
+
+#include <stdlib.h>
+
+struct tileslab
+{
+  char *base;
+  size_t stride;
+  int count;
+  uint32_t *refs;
+  int32_t *next;            // Links of both free lists.
+  int32_t local;            // The owner's free list; -1 if empty.
+  int32_t shared;           // Pushed by anyone; -1 if empty.
+  uint64_t dry;
+};
+
+// To find the slab of a pointer. Only added to, before the receive threads
+// run.
+const int maxslabs = 8;
+tileslab_t *slabs[maxslabs];
+int slabcount;
+
+tileslab_t *tileslab_create(size_t stride, int count)
+{
+  return tileslab_wrap(calloc(count, stride), stride, count);
+}
+
+tileslab_t *tileslab_wrap(void *base, size_t stride, int count)
+{
+  if (slabcount == maxslabs)
+    return NULL;
+  tileslab_t *s = (tileslab_t*)calloc(1, sizeof(tileslab_t));
+  s->base = (char*)base;
+  s->stride = stride;
+  s->count = count;
+  s->refs = (uint32_t*)calloc(count, sizeof(uint32_t));
+  s->next = (int32_t*)malloc(count * sizeof(int32_t));
+  for (int i = 0; i < count; i++)
+    s->next[i] = i + 1 < count ? i + 1 : -1;
+  s->local = 0;
+  s->shared = -1;
+  // Only created by one thread; the pointer is there before the count says
+  // so.
+  slabs[slabcount] = s;
+  __atomic_store_n(&slabcount, slabcount + 1, __ATOMIC_RELEASE);
+  return s;
+}
+
+int tileslab_alloc(tileslab_t *s)
+{
+  if (s->local < 0)
+    s->local = __atomic_exchange_n(&s->shared, -1, __ATOMIC_ACQUIRE);
+  if (s->local < 0)
+  {
+    __atomic_store_n(&s->dry, s->dry + 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  int i = s->local;
+  s->local = s->next[i];
+  __atomic_store_n(&s->refs[i], 1, __ATOMIC_RELAXED);
+  return i;
+}
+
+char *tileslab_buf(tileslab_t *s, int i)
+{
+  return s->base + i * s->stride;
+}
+
+// The slab and buffer "p" points into; NULL if none.
+static tileslab_t *slabof(const void *p, int *i)
+{
+  const char *c = (const char*)p;
+  const int count = __atomic_load_n(&slabcount, __ATOMIC_ACQUIRE);
+  for (int n = 0; n < count; n++)
+  {
+    tileslab_t *s = slabs[n];
+    if (c >= s->base && c < s->base + s->count * s->stride)
+    {
+      *i = (c - s->base) / s->stride;
+      return s;
+    }
+  }
+  return NULL;
+}
+
+void tileslab_ref(const void *p)
+{
+  int i;
+  tileslab_t *s = slabof(p, &i);
+  if (s)
+    __atomic_add_fetch(&s->refs[i], 1, __ATOMIC_RELAXED);
+}
+
+void tileslab_unref(const void *p)
+{
+  int i;
+  tileslab_t *s = slabof(p, &i);
+  if (!s || __atomic_sub_fetch(&s->refs[i], 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  int32_t head = __atomic_load_n(&s->shared, __ATOMIC_RELAXED);
+  do
+  {
+    s->next[i] = head;
+  } while (!__atomic_compare_exchange_n(&s->shared, &head, i, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+uint64_t tileslab_dry(const tileslab_t *s)
+{
+  return __atomic_load_n(&s->dry, __ATOMIC_RELAXED);
+}
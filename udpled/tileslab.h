@@ -0,0 +1,48 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+A slab of fixed size buffers with reference counts, for the tiles the
+receive threads read datagrams into.
+
+Each receive thread has a slab of its own and is the only one allocating
+from it. Any thread can take and drop references. The buffer whose last
+reference goes is pushed on the slab's shared free list with a
+compare-and-swap; the owner takes that whole list over in one exchange
+when its own runs out. Nobody locks or waits, and as only the owner takes
+from the shared list, pushes can't be confused by a buffer coming back
+(no ABA).
+
+The memory is fixed when the slab is created. When all buffers are
+referenced, tileslab_alloc() fails: the receiver drops the datagram, and
+tileslab_dry() counts how often.
+*/
+#ifndef UDPLED_TILESLAB_H
+#define UDPLED_TILESLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct tileslab tileslab_t;
+
+// "count" buffers of "stride" bytes, one after the other. Create all slabs
+// from one thread, before the threads taking references run.
+tileslab_t *tileslab_create(size_t stride, int count);
+
+// The same for memory that is already there, like the frames of a shmring.
+// References to a buffer "p" points into then tell when all are done with
+// it: tileslab_alloc() returns it again once the last one went.
+tileslab_t *tileslab_wrap(void *base, size_t stride, int count);
+
+// A free buffer, holding one reference; only for the slab's owner.
+// Returns -1 if there's none.
+int tileslab_alloc(tileslab_t *s);
+
+char *tileslab_buf(tileslab_t *s, int i);
+
+// Take or drop a reference to the buffer "p" points into, of any slab.
+// Pointers to elsewhere, like NULL, are ignored.
+void tileslab_ref(const void *p);
+void tileslab_unref(const void *p);
+
+// Allocations that failed.
+uint64_t tileslab_dry(const tileslab_t *s);
+
+#endif
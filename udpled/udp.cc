@@ -4,8 +4,6 @@ make  # compile library
 g++ -Wall -O3 -g -Iinclude simple-udp.cc -o simple-udp -Llib -lrgbmatrix -lrt -lm -lpthread
 */
 
-#define VALTAVAMATRIISI
-
 #include <errno.h>
 #include <unistd.h>
 #include <unistd.h>
@@ -14,16 +12,22 @@ g++ -Wall -O3 -g -Iinclude simple-udp.cc -o simple-udp -Llib -lrgbmatrix -lrt -l
        #include <sys/resource.h>
 
 #include <linux/sockios.h>
-static inline pid_t gettid()
-{
-    return syscall(SYS_gettid);
-}
 
 #include <assert.h>
 
 
 #include "led-matrix.h"
 #include "graphics.h"
+#include "trace.h"
+#include "protocol.h"
+#include "capture.h"
+#include "dmx.h"
+#include "ddp.h"
+#include "uring.h"
+#include "packetring.h"
+#include "shmring.h"
+#include "tileslab.h"
+#include "wall.h"
 #include <arpa/inet.h>
 #include <signal.h>
 #include <stdio.h>
@@ -32,9 +36,16 @@ static inline pid_t gettid()
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <netinet/udp.h>
+#include <net/if.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 #include <unistd.h>
 #include <sys/time.h> 
 
+#include <getopt.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <math.h>
 
 #define debugf(...) fprintf(stderr, __VA_ARGS__)
@@ -97,7 +108,7 @@ static void InterruptHandler(int signo)
 
 
 
-void centertext(rgb_matrix::FrameCanvas *swap_buffer, rgb_matrix::Font& font, int y, const char *txt)
+void centertext(rgb_matrix::Canvas *swap_buffer, rgb_matrix::Font& font, int y, const char *txt)
 {
   const int fx = 4;
   rgb_matrix::Color white = rgb_matrix::Color(200,200,200);
@@ -111,48 +122,51 @@ void centertext(rgb_matrix::FrameCanvas *swap_buffer, rgb_matrix::Font& font, in
 
 
 
+// A frame in the tile layout, drawn into like a FrameCanvas with luminance
+// correction; for the idle screen with --output.
+class TileCanvas : public rgb_matrix::Canvas
+{
+public:
+  TileCanvas(uint16_t *pixels) : pixels_(pixels), brightness_(100) {}
+
+  virtual int width() const { return screentiles_x * tilesize_x; }
+  virtual int height() const { return screentiles_y * tilesize_y; }
+  virtual void SetPixel(int x, int y,
+                        uint8_t red, uint8_t green, uint8_t blue) {
+    SetPixelHDR(x, y, cie1931_16(red, brightness_),
+                cie1931_16(green, brightness_), cie1931_16(blue, brightness_));
+  }
+  virtual void Clear() { Fill(0, 0, 0); }
+  virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) {
+    for (int y = 0; y < height(); y++)
+      for (int x = 0; x < width(); x++)
+        SetPixel(x, y, red, green, blue);
+  }
+
+  void SetPixelHDR(int x, int y, uint16_t red, uint16_t green, uint16_t blue) {
+    if (x < 0 || y < 0 || x >= width() || y >= height())
+      return;
+    uint16_t *p = pixels_ + shmring_pixel(width(), x, y);
+    p[0] = red;
+    p[1] = green;
+    p[2] = blue;
+  }
+  void SetBrightness(uint8_t brightness) { brightness_ = brightness; }
+  void set_luminance_correct(bool on) {}
+
+private:
+  uint16_t *pixels_;
+  int brightness_;
+};
 
 RGBMatrix *matrix;
 rgb_matrix::FrameCanvas *swap_buffer;
   rgb_matrix::Font font;
 
-pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
-uint16_t** sync_data;
-
-void *frametuuperthread(void *x_void_ptr)
+// The screen shown while no frames come in, into a FrameCanvas or a
+// TileCanvas.
+template <class C> void drawidle(C *swap_buffer)
 {
-   pthread_setname_np(pthread_self(), "udp: frametuup");
-
-  while(1)
-  {
-    pthread_mutex_lock (&sync_lock);
-
-    struct timespec ts;
-    struct timeval now;
-
-    gettimeofday(&now,NULL);
-
-    ts.tv_sec = now.tv_sec+3;
-    ts.tv_nsec = now.tv_usec*1000;
-
-
-    int condval = pthread_cond_timedwait (&sync_cond, &sync_lock, &ts);
-    //int condval = pthread_cond_wait (&sync_cond, &sync_lock);
-
-    if (condval == 0)
-    {
-      swap_buffer->SetTilePtrs((void**)sync_data);
-      pthread_mutex_unlock (&sync_lock);
-
-      swap_buffer = matrix->SwapOnVSync(swap_buffer);
-    }
-    else if (condval == ETIMEDOUT)
-    {
- //     debugf("swap buf: %p", swap_buffer);
-      swap_buffer->SetTilePtrs(0);
-      pthread_mutex_unlock (&sync_lock);
-
       debugf("showing screen %i,%i\n", swap_buffer->width(), swap_buffer->height());
 
       swap_buffer->SetBrightness(30);
@@ -182,119 +196,770 @@ void *frametuuperthread(void *x_void_ptr)
       const char *myip = getip();
       centertext(swap_buffer, font, swap_buffer->height() - 8, myip);
 #endif
+}
+
 
-      swap_buffer = matrix->SwapOnVSync(swap_buffer);
+pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+// When a frame got where, in realns() time; 0 where not known.
+typedef struct
+{
+  uint32_t key;
+  int tiles;                // Received or recovered.
+  uint64_t sent_ns;         // Sent, as the sender's pageflip says.
+  uint64_t first_ns;        // The first piece arrived.
+  uint64_t last_ns;         // The last tile arrived.
+  uint64_t flip_ns;         // The pageflip arrived.
+  uint64_t finished_ns;     // Handed to the frametuuper.
+  uint64_t shown_ns;        // The first refresh showing it started.
+} frametimes_t;
+
+// Layers over the frames, from --layer: bottom first, each receiving the
+// tile protocol on a port of its own (see layerloop()).
+const int maxlayers = rgb_matrix::FrameCanvas::kMaxTileLayers;
+typedef struct
+{
+  int port;
+  rgb_matrix::TileLayer::Blend blend;
+  int x0, y0, x1, y1;       // The tiles it may cover: x0 <= x < x1.
+  int s;
+  // Tiles received for the next pageflip; NULL and changed: cleared.
+  uint16_t *next[screentiles_x*screentiles_y];
+  bool changed[screentiles_x*screentiles_y];
+  // The tiles since the last pageflip, under sync_lock.
+  uint16_t *shown[screentiles_x*screentiles_y];
+} layer_t;
+layer_t layers[maxlayers];
+int layercount = 0;
+
+// The tiles of a frame of the tile protocol, each holding a reference
+// until the frametuuper is done with it: the frame slots they came in are
+// reused 16 frames later, and the tiles for new datagrams after that, while
+// the matrix may still be showing the frame.
+const int heldframecount = 16;
+typedef struct
+{
+  bool used;
+  uint16_t *tiles[screentiles_x*screentiles_y];
+  // The layers' tiles shown with them; see holdlayers().
+  uint16_t *layers[maxlayers][screentiles_x*screentiles_y];
+} heldframe_t;
+heldframe_t heldframes[heldframecount];
+
+// Hold on to "tiles"; NULL if too many frames are held already.
+heldframe_t *holdframe(uint16_t **tiles)
+{
+  for (int i = 0; i < heldframecount; i++)
+  {
+    heldframe_t *f = &heldframes[i];
+    bool unused = false;
+    if (!__atomic_compare_exchange_n(&f->used, &unused, true, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      continue;
+    for (int t = 0; t < screentiles_x*screentiles_y; t++)
+    {
+      f->tiles[t] = tiles[t];
+      tileslab_ref(tiles[t]);
     }
+    memset(f->layers, 0, sizeof(f->layers));
+    return f;
   }
-
   return NULL;
+}
 
+void releaseframe(heldframe_t *f)
+{
+  if (!f)
+    return;
+  for (int t = 0; t < screentiles_x*screentiles_y; t++)
+    tileslab_unref(f->tiles[t]);
+  for (int l = 0; l < layercount; l++)
+  {
+    for (int t = 0; t < screentiles_x*screentiles_y; t++)
+      tileslab_unref(f->layers[l][t]);
+  }
+  __atomic_store_n(&f->used, false, __ATOMIC_RELEASE);
 }
 
+uint16_t** sync_data;
+frametimes_t sync_times;
+heldframe_t *sync_frame;    // Of sync_data, until the frametuuper takes it.
+bool sync_new;              // sync_data wasn't taken yet.
+controlpayload_t sync_control;  // Control packets not applied yet.
+bool sync_controlled;
+bool sync_layered;          // A layer's pageflip changed its tiles.
+
+// Have "f" hold on to the tiles the layers show now too; under sync_lock.
+void holdlayers(heldframe_t *f)
+{
+  for (int l = 0; l < layercount; l++)
+  {
+    for (int t = 0; t < screentiles_x*screentiles_y; t++)
+    {
+      f->layers[l][t] = layers[l].shown[t];
+      tileslab_ref(f->layers[l][t]);
+    }
+  }
+}
 
+// With layers, the frame taken last, to show again when they change.
+heldframe_t *lastframe;
 
-rgb_matrix::FrameCanvas *creatematrix(int argc, char **argv)
+// Hold the frame of "tiles", already held by "f" if not NULL, or the last
+// frame again if "tiles" is NULL, with the tiles the layers show now;
+// under sync_lock. Returns NULL if too many frames are held already.
+heldframe_t *holdlayered(uint16_t **tiles, heldframe_t *f)
 {
-  RGBMatrix::Options defaults;
-  defaults.hardware_mapping = "regular";  // or e.g. "adafruit-hat"
-#ifdef VALTAVAMATRIISI
-  defaults.rows = 16;
-  defaults.cols = 64;
-  defaults.chain_length = 1;
-  defaults.multiplexing = 7;
-  defaults.parallel = 3;
-#else
-  defaults.rows = 32;
-  defaults.cols = 64;
-  defaults.chain_length = 3;
-  defaults.multiplexing = 0;
-  defaults.parallel = 3;
-#endif
+  if (tiles)
+  {
+    if (!f)
+      f = holdframe(tiles);
+    releaseframe(lastframe);
+    lastframe = f ? holdframe(f->tiles) : NULL;
+  }
+  else
+  {
+    f = lastframe ? holdframe(lastframe->tiles) : NULL;
+  }
+  if (f)
+    holdlayers(f);
+  return f;
+}
 
-  defaults.show_refresh_rate = true;
-  //defaults.pwm_lsb_nanoseconds = 50;
+// The layers "f" holds, for the matrix. Returns how many there are.
+int tilelayers(heldframe_t *f, rgb_matrix::TileLayer *out)
+{
+  for (int l = 0; l < layercount; l++)
+  {
+    out[l].tiles = (void**)f->layers[l];
+    out[l].blend = layers[l].blend;
+  }
+  return layercount;
+}
 
+// Have the frametuuper show these tiles; they need to stay valid until
+// the matrix is done with them. They do if "frame" holds them: it's
+// released when they're no longer needed.
+void showtiles(uint16_t **tiles, const frametimes_t &times,
+               heldframe_t *frame = NULL)
+{
+  pthread_mutex_lock(&sync_lock);
+  heldframe_t *replaced = sync_frame;
+  sync_data = tiles;
+  sync_times = times;
+  sync_frame = frame;
+  sync_new = true;
+  pthread_cond_signal(&sync_cond);
+  pthread_mutex_unlock(&sync_lock);
+  releaseframe(replaced);
+}
 
- // --led-multiplexing=7 --led-cols=64 --led-rows=16 --led-parallel=3 --led-slowdown-gpio=2 
+// Have the frametuuper apply a control packet; merged with those before
+// that it didn't get to yet.
+void requestcontrol(const controlpayload_t &c)
+{
+  pthread_mutex_lock(&sync_lock);
+  if (c.brightness)
+    sync_control.brightness = c.brightness;
+  if (c.pwm_bits)
+    sync_control.pwm_bits = c.pwm_bits;
+  if (c.dither_bits)
+    sync_control.dither_bits = c.dither_bits;
+  if (c.gamma)
+    sync_control.gamma = c.gamma;
+  if (c.idle_s)
+    sync_control.idle_s = c.idle_s;
+  sync_controlled = true;
+  pthread_cond_signal(&sync_cond);
+  pthread_mutex_unlock(&sync_lock);
+}
 
-  rgb_matrix::RuntimeOptions runtime_defaults;
-  runtime_defaults.drop_privileges = 1;
-  runtime_defaults.gpio_slowdown = 3;
-
-  matrix = rgb_matrix::CreateMatrixFromFlags(&argc, &argv,
-                                                        &defaults,
-                                                        &runtime_defaults);
-  if (matrix == NULL) {
-    PrintMatrixFlags(stderr, defaults, runtime_defaults);
-    return NULL;
-  }
+const char *tracecat = "udp";
+const char *tracefile = NULL;
+int recvport = udp_port;
+const char *multicastgroup = NULL;
+const char *capturefile = NULL;
 
-//  matrix->ApplyStaticTransformer(rgb_matrix::DoubleAbsenTransformer());
+// With --bench, there is no matrix: frames are only counted, to see how
+// much the receiver can take.
+bool benchmode = false;
+
+uint64_t nowns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-  matrix->Clear();
+// Wall clock time, which the kernel's receive timestamps and the senders'
+// pageflips are in.
+uint64_t realns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-  return matrix->CreateFrameCanvas();
+const int latencybucket_us = 100;
+const int latencybuckets = 1000;
 
- 
+// The bucket of the time from "from_ns" to "to_ns"; 0 if the clocks
+// they're from disagree and it's negative.
+int latencybucket(uint64_t from_ns, uint64_t to_ns)
+{
+  int64_t us = (int64_t)(to_ns - from_ns) / 1000;
+  if (us < 0)
+    return 0;
+  return us / latencybucket_us < latencybuckets
+    ? us / latencybucket_us : latencybuckets - 1;
 }
 
-void setsignal()
+typedef struct
 {
-  struct sigaction sa;
-  sa.sa_handler = InterruptHandler;
-  sa.sa_flags = SA_RESETHAND | SA_NODEFER;
-  sigaction(SIGTERM, &sa, NULL);
-  sigaction(SIGINT,  &sa, NULL);
+  uint64_t pageflips;
+  uint64_t frames_taken;      // Picked up by the frametuuper.
+  uint64_t tiles;             // Tiles of the pageflipped frames.
+  uint64_t complete_frames;
+  uint64_t recovered;         // Tiles rebuilt from parity.
+  uint64_t concealed;         // Tiles repeated from the frame before.
+  uint64_t waited;            // Pageflips that waited for tiles.
+  uint64_t dropped;           // Incomplete frames not shown.
+  uint64_t nobuffer;          // Datagrams dropped for want of tile buffers.
+  uint64_t layerflips;        // Layer pageflips that changed tiles.
+  uint64_t relayered;         // Frames shown again for them.
+  uint32_t latency_hist[latencybuckets];  // First tile to pageflip.
+  uint32_t oneway_hist[latencybuckets];   // Sent to shown.
+  uint32_t display_hist[latencybuckets];  // Pageflip arrived to shown.
+} benchstats_t;
+
+pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+benchstats_t benchstats;
+
+// A frame with "tiles" tiles is complete; its first piece arrived at
+// "first_ns", 0 if not known.
+void benchpageflip(uint64_t first_ns, int tiles, int recovered,
+                   int concealed, int alltiles)
+{
+  int bucket = first_ns ? latencybucket(first_ns, realns()) : 0;
+
+  pthread_mutex_lock(&bench_lock);
+  benchstats.pageflips++;
+  benchstats.tiles += tiles + recovered;
+  benchstats.recovered += recovered;
+  benchstats.concealed += concealed;
+  if (tiles + recovered >= alltiles)
+    benchstats.complete_frames++;
+  if (first_ns)
+    benchstats.latency_hist[bucket]++;
+  pthread_mutex_unlock(&bench_lock);
 }
 
+void benchcount(uint64_t *counter)
+{
+  pthread_mutex_lock(&bench_lock);
+  (*counter)++;
+  pthread_mutex_unlock(&bench_lock);
+}
 
- 
+// The frame number in the packets is only 8 bits. For tracing, extend it
+// relative to the newest frame seen, so frames stay apart in longer traces.
+uint32_t lastframekey = 0;
+uint32_t framekey(uint8_t frame)
+{
+  uint32_t last = __atomic_load_n(&lastframekey, __ATOMIC_RELAXED);
+  uint32_t key = last + (int8_t)(frame - (uint8_t)last);
+  if ((int32_t)(key - last) > 0)
+    __atomic_compare_exchange_n(&lastframekey, &last, key, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  return key;
+}
+
+FILE *frametimesfile = NULL;
+
+// A frame was shown, or dropped by the matrix if "times.shown_ns" is 0.
+void recordframe(const frametimes_t &times)
+{
+  if (frametimesfile)
+    fprintf(frametimesfile, "%u %d %llu %llu %llu %llu %llu %llu\n",
+            times.key, times.tiles, (unsigned long long)times.sent_ns,
+            (unsigned long long)times.first_ns,
+            (unsigned long long)times.last_ns,
+            (unsigned long long)times.flip_ns,
+            (unsigned long long)times.finished_ns,
+            (unsigned long long)times.shown_ns);
+  if (benchmode && times.shown_ns)
+  {
+    pthread_mutex_lock(&bench_lock);
+    if (times.sent_ns)
+      benchstats.oneway_hist[latencybucket(times.sent_ns, times.shown_ns)]++;
+    if (times.flip_ns)
+      benchstats.display_hist[latencybucket(times.flip_ns, times.shown_ns)]++;
+    pthread_mutex_unlock(&bench_lock);
+  }
+}
 
+// Frames handed to the matrix, until its presentation feedback tells when
+// they were shown, and that they're off the screen again. It keeps that for
+// the last 64 frames.
+const int pendingcount = 64;
 typedef struct
 {
-  union
+  uint64_t sequence;
+  frametimes_t times;
+  heldframe_t *frame;
+} pendingframe_t;
+pendingframe_t pending[pendingcount];
+
+void collectpresentations()
+{
+  rgb_matrix::FramePresentation feedback[8];
+  int n;
+  while ((n = matrix->GetPresentationFeedback(feedback, 8)) > 0)
+  {
+    // The feedback is in CLOCK_MONOTONIC microseconds.
+    uint64_t offset = realns() - nowns();
+    for (int i = 0; i < n; i++)
+    {
+      const rgb_matrix::FramePresentation &f = feedback[i];
+      pendingframe_t *p = &pending[f.sequence % pendingcount];
+      if (p->sequence != f.sequence)
+        continue;       // Not a frame of ours.
+      p->times.shown_ns = f.dropped ? 0 : f.shown_us * 1000 + offset;
+      recordframe(p->times);
+      releaseframe(p->frame);
+      p->sequence = 0;
+      p->frame = NULL;
+    }
+  }
+}
+
+// With --output, led-refreshd's ring the frames go to instead of a matrix.
+// Opened again when led-refreshd was restarted; NULL while it isn't running.
+const char *outputname = NULL;
+shmring_t *outring;
+uint64_t outringtried_ns;
+
+shmring_t *outputring()
+{
+  if (outring && shmring_stale(outring))
+  {
+    shmring_close(outring);
+    outring = NULL;
+  }
+  if (outring)
+    return outring;
+
+  uint64_t now = nowns();
+  if (now - outringtried_ns < 1000000000)
+    return NULL;
+  outringtried_ns = now;
+  outring = shmring_open(outputname);
+  if (outring && (shmring_width(outring) != screentiles_x * tilesize_x
+                  || shmring_height(outring) != screentiles_y * tilesize_y))
+  {
+    printf("%s is for a wall of %dx%d, not ours\n", outputname,
+           shmring_width(outring), shmring_height(outring));
+    shmring_close(outring);
+    outring = NULL;
+  }
+  return outring;
+}
+
+// How the matrix shows the frames, as control packets change it.
+int outputbrightness = 100;
+float outputgamma = 1.0;
+int outputpwmbits = 0;            // 0: as many as the frames have.
+int outputlsbns;
+int outputditherbits;
+int idletimeout_s = 3;            // 0: never.
+
+// Apply a control packet. In the frametuuper, as the matrix's lookup table
+// and pulse timings for it take a while to prepare; the refresh thread
+// only switches to them.
+void applycontrol(const controlpayload_t &c)
+{
+  bool curve = false;
+  bool timing = false;
+  if (c.brightness)
+  {
+    outputbrightness = c.brightness < 100 ? c.brightness : 100;
+    curve = true;
+  }
+  if (c.gamma)
   {
-  struct
+    outputgamma = c.gamma / 100.0f;
+    curve = true;
+  }
+  if (c.pwm_bits)
+  {
+    outputpwmbits = c.pwm_bits < 11 ? c.pwm_bits : 11;
+    timing = true;
+  }
+  if (c.dither_bits)
+  {
+    outputditherbits = c.dither_bits < 3 ? c.dither_bits - 1 : 2;
+    timing = true;
+  }
+  if (c.idle_s)
+    idletimeout_s = c.idle_s == 65535 ? 0 : c.idle_s;
+
+  if (matrix && curve)
+    matrix->SetOutputCurve(outputbrightness, outputgamma);
+  // Dithering more bits than are shown leaves none to show.
+  if (outputpwmbits > 0 && outputditherbits >= outputpwmbits)
+    outputditherbits = outputpwmbits - 1;
+  // Only the pulse lengths change; the pulser set up before the receiver
+  // dropped its privileges stays.
+  if (matrix && timing)
+    matrix->ChangeRefreshParameters(outputpwmbits, outputlsbns,
+                                    outputditherbits);
+  char idle[16] = "never";
+  if (idletimeout_s > 0)
+    snprintf(idle, sizeof(idle), "%ds", idletimeout_s);
+  printf("control: brightness %d%%, gamma %.2f, pwm bits %d, "
+         "dither bits %d, idle %s%s\n", outputbrightness, outputgamma,
+         outputpwmbits, outputditherbits, idle,
+         matrix || !(curve || timing) ? "" : " (no matrix; only the idle timeout applies)");
+  fflush(stdout);
+}
+
+void *frametuuperthread(void *x_void_ptr)
+{
+   pthread_setname_np(pthread_self(), "udp: frametuup");
+
+  // The idle screen is due idletimeout_s after this; layers changing don't
+  // keep it away.
+  struct timeval idlefrom;
+  gettimeofday(&idlefrom,NULL);
+
+  while(1)
   {
-    uint8_t type;
-    uint8_t frame;
-    union
+    if (!benchmode && !outputname)
+      collectpresentations();
+
+    pthread_mutex_lock (&sync_lock);
+
+    struct timespec ts;
+
+    ts.tv_sec = idlefrom.tv_sec+idletimeout_s;
+    ts.tv_nsec = idlefrom.tv_usec*1000;
+
+    // Until there's a frame, a control packet or new tiles of a layer, or
+    // it's time for the idle screen.
+    int condval = 0;
+    while (!sync_new && !sync_controlled && !sync_layered && condval == 0)
+    {
+      if (idletimeout_s > 0)
+        condval = pthread_cond_timedwait (&sync_cond, &sync_lock, &ts);
+      else
+        condval = pthread_cond_wait (&sync_cond, &sync_lock);
+    }
+    if (sync_new || sync_controlled || condval != 0)
+      gettimeofday(&idlefrom,NULL);
+    if (sync_controlled)
+    {
+      controlpayload_t control = sync_control;
+      memset(&sync_control, 0, sizeof(sync_control));
+      sync_controlled = false;
+      pthread_mutex_unlock (&sync_lock);
+      applycontrol(control);
+      continue;
+    }
+    const bool fresh = sync_new;
+    if (sync_new)
+      condval = 0;
+    sync_new = false;
+    sync_layered = false;
+
+    // A new frame, or the last one again when only the layers changed.
+    uint16_t **tiles = NULL;
+    frametimes_t times;
+    heldframe_t *held = NULL;
+    if (condval == 0 && fresh)
+    {
+      tiles = sync_data;
+      times = sync_times;
+      held = sync_frame;
+      sync_frame = NULL;
+    }
+    else if (condval == 0)
+    {
+      memset(&times, 0, sizeof(times));
+      times.tiles = screentiles_x * screentiles_y;
+      times.finished_ns = realns();
+    }
+    if (condval == 0 && layercount > 0)
+    {
+      held = holdlayered(tiles, held);
+      if (held)
+        tiles = held->tiles;
+    }
+    else if (condval == ETIMEDOUT)
     {
-      struct
+      // The layers wait for the next frame instead of the idle screen.
+      releaseframe(lastframe);
+      lastframe = NULL;
+    }
+    if (condval == 0 && !tiles)
+    {
+      pthread_mutex_unlock (&sync_lock);
+      continue;       // No frame to show the layers over yet.
+    }
+
+    if (condval == 0 && benchmode)
+    {
+      pthread_mutex_unlock (&sync_lock);
+      releaseframe(held);
+      pthread_mutex_lock(&bench_lock);
+      if (fresh)
+        benchstats.frames_taken++;
+      else
+        benchstats.relayered++;
+      pthread_mutex_unlock(&bench_lock);
+
+      // There's no matrix; a frame counts as shown when it's taken.
+      times.shown_ns = realns();
+      recordframe(times);
+    }
+    else if (condval == 0 && outputname)
+    {
+      pthread_mutex_unlock (&sync_lock);
+
+      // led-refreshd shows whole frames; the layers go on here.
+      rgb_matrix::TileLayer tilelayer[maxlayers];
+      const int n = held ? tilelayers(held, tilelayer) : 0;
+      shmring_t *r = outputring();
+      int slot = r ? shmring_acquire(r) : -1;
+      if (slot >= 0)
       {
-        uint16_t xpos;
-        uint16_t ypos;
-      };
-      struct
+        uint16_t *frame = shmring_frame(r, slot);
+        for (int i = 0; i < screentiles_x * screentiles_y; i++)
+        {
+          uint16_t *out = frame + i * tilepayloadsize / sizeof(uint16_t);
+          if (tiles[i])
+            memcpy(out, tiles[i], tilepayloadsize);
+          else
+            memset(out, 0, tilepayloadsize);
+          for (int l = 0; l < n; l++)
+          {
+            if (held->layers[l][i])
+              tilelayer[l].Draw(held->layers[l][i], out);
+          }
+        }
+        shmring_publish(r, slot);
+
+        // It's led-refreshd's to show; it counts as shown when it's there.
+        times.shown_ns = realns();
+        recordframe(times);
+      }
+      releaseframe(held);
+    }
+    else if (condval == 0)
+    {
+      swap_buffer->SetTilePtrs((void**)tiles);
+      rgb_matrix::TileLayer tilelayer[maxlayers];
+      swap_buffer->SetTileLayers(tilelayer,
+                                 held ? tilelayers(held, tilelayer) : 0);
+      uint32_t key = times.key;
+      pthread_mutex_unlock (&sync_lock);
+
+      // Don't wait for the vsync, so we're ready for the next pageflip
+      // right away; the newest frame wins.
+      rgb_matrix::TraceBegin(tracecat, "SubmitFrame", key);
+      rgb_matrix::FrameCanvas *submitted = swap_buffer;
+      swap_buffer = matrix->SubmitFrame(swap_buffer);
+      pendingframe_t *p = &pending[submitted->sequence() % pendingcount];
+      releaseframe(p->frame);   // 64 frames ago; its feedback got lost.
+      p->sequence = submitted->sequence();
+      p->times = times;
+      p->frame = held;
+      rgb_matrix::TraceLink(tracecat, key, "matrix", submitted->sequence());
+      rgb_matrix::TraceEnd(tracecat, "SubmitFrame", key);
+    }
+    else if (condval == ETIMEDOUT && benchmode)
+    {
+      pthread_mutex_unlock (&sync_lock);
+    }
+    else if (condval == ETIMEDOUT && outputname)
+    {
+      pthread_mutex_unlock (&sync_lock);
+      shmring_t *r = outputring();
+      int slot = r ? shmring_acquire(r) : -1;
+      if (slot >= 0)
       {
-      };
-    };
-  };
-    char siz[8];
-  };
-} packethdr_t;
+        TileCanvas canvas(shmring_frame(r, slot));
+        drawidle(&canvas);
+        shmring_publish(r, slot);
+      }
+    }
+    else if (condval == ETIMEDOUT)
+    {
+ //     debugf("swap buf: %p", swap_buffer);
+      swap_buffer->SetTilePtrs(0);
+      swap_buffer->SetTileLayers(NULL, 0);
+      pthread_mutex_unlock (&sync_lock);
+
+      drawidle(swap_buffer);
+
+      swap_buffer = matrix->SubmitFrame(swap_buffer);
+    }
+  }
+
+  return NULL;
+
+}
+
+
+
+void setsignal()
+{
+  struct sigaction sa;
+  sa.sa_handler = InterruptHandler;
+  sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT,  &sa, NULL);
+}
 
 
+ 
+
   int m_s = 0;
 
 
+// The tiles of the frame in each slot, each holding a reference.
 uint16_t** frameptrs;
 
-#ifdef VALTAVAMATRIISI
-  const int screentiles_x = 4;
-  const int screentiles_y = 3;
-#else
-  const int screentiles_x = 12;
-  const int screentiles_y = 6;
-#endif
+// Parity payloads, by slot and first tile of their group, each holding a
+// reference.
+uint16_t** parityptrs;
+uint8_t* paritytags;
+uint16_t* paritycounts;
 
-const int tilesize_x = 16;
-const int tilesize_y = 16;
+// The tiles last shown, each holding a reference.
+uint16_t **lastshown;
 
 const int framebuffers_count = 16;
 const size_t framesize = tilesize_x*tilesize_y*6;
-const size_t mempoolcount = screentiles_x*screentiles_y * framebuffers_count;
-typedef struct { char data[framesize]; } framemem_t;
+// Of each receive thread's tileslab. The frame slots hold up to a tile and
+// a parity payload per tile, and the held frames and concealment some more;
+// twice that leaves room for the kernel's share (see uringloop()) and UDP
+// GRO, so a slab only runs dry if tiles are held up elsewhere.
+const size_t mempoolcount = screentiles_x*screentiles_y * framebuffers_count * 4;
+// The control messages a datagram comes with: its UDP GRO segment size and
+// when it was received, by the kernel and the NIC.
+const size_t rxcontrolsize = CMSG_SPACE(sizeof(int))
+  + CMSG_SPACE(sizeof(struct timespec))
+  + CMSG_SPACE(sizeof(struct scm_timestamping));
+// Room before the payload for what io_uring puts there with it.
+const size_t framememheadroom =
+  uringrecv_headroom + rxcontrolsize + sizeof(packethdr_t);
+// A tile's payload, as received, in a tileslab buffer.
+typedef struct
+{
+  char head[framememheadroom];
+  char data[framesize];
+} framemem_t;
+
+// What arrived of the frame in each slot of frameptrs: a bit per tile, so
+// whether a frame is complete is known without looking through frameptrs.
+// Both receive threads update these, under slots_lock.
+const int tilewords = (screentiles_x*screentiles_y + 63) / 64;
+typedef struct
+{
+  bool used;
+  bool done;                // Shown or dropped.
+  uint8_t frame;            // The frame the bits are for.
+  int count;                // Bits set.
+  int recovered;            // Of them, rebuilt from parity.
+  uint64_t bits[tilewords];
+  uint64_t first_ns;        // When the first piece arrived, in realns() time.
+  uint64_t last_ns;         // The last tile.
+  uint64_t flip_ns;         // The pageflip.
+  uint64_t sent_ns;         // When it was sent, if the pageflip says.
+  uint64_t deadline_ns;     // The pageflip waits for tiles until then.
+} slot_t;
+
+slot_t slots[framebuffers_count];
+pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t nextdeadline_ns;   // Of the slots waiting; 0 if none.
+
+// The slot of "frame", of which a piece arrived at "arrival_ns", emptied
+// if it still has an older frame. Returns NULL for a frame older than the
+// one in the slot.
+slot_t *slotof(uint8_t frame, uint64_t arrival_ns)
+{
+  slot_t *s = &slots[frame & 15];
+  if (s->used && s->frame == frame)
+    return s;
+  if (s->used && (int8_t)(frame - s->frame) < 0)
+    return NULL;
+  const int tiles = screentiles_x * screentiles_y;
+  const int offs = (frame & 15) * tiles;
+  for (int i = 0; i < tiles; i++)
+  {
+    tileslab_unref(frameptrs[offs + i]);
+    tileslab_unref(parityptrs[offs + i]);
+    frameptrs[offs + i] = NULL;
+    parityptrs[offs + i] = NULL;
+  }
+  memset(s, 0, sizeof(*s));
+  s->used = true;
+  s->frame = frame;
+  s->first_ns = arrival_ns;
+  return s;
+}
+
+bool hastile(const slot_t *s, int i)
+{
+  return (s->bits[i / 64] >> (i % 64)) & 1;
+}
+
+void settile(slot_t *s, int i)
+{
+  if (!hastile(s, i))
+  {
+    s->bits[i / 64] |= (uint64_t)1 << (i % 64);
+    s->count++;
+  }
+}
+
+// When a pageflip arrives before all tiles of its frame.
+enum
+{
+  incomplete_show,    // Show it, with the missing tiles concealed.
+  incomplete_drop,    // Keep showing the frame before.
+};
+int incompletemode = incomplete_show;
+int tilewait_ms = 0;  // Wait this long for the missing tiles first.
+
+bool rxtimestamps = false;        // The kernel tells when packets arrived.
+const char *hwtimestampif = NULL; // The NIC does, on this interface.
+
+// Have the NIC on "ifname" timestamp the packets it receives, and give us
+// those stamps. They're in the NIC's clock, which phc2sys has to keep to
+// the system's for them to compare with anything.
+bool inithwtimestamps(const char *ifname)
+{
+  struct hwtstamp_config config;
+  memset(&config, 0, sizeof(config));
+  config.rx_filter = HWTSTAMP_FILTER_ALL;
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+  ifr.ifr_data = (char*)&config;
+  if (ioctl(m_s, SIOCSHWTSTAMP, &ifr) < 0)
+  {
+    printf("no hardware timestamps on %s: %s\n", ifname, strerror(errno));
+    return false;
+  }
+  int flags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+  if (setsockopt(m_s, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+  {
+    printf("can't get hardware timestamps: %s\n", strerror(errno));
+    return false;
+  }
+  return true;
+}
 
 void initrecv()
 {
@@ -306,9 +971,13 @@ void initrecv()
   {
     frameptrs[i] = NULL;
   }
+  parityptrs = (uint16_t**)calloc(framebuffers_count*screentiles_x*screentiles_y, sizeof(uint16_t*));
+  paritytags = (uint8_t*)calloc(framebuffers_count*screentiles_x*screentiles_y, 1);
+  paritycounts = (uint16_t*)calloc(framebuffers_count*screentiles_x*screentiles_y, sizeof(uint16_t));
+  lastshown = (uint16_t**)calloc(screentiles_x*screentiles_y, sizeof(uint16_t*));
 
 
-  int port = 9998;
+  int port = recvport;
 
 
 
@@ -331,6 +1000,17 @@ void initrecv()
     printf("shokki, ei onnistu bind\n");
   }
 
+  if (multicastgroup)
+  {
+    struct ip_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (inet_pton(AF_INET, multicastgroup, &mreq.imr_multiaddr) != 1
+        || setsockopt(m_s, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                      &mreq, sizeof(mreq)) < 0)
+      printf("can't join multicast group %s\n", multicastgroup);
+  }
+
 //  int rcvbufsiz = 16777216;
   int rcvbufsiz = 1024*1024;
   socklen_t rcvbufsiz_siz = sizeof(rcvbufsiz);
@@ -338,14 +1018,652 @@ void initrecv()
   getsockopt(m_s, SOL_SOCKET, SO_RCVBUF, &rcvbufsiz, &rcvbufsiz_siz);
   printf("rcvbufsiz_siz %i, rcvbufsiz %i\n", rcvbufsiz_siz, rcvbufsiz);
 
+  // When each packet arrived, for how long the frames take to get through.
+  int on = 1;
+  rxtimestamps =
+    setsockopt(m_s, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == 0;
+  if (hwtimestampif && !inithwtimestamps(hwtimestampif))
+    hwtimestampif = NULL;
+
   assert(sizeof(packethdr_t) == 8);
 }
 
-void *recvloop(void *x_void_ptr)
+// Rebuild the tiles of the frame in "s" lost from groups with a parity
+// packet and no other loss; the parity payload becomes the tile.
+void recovertiles(slot_t *s)
 {
-   pthread_setname_np(pthread_self(), (const char *)x_void_ptr);
-
-   pthread_t self = pthread_self();
+  const int tiles = screentiles_x * screentiles_y;
+  const int offs = (s->frame & 15) * tiles;
+  const uint8_t frame = s->frame;
+  for (int first = 0; first < tiles; first++)
+  {
+    uint64_t *parity = (uint64_t*)parityptrs[offs + first];
+    if (!parity || paritytags[offs + first] != frame)
+      continue;
+    const int last = first + paritycounts[offs + first];
+    int missing = -1;
+    int missingcount = 0;
+    for (int i = first; i < last; i++)
+    {
+      if (!hastile(s, i))
+      {
+        missing = i;
+        missingcount++;
+      }
+    }
+    if (missingcount != 1)
+      continue;
+
+    for (int i = first; i < last; i++)
+    {
+      if (i == missing)
+        continue;
+      const uint64_t *tile = (const uint64_t*)frameptrs[offs + i];
+      for (size_t w = 0; w < tilepayloadsize / sizeof(uint64_t); w++)
+        parity[w] ^= tile[w];
+    }
+    frameptrs[offs + missing] = (uint16_t*)parity;
+    settile(s, missing);
+    s->recovered++;
+    parityptrs[offs + first] = NULL;
+  }
+}
+
+// What to show for a tile that didn't arrive, even with parity.
+enum
+{
+  conceal_none,       // The matrix falls back to what was drawn on it.
+  conceal_previous,   // The tile shown at the position before.
+};
+int concealmode = conceal_previous;
+
+pthread_mutex_t lastshown_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Fill in the tiles still missing from the frame in "s" as "concealmode"
+// says. Returns the number of tiles concealed.
+int concealtiles(const slot_t *s)
+{
+  const int tiles = screentiles_x * screentiles_y;
+  const int offs = (s->frame & 15) * tiles;
+  int concealed = 0;
+  pthread_mutex_lock(&lastshown_lock);
+  for (int i = 0; i < tiles; i++)
+  {
+    if (hastile(s, i))
+      continue;
+    if (concealmode == conceal_previous && lastshown[i])
+    {
+      tileslab_ref(lastshown[i]);
+      frameptrs[offs + i] = lastshown[i];
+      concealed++;
+    }
+  }
+
+  if (concealmode == conceal_previous)
+  {
+    for (int i = 0; i < tiles; i++)
+    {
+      uint16_t *tile = frameptrs[offs + i];
+      if (tile == lastshown[i])
+        continue;
+      tileslab_ref(tile);
+      tileslab_unref(lastshown[i]);
+      lastshown[i] = tile;
+    }
+  }
+  pthread_mutex_unlock(&lastshown_lock);
+  return concealed;
+}
+
+void updatedeadline()
+{
+  uint64_t next = 0;
+  for (int i = 0; i < framebuffers_count; i++)
+  {
+    if (slots[i].deadline_ns && (!next || slots[i].deadline_ns < next))
+      next = slots[i].deadline_ns;
+  }
+  __atomic_store_n(&nextdeadline_ns, next, __ATOMIC_RELAXED);
+}
+
+// Done with the frame in "s": show it, or drop it if it's incomplete and
+// "incompletemode" says so. Older frames still waiting for tiles are
+// dropped, so the wall never goes back in time. Called with slots_lock held.
+void finishslot(slot_t *s)
+{
+  const int tiles = screentiles_x * screentiles_y;
+  for (int i = 0; i < framebuffers_count; i++)
+  {
+    slot_t *older = &slots[i];
+    if (older->deadline_ns && (int8_t)(older->frame - s->frame) < 0)
+    {
+      older->deadline_ns = 0;
+      older->done = true;
+      if (benchmode)
+        benchcount(&benchstats.dropped);
+    }
+  }
+  s->done = true;
+  s->deadline_ns = 0;
+  updatedeadline();
+
+  uint32_t key = 0;
+  if (rgb_matrix::TraceEnabled() || frametimesfile)
+    key = framekey(s->frame);
+
+  if (s->count < tiles && incompletemode == incomplete_drop)
+  {
+    if (rgb_matrix::TraceEnabled())
+      rgb_matrix::TraceInstant(tracecat, "drop", key, s->count);
+    if (benchmode)
+      benchcount(&benchstats.dropped);
+    else
+      printf("     fr %i: dropped, ok tiles: %.2f%%\n", s->frame & 15,
+             (float)s->count*100.f / tiles);
+    return;
+  }
+
+  int concealed = concealtiles(s);
+  if (!benchmode)
+  {
+              int bufleft;
+              (void)ioctl(m_s, SIOCINQ, &bufleft);
+      printf("     %lX: fr %i, left %i, ok tiles: %.2f%%, concealed %i\n", pthread_self(), s->frame & 15, bufleft, (float)s->count*100.f / tiles, concealed);
+  }
+  else
+  {
+    benchpageflip(s->first_ns, s->count - s->recovered, s->recovered,
+                  concealed, tiles);
+  }
+
+  if (rgb_matrix::TraceEnabled())
+    rgb_matrix::TraceInstant(tracecat, "pageflip", key, s->count);
+
+  frametimes_t times;
+  memset(&times, 0, sizeof(times));
+  times.key = key;
+  times.tiles = s->count;
+  times.sent_ns = s->sent_ns;
+  times.first_ns = s->first_ns;
+  times.last_ns = s->last_ns;
+  times.flip_ns = s->flip_ns;
+  times.finished_ns = realns();
+  heldframe_t *held = holdframe(&frameptrs[(s->frame & 15) * tiles]);
+  if (!held)
+  {
+    if (benchmode)
+      benchcount(&benchstats.dropped);
+    return;
+  }
+  showtiles(held->tiles, times, held);
+}
+
+// The pageflip of the frame in "s" arrived. Called with slots_lock held.
+void pageflipslot(slot_t *s)
+{
+  if (s->done || s->deadline_ns)
+    return;
+  recovertiles(s);
+  if (s->count < screentiles_x * screentiles_y && tilewait_ms > 0)
+  {
+    s->deadline_ns = nowns() + (uint64_t)tilewait_ms * 1000000;
+    updatedeadline();
+    if (benchmode)
+      benchcount(&benchstats.waited);
+  }
+  else
+  {
+    finishslot(s);
+  }
+}
+
+// A piece of the frame in "s" arrived; finish it if its pageflip was only
+// waiting for that. Called with slots_lock held.
+void gotpiece(slot_t *s)
+{
+  if (!s->deadline_ns)
+    return;
+  recovertiles(s);
+  if (s->count == screentiles_x * screentiles_y)
+    finishslot(s);
+}
+
+// Finish the newest frame whose wait for tiles is over, and with it the
+// older ones.
+void expireslots()
+{
+  uint64_t next = __atomic_load_n(&nextdeadline_ns, __ATOMIC_RELAXED);
+  if (!next || nowns() < next)
+    return;
+
+  pthread_mutex_lock(&slots_lock);
+  uint64_t now = nowns();
+  slot_t *newest = NULL;
+  for (int i = 0; i < framebuffers_count; i++)
+  {
+    slot_t *s = &slots[i];
+    if (s->deadline_ns && s->deadline_ns <= now
+        && (!newest || (int8_t)(s->frame - newest->frame) > 0))
+      newest = s;
+  }
+  if (newest)
+    finishslot(newest);
+  pthread_mutex_unlock(&slots_lock);
+}
+
+// Take in a datagram of the tile protocol, "len" bytes with the header,
+// that arrived at "arrival_ns" in realns() time. A payload that's kept gets
+// a reference of its own.
+void handlepacket(const packethdr_t &vidhdr, char *payload, ssize_t len,
+                  uint64_t arrival_ns)
+{
+  int fr = vidhdr.frame & 15;
+
+  int offs = fr * screentiles_x * screentiles_y;
+
+  if (vidhdr.type == packettype_tile)
+  {
+    //printf("pack to %i,%i\n", vidhdr.xpos, vidhdr.ypos);
+    int xt = vidhdr.xpos / tilesize_x;
+    int yt = vidhdr.ypos / tilesize_y;
+
+    if (xt < 0 || yt < 0 || xt >= screentiles_x || yt >= screentiles_y)
+      return;
+
+    pthread_mutex_lock(&slots_lock);
+    slot_t *s = slotof(vidhdr.frame, arrival_ns);
+    if (s)
+    {
+      // A duplicate replaces the tile.
+      uint16_t **tile = &frameptrs[offs + yt * screentiles_x + xt];
+      tileslab_ref(payload);
+      tileslab_unref(*tile);
+      *tile = (uint16_t*)payload;
+      settile(s, yt * screentiles_x + xt);
+      if (arrival_ns > s->last_ns)
+        s->last_ns = arrival_ns;
+      gotpiece(s);
+    }
+    pthread_mutex_unlock(&slots_lock);
+    if (s && rgb_matrix::TraceEnabled())
+      rgb_matrix::TraceInstant(tracecat, "tile", framekey(vidhdr.frame),
+                               yt * screentiles_x + xt);
+  }
+  else if (vidhdr.type == packettype_parity)
+  {
+    int first = vidhdr.xpos;
+    int count = vidhdr.ypos;
+    if (len != (ssize_t)(sizeof(packethdr_t) + tilepayloadsize)
+        || count < 1 || first + count > screentiles_x * screentiles_y)
+      return;
+    pthread_mutex_lock(&slots_lock);
+    slot_t *s = slotof(vidhdr.frame, arrival_ns);
+    if (s)
+    {
+      tileslab_ref(payload);
+      tileslab_unref(parityptrs[offs + first]);
+      parityptrs[offs + first] = (uint16_t*)payload;
+      paritytags[offs + first] = vidhdr.frame;
+      paritycounts[offs + first] = count;
+      gotpiece(s);
+    }
+    pthread_mutex_unlock(&slots_lock);
+  }
+  else if (vidhdr.type == packettype_control)
+  {
+    controlpayload_t control;
+    if (len < (ssize_t)(sizeof(packethdr_t) + sizeof(control)))
+      return;
+    memcpy(&control, payload, sizeof(control));
+    requestcontrol(control);
+  }
+  else if (vidhdr.type == packettype_pageflip)
+  {
+    //printf("pageflip to %i\n", fr);
+
+//      swap_buffer->SetTilePtrs((void**)&frameptrs[offs]);
+//    swap_buffer = matrix->SwapOnVSync(swap_buffer);
+
+    pageflippayload_t flip;
+    memset(&flip, 0, sizeof(flip));
+    if (len >= (ssize_t)(sizeof(packethdr_t) + sizeof(flip)))
+      memcpy(&flip, payload, sizeof(flip));
+
+    pthread_mutex_lock(&slots_lock);
+    slot_t *s = slotof(vidhdr.frame, arrival_ns);
+    if (s)
+    {
+      if (!s->flip_ns)
+      {
+        s->flip_ns = arrival_ns;
+        s->sent_ns = flip.sent_ns;
+      }
+      pageflipslot(s);
+    }
+    pthread_mutex_unlock(&slots_lock);
+  }
+}
+
+// How long the receive threads can wait for packets: a second, or until
+// the next frame waiting for tiles is due.
+uint64_t waittime_ns()
+{
+  uint64_t deadline = __atomic_load_n(&nextdeadline_ns, __ATOMIC_RELAXED);
+  if (!deadline)
+    return 1000000000;
+  uint64_t now = nowns();
+  if (deadline <= now)
+    return 0;
+  return deadline - now < 1000000000 ? deadline - now : 1000000000;
+}
+
+// When the datagram read with "hdr" was received, from its control
+// messages: by the NIC if it says, else by the kernel. 0 if they don't say.
+uint64_t rxstamp_ns(struct msghdr *hdr)
+{
+  uint64_t stamp = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg;
+       cmsg = CMSG_NXTHDR(hdr, cmsg))
+  {
+    if (cmsg->cmsg_level != SOL_SOCKET)
+      continue;
+    if (cmsg->cmsg_type == SCM_TIMESTAMPNS)
+    {
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      if (!stamp)
+        stamp = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+    else if (cmsg->cmsg_type == SCM_TIMESTAMPING)
+    {
+      struct scm_timestamping ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      if (ts.ts[2].tv_sec || ts.ts[2].tv_nsec)
+        return (uint64_t)ts.ts[2].tv_sec * 1000000000 + ts.ts[2].tv_nsec;
+    }
+  }
+  return stamp;
+}
+
+// How the receive threads read the socket.
+enum
+{
+  recv_select,        // select() and a recvmsg() per packet.
+  recv_uring,         // io_uring, if the kernel has what it takes.
+  recv_packet,        // A TPACKET_V3 ring, by one thread.
+};
+int recvmode = recv_uring;
+const char *packetif = NULL;  // For recv_packet; NULL: all interfaces.
+
+// How a receive thread on the recvmsg() path waits for packets.
+enum
+{
+  wait_select,        // select(); the scheduler wakes us up.
+  wait_epoll,         // epoll, busy polling the device for "busy_us" first.
+  wait_spin,          // recvmsg() without blocking for "busy_us", then
+                      // select().
+};
+
+const int wakeupbuckets = 1000;  // Of a microsecond; the last is for more.
+
+typedef struct
+{
+  const char *name;
+  int wait;
+  int busy_us;
+  int cpu;                  // To run on.
+  // With --bench: from the kernel receiving a packet to recvmsg() giving
+  // it to us, in microseconds.
+  uint32_t wakeup_hist[wakeupbuckets];
+  tileslab_t *slab;         // The tiles it receives.
+} recvthread_t;
+
+const int recvthreadcount = 2;
+recvthread_t recvthreads[recvthreadcount] =
+{
+  { "udp: recv1", wait_select, 50, 0, { 0 } },
+  { "udp: recv2", wait_select, 50, 0, { 0 } },
+};
+
+// The socket options are for blocking reads on the socket the threads
+// share, so they are set once, for the longest any thread busy polls.
+// EPIOCSPARAMS on each thread's epoll is what's per thread.
+void initbusypoll()
+{
+  int busy_us = 0;
+  for (int t = 0; t < recvthreadcount; t++)
+  {
+    if (recvthreads[t].wait == wait_epoll && recvthreads[t].busy_us > busy_us)
+      busy_us = recvthreads[t].busy_us;
+  }
+  if (busy_us == 0)
+    return;
+  int on = 1;
+  setsockopt(m_s, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on));
+  if (setsockopt(m_s, SOL_SOCKET, SO_BUSY_POLL,
+                 &busy_us, sizeof(busy_us)) < 0)
+    printf("can't busy poll the socket: %s\n", strerror(errno));
+}
+
+uint64_t nobuffers;              // Not printed yet.
+uint64_t nobuffersprinted_ns;
+
+// A datagram that came when the receive thread's tileslab was dry. Its
+// payload is only where it was received; pageflips and control packets
+// still go through, as they aren't kept, but the rest is dropped.
+void nobuffer(const packethdr_t &vidhdr, char *payload, ssize_t len,
+              uint64_t arrival_ns)
+{
+  if (vidhdr.type == packettype_pageflip
+      || vidhdr.type == packettype_control)
+  {
+    handlepacket(vidhdr, payload, len, arrival_ns);
+    return;
+  }
+  if (benchmode)
+  {
+    benchcount(&benchstats.nobuffer);
+    return;
+  }
+  __atomic_add_fetch(&nobuffers, 1, __ATOMIC_RELAXED);
+  uint64_t now = nowns();
+  uint64_t printed = __atomic_load_n(&nobuffersprinted_ns, __ATOMIC_RELAXED);
+  if (now - printed >= 1000000000
+      && __atomic_compare_exchange_n(&nobuffersprinted_ns, &printed, now,
+                                     false, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED))
+    printf("out of tile buffers, dropped %llu datagrams\n",
+           (unsigned long long)__atomic_exchange_n(&nobuffers, 0,
+                                                   __ATOMIC_RELAXED));
+}
+
+// Receive with io_uring straight into the buffers of "slab", until
+// interrupted. Returns false if io_uring can't be used.
+bool uringloop(tileslab_t *slab, const char *name)
+{
+  framemem_t *mempool = (framemem_t*)tileslab_buf(slab, 0);
+  uringrecv_t *u = uringrecv_open(m_s, mempool[0].head, sizeof(framemem_t),
+                                  framememheadroom + framesize,
+                                  mempoolcount, rxcontrolsize);
+  if (!u)
+    return false;
+
+  // The kernel has up to "kernelbuffers" buffers of the slab at a time,
+  // each with a reference of ours. When the slab runs dry, the kernel runs
+  // out too and leaves the datagrams in the socket until we catch up.
+  const int kernelbuffers = mempoolcount / 4;
+  int inkernel = 0;
+  for (int buf; inkernel < kernelbuffers
+         && (buf = tileslab_alloc(slab)) >= 0; inkernel++)
+    uringrecv_release(u, buf);
+
+  const int batch = 32;
+  uringpacket_t packets[batch];
+  bool ok = true;
+  while (!interrupt_received)
+  {
+    int n = uringrecv_wait(u, packets, batch, waittime_ns());
+    if (n < 0)
+    {
+      ok = false;
+      break;
+    }
+    expireslots();
+
+    for (int i = 0; i < n; i++)
+    {
+      const uringpacket_t &p = packets[i];
+      framemem_t *mem = &mempool[p.buf];
+      inkernel--;
+
+      // The payload lands where recvloop() would have put it, unless the
+      // kernel put something else before it.
+      if (p.len < sizeof(packethdr_t) || p.truncated
+          || p.data + sizeof(packethdr_t) != mem->data)
+      {
+        printf("%s: got %zu bytes\n", name, p.len);
+        printf("INVALID\n");
+        tileslab_unref(mem->data);
+        continue;
+      }
+      struct msghdr control;
+      memset(&control, 0, sizeof(control));
+      control.msg_control = p.control;
+      control.msg_controllen = p.controllen;
+      uint64_t arrival = rxstamp_ns(&control);
+      packethdr_t vidhdr;
+      memcpy(&vidhdr, p.data, sizeof(vidhdr));
+      if (capturefile)
+        capture_packet(nowns(), &vidhdr, sizeof(vidhdr),
+                       mem->data, p.len - sizeof(vidhdr));
+      handlepacket(vidhdr, mem->data, p.len, arrival ? arrival : realns());
+      tileslab_unref(mem->data);
+    }
+
+    for (int buf; inkernel < kernelbuffers
+           && (buf = tileslab_alloc(slab)) >= 0; inkernel++)
+      uringrecv_release(u, buf);
+    // The kernel would only tell us it has none; wait for tiles to be
+    // released instead.
+    if (inkernel == 0)
+      usleep(1000);
+  }
+
+  uringrecv_close(u);
+  return ok;
+}
+
+// Receive from a packet ring until interrupted, copying the payloads to
+// the buffers of "slab": they have to be aligned and outlive the ring's
+// blocks. Returns false if the ring can't be used.
+bool packetloop(tileslab_t *slab, const char *name)
+{
+  packetring_t *r = packetring_open(packetif, recvport,
+                                    hwtimestampif != NULL);
+  if (!r)
+    return false;
+  if (!packetring_dropfilter(m_s))
+    printf("%s: can't filter the socket; it fills up and drops\n", name);
+
+  bool ok = true;
+  while (!interrupt_received)
+  {
+    const uint8_t *data;
+    size_t len;
+    uint64_t arrival;
+    int got = packetring_next(r, &data, &len, &arrival, waittime_ns());
+    if (got < 0)
+    {
+      ok = false;
+      break;
+    }
+    expireslots();
+    if (got == 0)
+      continue;
+
+    if (len < sizeof(packethdr_t))
+    {
+      printf("%s: got %zu bytes\n", name, len);
+      printf("INVALID\n");
+      continue;
+    }
+    packethdr_t vidhdr;
+    memcpy(&vidhdr, data, sizeof(vidhdr));
+    int buf = tileslab_alloc(slab);
+    if (buf < 0)
+    {
+      nobuffer(vidhdr, (char*)data + sizeof(vidhdr), len, arrival);
+      continue;
+    }
+    char *payload = ((framemem_t*)tileslab_buf(slab, buf))->data;
+    size_t payloadlen = len - sizeof(vidhdr);
+    if (payloadlen > framesize)
+      payloadlen = framesize;
+    memcpy(payload, data + sizeof(vidhdr), payloadlen);
+    if (capturefile)
+      capture_packet(nowns(), &vidhdr, sizeof(vidhdr), payload, payloadlen);
+    handlepacket(vidhdr, payload, sizeof(vidhdr) + payloadlen, arrival);
+    tileslab_unref(payload);
+  }
+
+  packetring_close(r);
+  return ok;
+}
+
+// The most datagrams UDP GRO coalesces into one buffer for us.
+const int grosegments = 65536 / (sizeof(packethdr_t) + framesize) + 1;
+
+#ifndef EPIOCSPARAMS
+// <linux/eventpoll.h> of Linux 6.9.
+struct epoll_params
+{
+  uint32_t busy_poll_usecs;
+  uint16_t busy_poll_budget;
+  uint8_t prefer_busy_poll;
+  uint8_t pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+// Datagrams UDP GRO coalesced that aren't tiles, like pageflips sent back
+// to back, spread over the "iovs" buffers received into, a header and a
+// tile at a time. Gather them into "flat" and hand over the pageflips and
+// control packets among them; nothing else is kept from something this
+// small.
+void handlesmall(const struct iovec *vec, int iovs, char *flat, ssize_t len,
+                 ssize_t segsize, uint64_t arrival_ns)
+{
+  ssize_t gathered = 0;
+  for (int v = 0; v < iovs && gathered < len; v++)
+  {
+    size_t n = len - gathered < (ssize_t)vec[v].iov_len
+      ? len - gathered : vec[v].iov_len;
+    memcpy(flat + gathered, vec[v].iov_base, n);
+    gathered += n;
+  }
+  for (ssize_t off = 0; off < gathered; off += segsize)
+  {
+    ssize_t seglen = gathered - off < segsize ? gathered - off : segsize;
+    if (seglen < (ssize_t)sizeof(packethdr_t))
+      continue;
+    packethdr_t vidhdr;
+    memcpy(&vidhdr, flat + off, sizeof(vidhdr));
+    char *payload = flat + off + sizeof(packethdr_t);
+    if (capturefile)
+      capture_packet(nowns(), &vidhdr, sizeof(packethdr_t),
+                     payload, seglen - sizeof(packethdr_t));
+    if (vidhdr.type == packettype_pageflip
+        || vidhdr.type == packettype_control)
+      handlepacket(vidhdr, payload, seglen, arrival_ns);
+  }
+}
+
+void *recvloop(void *x_void_ptr)
+{
+   recvthread_t *t = (recvthread_t*)x_void_ptr;
+   pthread_setname_np(pthread_self(), t->name);
+
+   pthread_t self = pthread_self();
 
 #if 1
    {
@@ -376,7 +1694,7 @@ void *recvloop(void *x_void_ptr)
     int err;
     cpu_set_t cpu_mask;
     CPU_ZERO(&cpu_mask);
-    CPU_SET(0, &cpu_mask);
+    CPU_SET(t->cpu, &cpu_mask);
 
 
     if ((err=pthread_setaffinity_np(self, sizeof(cpu_mask), &cpu_mask))) {
@@ -387,8 +1705,60 @@ void *recvloop(void *x_void_ptr)
   #endif
 
 
-   framemem_t* mempool = (framemem_t*)malloc(mempoolcount * framesize);
-   int mempoolidx = 0;
+   tileslab_t *slab = t->slab;
+
+   if (recvmode == recv_uring)
+   {
+     if (uringloop(slab, t->name))
+       return NULL;
+     printf("%s: io_uring receive not available, using recvmsg\n",
+            t->name);
+   }
+   else if (recvmode == recv_packet)
+   {
+     if (packetloop(slab, t->name))
+       return NULL;
+     printf("%s: packet ring not available, using recvmsg\n",
+            t->name);
+   }
+
+   // Get the tiles of a burst in one go, coalesced by UDP GRO. The other
+   // paths can't take coalesced datagrams, so not when falling back.
+   bool udpgro = false;
+   if (recvmode == recv_select)
+   {
+     int on = 1;
+     udpgro = setsockopt(m_s, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+   }
+
+   int epfd = -1;
+   if (t->wait == wait_epoll)
+   {
+     epfd = epoll_create1(0);
+     struct epoll_event ev;
+     memset(&ev, 0, sizeof(ev));
+     ev.events = EPOLLIN;
+     epoll_ctl(epfd, EPOLL_CTL_ADD, m_s, &ev);
+
+     // Each thread's own time; the socket's is initbusypoll()'s.
+     struct epoll_params params;
+     memset(&params, 0, sizeof(params));
+     params.busy_poll_usecs = t->busy_us;
+     params.busy_poll_budget = 8;
+     params.prefer_busy_poll = 1;
+     if (ioctl(epfd, EPIOCSPARAMS, &params) < 0)
+       printf("%s: can't busy poll with epoll: %s\n", t->name,
+              strerror(errno));
+   }
+
+   // The tileslab buffers to receive into, for as many datagrams as a
+   // UDP_GRO buffer can have; without GRO only the first is used. The ones
+   // not received into stay for the next time.
+   int bufs[grosegments];
+   for (int i = 0; i < grosegments; i++)
+     bufs[i] = -1;
+   char *flat = udpgro
+     ? (char*)malloc(grosegments * (sizeof(packethdr_t) + framesize)) : NULL;
 
   while(!interrupt_received)
   {
@@ -420,77 +1790,155 @@ void *recvloop(void *x_void_ptr)
 
     showcrap = false;
 
-    packethdr_t vidhdr;
-    vidhdr.type = 0;
+    packethdr_t vidhdr[grosegments];
+    vidhdr[0].type = 0;
+    struct iovec vec[2 * grosegments];
+    int segments = 0;
+    while (segments < (udpgro ? grosegments : 1)
+           && (bufs[segments] >= 0
+               || (bufs[segments] = tileslab_alloc(slab)) >= 0))
+      segments++;
 
 //    char* payload = (char*)malloc(16*16*6);
-    char* payload = (char*)&mempool[mempoolidx];
+    for (int i = 0; i < segments; i++)
+    {
+      vec[2 * i].iov_base = &vidhdr[i];
+      vec[2 * i].iov_len = sizeof(packethdr_t);
+      vec[2 * i + 1].iov_base = ((framemem_t*)tileslab_buf(slab, bufs[i]))->data;
+      vec[2 * i + 1].iov_len = framesize;
+    }
 
-     struct iovec vec[2] =
-     {
-      {
-        &vidhdr,
-        8,
-      },
-      {
-        payload,
-        16*16*6
-      }
-     };
+    // With the slab dry, the datagram is still read, to be dropped.
+    const bool dry = segments == 0;
+    char scratch[framesize];
+    if (dry)
+    {
+      vec[0].iov_base = &vidhdr[0];
+      vec[0].iov_len = sizeof(packethdr_t);
+      vec[1].iov_base = scratch;
+      vec[1].iov_len = framesize;
+      segments = 1;
+    }
 
+    char control[rxcontrolsize];
     struct sockaddr_in srcaddr;
     struct msghdr hdr =
     {
       .msg_name = &srcaddr,
       .msg_namelen = sizeof(struct sockaddr_in),
       .msg_iov = vec,
-      .msg_iovlen = 2,
-      .msg_control = NULL,
-      .msg_controllen = 0,
+      .msg_iovlen = (size_t)(2 * segments),
+      .msg_control = control,
+      .msg_controllen = sizeof(control),
       .msg_flags = 0,
     };
 
+    ssize_t len = -1;
+    if (t->wait == wait_spin)
+    {
+      uint64_t until = nowns() + (uint64_t)t->busy_us * 1000;
+      do
+      {
+        len = recvmsg(m_s, &hdr, MSG_DONTWAIT);
+      } while (len < 0 && errno == EAGAIN && !interrupt_received
+               && nowns() < until);
+      expireslots();
+    }
 
+    if (len < 0 && t->wait == wait_epoll)
+    {
+      struct epoll_event ev;
+      int retval = epoll_wait(epfd, &ev, 1, (waittime_ns() + 999999) / 1000000);
+      if (retval == -1 && errno != EINTR)
+        return NULL;
+      expireslots();
+      if (retval <= 0)
+        continue;
+      len = recvmsg(m_s, &hdr, MSG_DONTWAIT);
+    }
+    else if (len < 0)
+    {
+      uint64_t wait_us = (waittime_ns() + 999) / 1000;
+      struct timeval tv;
+      tv.tv_sec = wait_us / 1000000;
+      tv.tv_usec = wait_us % 1000000;
 
-  struct timeval tv;
-  tv.tv_sec = 1;
-  tv.tv_usec = 0;
-
-  fd_set rfds;
-  FD_ZERO(&rfds);
-  FD_SET(m_s, &rfds);
+      fd_set rfds;
+      FD_ZERO(&rfds);
+      FD_SET(m_s, &rfds);
 
-  fd_set efds;
-  FD_ZERO(&efds);
-  FD_SET(m_s, &efds);
+      fd_set efds;
+      FD_ZERO(&efds);
+      FD_SET(m_s, &efds);
 
-  int retval = select(m_s+1, &rfds, NULL, &efds, &tv);
+      int retval = select(m_s+1, &rfds, NULL, &efds, &tv);
 
-  if (retval == -1)
-    return NULL;
+      if (retval == -1)
+        return NULL;
 
+      expireslots();
 
-  if (FD_ISSET(m_s, &efds))
-  {
-    printf("PROBLEM'S IN SOCKET!\n");
-  }
+      if (FD_ISSET(m_s, &efds))
+      {
+        printf("PROBLEM'S IN SOCKET!\n");
+      }
 
+      if (FD_ISSET(m_s, &rfds))
+        len = recvmsg(m_s, &hdr, MSG_DONTWAIT);
+      else
+        continue;
+    }
 
+    // The other thread got it.
+    if (len < 0 && errno == EAGAIN)
+      continue;
+    if (len < (ssize_t)sizeof(packethdr_t))
+    {
+      printf("%lX: got %d bytes (hdr %u)\n", self, len, sizeof(packethdr_t));
+      printf("INVALID\n");
+      continue;
+    }
 
-     if (FD_ISSET(m_s, &rfds))
+    // Datagrams coalesced by GRO are all "segsize" bytes but the last.
+    ssize_t segsize = len;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg;
+         cmsg = CMSG_NXTHDR(&hdr, cmsg))
     {
-      ssize_t len = recvmsg(m_s, &hdr, 0);
-      
-        
-      if (len < (ssize_t)sizeof(packethdr_t))
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
       {
-        printf("%lX: got %d bytes (hdr %u)\n", self, len, sizeof(packethdr_t));
-        printf("INVALID\n");
-        continue;
+        int gso_size;
+        memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+        if (gso_size > 0 && gso_size < len)
+          segsize = gso_size;
       }
     }
-    else
+
+    // For --bench, how long the packets waited for us.
+    uint64_t now = realns();
+    uint64_t arrival = rxstamp_ns(&hdr);
+    if (!arrival)
+      arrival = now;
+    else if (benchmode)
+    {
+      int64_t us = (int64_t)(now - arrival) / 1000;
+      if (us < 0)
+        us = 0;
+      if (us >= wakeupbuckets)
+        us = wakeupbuckets - 1;
+      __atomic_add_fetch(&t->wakeup_hist[us], 1, __ATOMIC_RELAXED);
+    }
+    // Not tiles; the buffers received into stay for the next time.
+    if (segsize < len
+        && segsize != (ssize_t)(sizeof(packethdr_t) + framesize))
+    {
+      handlesmall(vec, 2 * segments, flat, len, segsize, arrival);
       continue;
+    }
+    if (dry)
+    {
+      nobuffer(vidhdr[0], scratch, len, arrival);
+      continue;
+    }
 
 
 #if 0
@@ -514,70 +1962,861 @@ void *recvloop(void *x_void_ptr)
     //free(payload);
 
 
-    int fr = vidhdr.frame & 15;
+    for (int i = 0; i * segsize < len; i++)
+    {
+      ssize_t seglen = len - i * segsize < segsize ? len - i * segsize : segsize;
+      char *payload = (char*)vec[2 * i + 1].iov_base;
+      if (seglen < (ssize_t)sizeof(packethdr_t))
+        continue;
+      if (capturefile)
+        capture_packet(nowns(), &vidhdr[i], sizeof(packethdr_t),
+                       payload, seglen - sizeof(packethdr_t));
+      handlepacket(vidhdr[i], payload, seglen, arrival);
+      tileslab_unref(payload);
+      bufs[i] = -1;
+    }
+  }
+
+  return NULL;
+}
 
-    int offs = fr * screentiles_x * screentiles_y;
+bool artnet = false;
+bool sacn = false;
+bool ddp = false;
+const char *patchfile = NULL;
+int firstuniverse = 1;
 
-    if (vidhdr.type == 1)
+// The protocols besides the tile protocol; they all write to one assembler.
+assembler_t *frontendassembler;
+typedef uint16_t **(*frontendparser_t)(const uint8_t *buf, size_t len,
+                                       assembler_t *a);
+typedef struct
+{
+  int s;
+  frontendparser_t parse;
+} frontend_t;
+
+const int maxfrontends = 3;
+frontend_t frontends[maxfrontends];
+int frontendcount = 0;
+
+int bindudp(int port)
+{
+  int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  struct sockaddr_in myaddr;
+  memset(&myaddr, 0, sizeof(myaddr));
+  myaddr.sin_family = AF_INET;
+  myaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+  myaddr.sin_port = htons(port);
+  if (s < 0 || bind(s, (struct sockaddr *)&myaddr, sizeof(myaddr)) < 0)
+  {
+    printf("can't bind port %i: %s\n", port, strerror(errno));
+    if (s >= 0)
+      close(s);
+    return -1;
+  }
+  int rcvbufsiz = 1024*1024;
+  setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbufsiz, sizeof(rcvbufsiz));
+  return s;
+}
+
+void addfrontend(int s, frontendparser_t parse)
+{
+  if (s < 0)
+    return;
+  frontends[frontendcount].s = s;
+  frontends[frontendcount].parse = parse;
+  frontendcount++;
+}
+
+void initfrontends()
+{
+  if (artnet)
+    addfrontend(bindudp(artnet_port), dmx_artnet);
+
+  if (ddp)
+    addfrontend(bindudp(ddp_port), ddp_packet);
+
+  if (sacn)
+  {
+    int sacn_s = bindudp(sacn_port);
+    addfrontend(sacn_s, dmx_sacn);
+    uint16_t universes[1024];
+    int n = dmx_universes(universes, 1024);
+    for (int i = 0; sacn_s >= 0 && i < n; i++)
     {
-      //printf("pack to %i,%i\n", vidhdr.xpos, vidhdr.ypos);
-      int xt = vidhdr.xpos / tilesize_x;
-      int yt = vidhdr.ypos / tilesize_y;
+      // E1.31: universe u is sent to 239.255.<u high byte>.<u low byte>
+      struct ip_mreq mreq;
+      memset(&mreq, 0, sizeof(mreq));
+      mreq.imr_multiaddr.s_addr = htonl(0xefff0000 | universes[i]);
+      mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+      if (setsockopt(sacn_s, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                     &mreq, sizeof(mreq)) < 0)
+        printf("can't join sACN universe %i\n", universes[i]);
+    }
+  }
+}
+
+// Receives the other protocols, a batch of datagrams per system call.
+void *frontendloop(void *x_void_ptr)
+{
+  pthread_setname_np(pthread_self(), "udp: frontends");
 
-      if (xt < 0 || yt < 0 || xt > screentiles_x || yt > screentiles_y)
-        goto invalidframe;
+  assembler_t *assembler = frontendassembler;
 
-      if (frameptrs[offs + yt * screentiles_x + xt])
+  const int batch = 32;
+  const int maxdatagram = 1500;  // DDP: 1440 bytes of data and the header.
+  static uint8_t bufs[batch][maxdatagram];
+  struct iovec iovs[batch];
+  struct mmsghdr msgs[batch];
+  memset(msgs, 0, sizeof(msgs));
+  for (int i = 0; i < batch; i++)
+  {
+    iovs[i].iov_base = bufs[i];
+    iovs[i].iov_len = maxdatagram;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  struct pollfd fds[maxfrontends];
+  for (int f = 0; f < frontendcount; f++)
+  {
+    fds[f].fd = frontends[f].s;
+    fds[f].events = POLLIN;
+  }
+
+  while (!interrupt_received)
+  {
+    if (poll(fds, frontendcount, 1000) <= 0)
+      continue;
+    for (int f = 0; f < frontendcount; f++)
+    {
+      if (!(fds[f].revents & POLLIN))
+        continue;
+      int n = recvmmsg(fds[f].fd, msgs, batch, MSG_DONTWAIT, NULL);
+      for (int i = 0; i < n; i++)
       {
-//        printf("huh, frame already got\n");
-        //free(frameptrs[offs + yt * screentiles_x + xt]);
-        //return 1;
+        uint16_t **tiles = frontends[f].parse(bufs[i], msgs[i].msg_len,
+                                              assembler);
+        heldframe_t *frame = tiles ? holdframe(tiles) : NULL;
+        if (tiles)
+          tileslab_unref(tiles[0]);
+        if (frame)
+        {
+          if (benchmode)
+            benchpageflip(0, screentiles_x * screentiles_y, 0, 0,
+                          screentiles_x * screentiles_y);
+          frametimes_t times;
+          memset(&times, 0, sizeof(times));
+          times.tiles = screentiles_x * screentiles_y;
+          times.flip_ns = realns();
+          times.finished_ns = times.flip_ns;
+          showtiles(frame->tiles, times, frame);
+        }
       }
-      frameptrs[offs + yt * screentiles_x + xt] = (uint16_t*)payload;
+    }
+  }
+  return NULL;
+}
+
+const char *shmname = NULL;
+const char *shmgroup = NULL;
+const int shmslots = 8;
+shmring_t *shmring;
+// A reference to the frame in a slot for each of its tiles held, so it goes
+// back to the producers when the matrix and the layers are done with it.
+tileslab_t *shmslab;
+
+void initshm()
+{
+  shmring = shmring_create(shmname, screentiles_x, screentiles_y, shmslots,
+                           shmgroup);
+  if (!shmring)
+    return;
+  uint16_t *first = shmring_frame(shmring, 0);
+  shmslab = tileslab_wrap(first, (char*)shmring_frame(shmring, 1)
+                          - (char*)first, shmring_slots(shmring));
+  // The slots are the producers' to begin with; see shmloop().
+  for (int slot = 0; slot < shmring_slots(shmring); slot++)
+    tileslab_alloc(shmslab);
+}
+
+// Hand the frames local producers publish in shmring to the frametuuper
+// where they are.
+void *shmloop(void *x_void_ptr)
+{
+  shmring_t *r = shmring;
+  pthread_setname_np(pthread_self(), "udp: shm");
+
+  const int tiles = screentiles_x * screentiles_y;
+  const int slots = shmring_slots(r);
+  uint16_t **tileptrs = (uint16_t**)malloc(slots * tiles * sizeof(uint16_t*));
+  for (int slot = 0; slot < slots; slot++)
+  {
+    for (int i = 0; i < tiles; i++)
+      tileptrs[slot * tiles + i] = shmring_frame(r, slot)
+        + i * tilepayloadsize / sizeof(uint16_t);
+  }
+
+  // A slot not taken holds our reference. Taken, the frame holding its
+  // tiles has them; when the last goes, the slot comes back from
+  // tileslab_alloc() and goes back to the producers. Look for those often,
+  // so a producer publishing faster than the matrix shows doesn't run out.
+  // (Each look finding none counts as dry; nobody asks this slab.)
+  uint32_t key = 0;
+  while (!interrupt_received)
+  {
+    int done;
+    while ((done = tileslab_alloc(shmslab)) >= 0)
+      shmring_release(r, done);
+
+    uint64_t published;
+    int slot = shmring_take(r, 10000000, &published);
+    if (slot < 0)
+      continue;
+    heldframe_t *frame = holdframe(&tileptrs[slot * tiles]);
+    tileslab_unref(shmring_frame(r, slot));
+    if (!frame)
+      continue;         // Too many held; dropped.
+
+    key++;
+    if (rgb_matrix::TraceEnabled())
+      rgb_matrix::TraceInstant(tracecat, "shm frame", key, slot);
+    if (benchmode)
+      benchpageflip(0, tiles, 0, 0, tiles);
+    frametimes_t times;
+    memset(&times, 0, sizeof(times));
+    times.key = key;
+    times.tiles = tiles;
+    times.sent_ns = published;
+    times.flip_ns = realns();
+    times.finished_ns = times.flip_ns;
+    showtiles(frame->tiles, times, frame);
+  }
 
-      mempoolidx++;
-      mempoolidx %= mempoolcount;
+  shmring_destroy(r);
+  free(tileptrs);
+  return NULL;
+}
+
+// The layers' tiles, for as long as they're shown and held by the frames
+// shown with them.
+tileslab_t *layerslab;
+const size_t layerdatagram = sizeof(packethdr_t) + tilepayloadsize;
+
+// A datagram of layer "l" in "buf". Its tiles can only be kept if "buf" is
+// in layerslab.
+void layerpacket(layer_t *l, char *buf, ssize_t len, bool keep)
+{
+  packethdr_t hdr;
+  memcpy(&hdr, buf, sizeof(hdr));
+  uint16_t *payload = (uint16_t*)(buf + sizeof(hdr));
 
-      invalidframe:;
+  if (hdr.type == packettype_tile)
+  {
+    int xt = hdr.xpos / tilesize_x;
+    int yt = hdr.ypos / tilesize_y;
+    if (xt < l->x0 || yt < l->y0 || xt >= l->x1 || yt >= l->y1)
+      return;
+    if (len == (ssize_t)sizeof(hdr))
+      payload = NULL;         // Cleared.
+    else if (len != (ssize_t)layerdatagram || !keep)
+      return;
+    int t = yt * screentiles_x + xt;
+    tileslab_ref(payload);
+    tileslab_unref(l->next[t]);
+    l->next[t] = payload;
+    l->changed[t] = true;
+  }
+  else if (hdr.type == packettype_pageflip)
+  {
+    bool changed = false;
+    pthread_mutex_lock(&sync_lock);
+    for (int t = 0; t < screentiles_x*screentiles_y; t++)
+    {
+      if (!l->changed[t])
+        continue;
+      tileslab_unref(l->shown[t]);
+      l->shown[t] = l->next[t];
+      l->next[t] = NULL;
+      l->changed[t] = false;
+      changed = true;
     }
-    else if (vidhdr.type == 2)
+    if (changed)
     {
-      //printf("pageflip to %i\n", fr);
+      sync_layered = true;
+      pthread_cond_signal(&sync_cond);
+    }
+    pthread_mutex_unlock(&sync_lock);
+    if (changed && benchmode)
+      benchcount(&benchstats.layerflips);
+  }
+}
 
+// Receives the layers: the tile protocol, on a port for each. Unlike the
+// frames, a layer's tiles stay until they're replaced or cleared, so it
+// only needs to send the tiles that change, followed by a pageflip. That
+// wakes the frametuuper to show the last frame again with them; the matrix
+// draws them over its tiles while it converts them, so transparent tiles
+// cost nothing there, and the frames don't wait for the layers.
+void *layerloop(void *x_void_ptr)
+{
+  pthread_setname_np(pthread_self(), "udp: layers");
 
-#if 1
-      int oktiles = 0;
-      for (int i = 0; i < screentiles_x * screentiles_y; i++)
+  static char scratch[layerdatagram];
+  struct pollfd fds[maxlayers];
+  for (int l = 0; l < layercount; l++)
+  {
+    fds[l].fd = layers[l].s;
+    fds[l].events = POLLIN;
+  }
+
+  while (!interrupt_received)
+  {
+    if (poll(fds, layercount, 1000) <= 0)
+      continue;
+    for (int l = 0; l < layercount; l++)
+    {
+      if (!(fds[l].revents & POLLIN))
+        continue;
+      for (;;)
       {
-        if (frameptrs[offs + i])
-          oktiles++;
+        int i = tileslab_alloc(layerslab);
+        char *buf = i >= 0 ? tileslab_buf(layerslab, i) : scratch;
+        ssize_t len = recv(fds[l].fd, buf, layerdatagram, MSG_DONTWAIT);
+        if (len >= (ssize_t)sizeof(packethdr_t))
+          layerpacket(&layers[l], buf, len, i >= 0);
+        if (i >= 0)
+          tileslab_unref(buf);
+        if (len < 0)
+          break;
       }
+    }
+  }
+  return NULL;
+}
 
+// Start receiving the layers; layerslab has to be there already.
+void initlayers()
+{
+  for (int l = 0; l < layercount; l++)
+    layers[l].s = bindudp(layers[l].port);
+  pthread_t layer_thread;
+  pthread_create(&layer_thread, NULL, layerloop, 0);
+}
 
-              int bufleft;
-              (void)ioctl(m_s, SIOCINQ, &bufleft);
-      printf("     %lX: fr %i, left %i, ok tiles: %.2f%%\n", self, fr, bufleft, (float)oktiles*100.f / (screentiles_x*screentiles_y));
-#endif
+// The number of buckets "percent" of the "count" values in "hist" fit in.
+int histpercentile(const uint32_t *hist, int buckets, uint64_t count,
+                   float percent)
+{
+  uint64_t seen = 0;
+  for (int i = 0; i < buckets; i++)
+  {
+    seen += hist[i];
+    if (seen * 100 >= count * percent)
+      return i + 1;
+  }
+  return buckets;
+}
 
-//      swap_buffer->SetTilePtrs((void**)&frameptrs[offs]);
-//    swap_buffer = matrix->SwapOnVSync(swap_buffer);
+// Milliseconds below which "percent" of the latencies in the histogram are.
+float latencypercentile(const uint32_t *hist, uint64_t count, float percent)
+{
+  return histpercentile(hist, latencybuckets, count, percent)
+    * latencybucket_us / 1000.f;
+}
 
+// The latencies in "now" that aren't in "last" yet, into "out". Returns
+// how many.
+uint64_t latenciessince(uint32_t *out, const uint32_t *now,
+                        const uint32_t *last)
+{
+  uint64_t count = 0;
+  for (int i = 0; i < latencybuckets; i++)
+  {
+    out[i] = now[i] - last[i];
+    count += out[i];
+  }
+  return count;
+}
 
-#if 1
-      pthread_mutex_lock(&sync_lock);
-      sync_data = &frameptrs[offs];
-      pthread_cond_signal(&sync_cond);
-      pthread_mutex_unlock(&sync_lock);
-#endif
+double cpuseconds()
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+    + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// What printbenchstats() printed last, to print the difference.
+benchstats_t last;
+double lastcpu;
+uint64_t lasttime;
+uint32_t lastwakeup[recvthreadcount][wakeupbuckets];
+uint64_t lastdry;
+
+// The wakeup latencies of the receive threads since the last time.
+void printwakeups()
+{
+  static const char *waitnames[] = { "select", "epoll", "spin" };
+  for (int t = 0; t < recvthreadcount; t++)
+  {
+    uint32_t hist[wakeupbuckets];
+    uint64_t count = 0;
+    for (int i = 0; i < wakeupbuckets; i++)
+    {
+      uint32_t now = __atomic_load_n(&recvthreads[t].wakeup_hist[i],
+                                     __ATOMIC_RELAXED);
+      hist[i] = now - lastwakeup[t][i];
+      lastwakeup[t][i] = now;
+      count += hist[i];
     }
+    if (count == 0)
+      continue;
+    printf("  %s (%s): kernel to recvmsg p50 %4dus p99 %4dus, "
+           "%5.1f%% over %dus\n", recvthreads[t].name,
+           waitnames[recvthreads[t].wait],
+           histpercentile(hist, wakeupbuckets, count, 50),
+           histpercentile(hist, wakeupbuckets, count, 99),
+           100.0 * hist[wakeupbuckets - 1] / count, wakeupbuckets - 1);
   }
+}
 
-  return NULL;
+// Once a second, print what was received since the last time.
+void printbenchstats()
+{
+  benchstats_t now;
+  pthread_mutex_lock(&bench_lock);
+  now = benchstats;
+  pthread_mutex_unlock(&bench_lock);
+  double cpu = cpuseconds();
+  uint64_t time = nowns();
+
+  double secs = (time - lasttime) / 1e9;
+  uint64_t flips = now.pageflips - last.pageflips;
+  uint64_t dropped = now.dropped - last.dropped;
+  uint32_t hist[latencybuckets];
+  uint64_t latencies =
+    latenciessince(hist, now.latency_hist, last.latency_hist);
+
+  if (flips > 0)
+  {
+    printf("%6.1f fps (%6.1f taken), tiles %5.1f%% (%5.1f%% parity), "
+           "concealed %5.1f%%, complete %5.1f%%, "
+           "waited %5.1f%%, dropped %5.1f%%, "
+           "assembly p50 %5.1fms p99 %5.1fms, cpu %6.0fus/frame\n",
+           flips / secs, (now.frames_taken - last.frames_taken) / secs,
+           100.0 * (now.tiles - last.tiles) / (flips * screentiles_x * screentiles_y),
+           100.0 * (now.recovered - last.recovered) / (flips * screentiles_x * screentiles_y),
+           100.0 * (now.concealed - last.concealed) / (flips * screentiles_x * screentiles_y),
+           100.0 * (now.complete_frames - last.complete_frames) / flips,
+           100.0 * (now.waited - last.waited) / (flips + dropped),
+           100.0 * dropped / (flips + dropped),
+           latencypercentile(hist, latencies, 50),
+           latencypercentile(hist, latencies, 99),
+           (cpu - lastcpu) * 1e6 / flips);
+  }
+  else if (dropped > 0)
+  {
+    printf("no frames, %llu dropped\n", (unsigned long long)dropped);
+  }
+  else
+  {
+    printf("no frames\n");
+  }
+
+  // Frames count as shown when they're taken.
+  uint32_t oneway[latencybuckets], display[latencybuckets];
+  uint64_t oneways = latenciessince(oneway, now.oneway_hist,
+                                    last.oneway_hist);
+  uint64_t displays = latenciessince(display, now.display_hist,
+                                     last.display_hist);
+  if (oneways > 0)
+    printf("  sent to taken p50 %5.1fms p99 %5.1fms\n",
+           latencypercentile(oneway, oneways, 50),
+           latencypercentile(oneway, oneways, 99));
+  if (displays > 0)
+    printf("  pageflip to taken p50 %5.1fms p99 %5.1fms\n",
+           latencypercentile(display, displays, 50),
+           latencypercentile(display, displays, 99));
+
+  // The io_uring path leaves datagrams in the socket instead of dropping
+  // them, until that fills up.
+  uint64_t dry = 0;
+  for (int t = 0; t < recvthreadcount; t++)
+    dry += tileslab_dry(recvthreads[t].slab);
+  if (layerslab)
+    dry += tileslab_dry(layerslab);
+  if (dry > lastdry || now.nobuffer > last.nobuffer)
+    printf("  out of tile buffers %llu times, %llu datagrams dropped\n",
+           (unsigned long long)(dry - lastdry),
+           (unsigned long long)(now.nobuffer - last.nobuffer));
+  lastdry = dry;
+  if (now.layerflips > last.layerflips)
+    printf("  layer pageflips %5.1f/s, frames shown again for them %5.1f/s\n",
+           (now.layerflips - last.layerflips) / secs,
+           (now.relayered - last.relayered) / secs);
+  printwakeups();
+  fflush(stdout);
+
+  last = now;
+  lastcpu = cpu;
+  lasttime = time;
+}
+
+// "select", "epoll[:<us>]" or "spin[:<us>]", for each receive thread or
+// one for all.
+bool parsewaits(const char *arg)
+{
+  for (int t = 0; t < recvthreadcount; t++)
+  {
+    recvthread_t *thread = &recvthreads[t];
+    size_t namelen = strcspn(arg, ":,");
+    if (strncmp(arg, "select", namelen) == 0 && namelen == 6)
+      thread->wait = wait_select;
+    else if (strncmp(arg, "epoll", namelen) == 0 && namelen == 5)
+      thread->wait = wait_epoll;
+    else if (strncmp(arg, "spin", namelen) == 0 && namelen == 4)
+      thread->wait = wait_spin;
+    else
+      return false;
+    const char *next = arg + namelen;
+    if (*next == ':')
+    {
+      char *end;
+      thread->busy_us = strtol(next + 1, &end, 10);
+      if (end == next + 1 || thread->busy_us < 0)
+        return false;
+      next = end;
+    }
+    if (*next == ',')
+      arg = next + 1;
+    else if (*next != '\0')
+      return false;
+  }
+  return true;
+}
+
+bool parsecpus(const char *arg)
+{
+  for (int t = 0; t < recvthreadcount; t++)
+  {
+    char *end;
+    recvthreads[t].cpu = strtol(arg, &end, 10);
+    if (end == arg || recvthreads[t].cpu < 0)
+      return false;
+    if (*end == ',')
+      arg = end + 1;
+    else if (*end != '\0')
+      return false;
+  }
+  return true;
+}
+
+// "<port>[:<blend>[:<x>,<y>,<w>,<h>]]": a layer over those before, the
+// tiles in the rectangle of pixels it may cover.
+bool parselayer(const char *arg)
+{
+  if (layercount == maxlayers)
+    return false;
+  layer_t *l = &layers[layercount];
+  char *end;
+  l->port = strtol(arg, &end, 10);
+  if (end == arg || l->port <= 0 || l->port > 65535)
+    return false;
+  l->blend = rgb_matrix::TileLayer::kReplace;
+  l->x0 = 0;
+  l->y0 = 0;
+  l->x1 = screentiles_x;
+  l->y1 = screentiles_y;
+  if (*end == ':')
+  {
+    static const struct
+    {
+      const char *name;
+      rgb_matrix::TileLayer::Blend blend;
+    } blends[] =
+    {
+      { "replace", rgb_matrix::TileLayer::kReplace },
+      { "keyed", rgb_matrix::TileLayer::kKeyed },
+      { "add", rgb_matrix::TileLayer::kAdd },
+      { "max", rgb_matrix::TileLayer::kMax },
+    };
+    const char *name = end + 1;
+    size_t n = strcspn(name, ":");
+    int b = 0;
+    while (b < 4 && (strlen(blends[b].name) != n
+                     || strncmp(blends[b].name, name, n) != 0))
+      b++;
+    if (b == 4)
+      return false;
+    l->blend = blends[b].blend;
+    end = (char*)name + n;
+  }
+  if (*end == ':')
+  {
+    int x, y, w, h;
+    char c;
+    if (sscanf(end + 1, "%d,%d,%d,%d%c", &x, &y, &w, &h, &c) != 4
+        || x < 0 || y < 0 || w <= 0 || h <= 0)
+      return false;
+    // The tiles entirely inside.
+    l->x0 = (x + tilesize_x - 1) / tilesize_x;
+    l->y0 = (y + tilesize_y - 1) / tilesize_y;
+    l->x1 = (x + w) / tilesize_x;
+    l->y1 = (y + h) / tilesize_y;
+    if (l->x1 > screentiles_x)
+      l->x1 = screentiles_x;
+    if (l->y1 > screentiles_y)
+      l->y1 = screentiles_y;
+  }
+  else if (*end != '\0')
+  {
+    return false;
+  }
+  layercount++;
+  return true;
+}
+
+int usage(const char *progname, const RGBMatrix::Options &defaults,
+          const rgb_matrix::RuntimeOptions &runtime_defaults)
+{
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Options:\n"
+          "\t--port=<port>   : UDP port to receive on (Default: %d).\n"
+          "\t--multicast=<group>: Receive from this multicast group too.\n"
+          "\t--artnet        : Receive Art-Net on port %d.\n"
+          "\t--sacn          : Receive sACN (E1.31) on port %d.\n"
+          "\t--ddp           : Receive DDP on port %d.\n"
+          "\t--patch=<file>  : Art-Net/sACN universes to pixels; see dmx.h.\n"
+          "\t--universe=<n>  : Without --patch, patch the wall row by row,\n"
+          "\t                  170 pixels per universe from <n> (Default: 1).\n"
+          "\t--bench         : No matrix; print receive statistics every "
+          "second.\n"
+          "\t--trace=<file>  : Write a trace to <file> on Ctrl-C.\n"
+          "\t--conceal=<how> : Show a lost tile as 'previous': the tile\n"
+          "\t                  shown there before (default), or 'none':\n"
+          "\t                  what was drawn on the matrix.\n"
+          "\t--incomplete=<how>: Show a frame with tiles missing at the\n"
+          "\t                  pageflip (concealed, 'show', default) or keep\n"
+          "\t                  the frame before ('drop').\n"
+          "\t--recv=<how>    : Receive tiles with 'uring': io_uring, if the\n"
+          "\t                  kernel has it (default), 'select': a\n"
+          "\t                  syscall per packet or per burst coalesced\n"
+          "\t                  by UDP GRO, or 'packet[:<if>]': a\n"
+          "\t                  TPACKET_V3 ring on interface <if> (Default:\n"
+          "\t                  all). The ring needs CAP_NET_RAW and tile\n"
+          "\t                  packets that aren't fragmented.\n"
+          "\t--wait=<how>[,<how>]: How the threads of --recv=select wait\n"
+          "\t                  for packets, one for both or each: 'select'\n"
+          "\t                  (default), 'epoll[:<us>]': busy poll the\n"
+          "\t                  device for <us> (Default: 50) first, or\n"
+          "\t                  'spin[:<us>]': try reading for <us> first.\n"
+          "\t                  Blocking reads of the shared socket busy\n"
+          "\t                  poll for the longest epoll <us>.\n"
+          "\t                  --bench shows how long packets waited.\n"
+          "\t--recvcpu=<cpu>[,<cpu>]: CPUs for the receive threads\n"
+          "\t                  (Default: 0).\n"
+          "\t--tilewait=<ms>  : Let an incomplete frame wait this long for\n"
+          "\t                  its missing tiles first (Default: 0).\n"
+          "\t--capture=<file>: Write the received packets to <file>, to be\n"
+          "\t                  replayed with udpreplay.\n"
+          "\t--frametimes=<file>: Write when each frame was sent, its\n"
+          "\t                  first and last tile and its pageflip arrived,\n"
+          "\t                  it was done and first shown to <file>.\n"
+          "\t--hwtimestamp=<if>: Have the NIC <if> timestamp the packets;\n"
+          "\t                  its clock has to be synced with phc2sys.\n"
+          "\t--shm=<name>    : Take frames from producers on this machine\n"
+          "\t                  in shared memory <name>, like /udpled; see\n"
+          "\t                  shmring.h.\n"
+          "\t--shm-group=<group>: Let producers of this group use it too\n"
+          "\t                  (Default: only our user).\n"
+          "\t--output=<name> : No matrix; hand the frames to led-refreshd\n"
+          "\t                  over its shared memory <name>, like /udpled.\n"
+          "\t                  Needs no privileges.\n"
+          "\t--layer=<port>[:<blend>[:<x>,<y>,<w>,<h>]]: Show the tiles\n"
+          "\t                  received on <port> over the frames and the\n"
+          "\t                  layers given before, up to %d; see\n"
+          "\t                  protocol.h. <blend>: 'replace' (default),\n"
+          "\t                  'keyed': black is transparent, 'add' or\n"
+          "\t                  'max'. Only the tiles inside the rectangle\n"
+          "\t                  of pixels are shown (Default: all).\n\n",
+          udp_port, artnet_port, sacn_port, ddp_port, maxlayers);
+  rgb_matrix::PrintMatrixFlags(stderr, defaults, runtime_defaults);
+  return 1;
 }
 
 int main(int argc, char **argv)
 {
-  swap_buffer = creatematrix(argc, argv);
+  RGBMatrix::Options defaults;
+  rgb_matrix::RuntimeOptions runtime_defaults;
+  setmatrixdefaults(&defaults, &runtime_defaults);
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
+                                         &defaults, &runtime_defaults))
+    return usage(argv[0], defaults, runtime_defaults);
+
+  static const struct option longopts[] =
+  {
+    { "port",  required_argument, NULL, 'p' },
+    { "multicast", required_argument, NULL, 'm' },
+    { "artnet", no_argument, NULL, 'A' },
+    { "sacn", no_argument, NULL, 'S' },
+    { "ddp", no_argument, NULL, 'D' },
+    { "patch", required_argument, NULL, 'P' },
+    { "universe", required_argument, NULL, 'U' },
+    { "bench", no_argument,       NULL, 'b' },
+    { "trace", required_argument, NULL, 't' },
+    { "capture", required_argument, NULL, 'c' },
+    { "conceal", required_argument, NULL, 'C' },
+    { "incomplete", required_argument, NULL, 'I' },
+    { "tilewait", required_argument, NULL, 'W' },
+    { "recv", required_argument, NULL, 'R' },
+    { "wait", required_argument, NULL, 'w' },
+    { "recvcpu", required_argument, NULL, 'X' },
+    { "frametimes", required_argument, NULL, 'F' },
+    { "hwtimestamp", required_argument, NULL, 'H' },
+    { "shm", required_argument, NULL, 'M' },
+    { "shm-group", required_argument, NULL, 'G' },
+    { "output", required_argument, NULL, 'O' },
+    { "layer", required_argument, NULL, 'L' },
+    { NULL, 0, NULL, 0 },
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "p:m:bt:c:", longopts, NULL)) != -1)
+  {
+    switch (opt)
+    {
+    case 'p':
+      recvport = atoi(optarg);
+      break;
+    case 'm':
+      multicastgroup = optarg;
+      break;
+    case 'A':
+      artnet = true;
+      break;
+    case 'S':
+      sacn = true;
+      break;
+    case 'D':
+      ddp = true;
+      break;
+    case 'P':
+      patchfile = optarg;
+      break;
+    case 'U':
+      firstuniverse = atoi(optarg);
+      break;
+    case 'b':
+      benchmode = true;
+      break;
+    case 't':
+      tracefile = optarg;
+      break;
+    case 'c':
+      capturefile = optarg;
+      break;
+    case 'C':
+      if (strcmp(optarg, "previous") == 0)
+        concealmode = conceal_previous;
+      else if (strcmp(optarg, "none") == 0)
+        concealmode = conceal_none;
+      else
+        return usage(argv[0], defaults, runtime_defaults);
+      break;
+    case 'I':
+      if (strcmp(optarg, "show") == 0)
+        incompletemode = incomplete_show;
+      else if (strcmp(optarg, "drop") == 0)
+        incompletemode = incomplete_drop;
+      else
+        return usage(argv[0], defaults, runtime_defaults);
+      break;
+    case 'R':
+      if (strcmp(optarg, "uring") == 0)
+        recvmode = recv_uring;
+      else if (strcmp(optarg, "select") == 0)
+        recvmode = recv_select;
+      else if (strncmp(optarg, "packet", 6) == 0
+               && (optarg[6] == '\0' || optarg[6] == ':'))
+      {
+        recvmode = recv_packet;
+        if (optarg[6] == ':')
+          packetif = optarg + 7;
+      }
+      else
+        return usage(argv[0], defaults, runtime_defaults);
+      break;
+    case 'w':
+      if (!parsewaits(optarg))
+        return usage(argv[0], defaults, runtime_defaults);
+      break;
+    case 'X':
+      if (!parsecpus(optarg))
+        return usage(argv[0], defaults, runtime_defaults);
+      break;
+    case 'F':
+      frametimesfile = fopen(optarg, "w");
+      if (!frametimesfile)
+      {
+        perror(optarg);
+        return 1;
+      }
+      fprintf(frametimesfile, "# frame tiles sent first last pageflip "
+              "done shown, CLOCK_REALTIME ns, 0: not known\n");
+      break;
+    case 'H':
+      hwtimestampif = optarg;
+      break;
+    case 'M':
+      shmname = optarg;
+      break;
+    case 'G':
+      shmgroup = optarg;
+      break;
+    case 'O':
+      outputname = optarg;
+      break;
+    case 'L':
+      if (!parselayer(optarg))
+        return usage(argv[0], defaults, runtime_defaults);
+      break;
+    case 'W':
+      tilewait_ms = atoi(optarg);
+      if (tilewait_ms < 0)
+        return usage(argv[0], defaults, runtime_defaults);
+      break;
+    default:
+      return usage(argv[0], defaults, runtime_defaults);
+    }
+  }
+
+  if (tracefile)
+    rgb_matrix::TraceEnable(true);
+  if (capturefile && !capture_open(capturefile, 64 << 20))
+    return 1;
+  if (artnet || sacn)
+  {
+    if (patchfile && !dmx_loadpatch(patchfile))
+      return 1;
+    if (!patchfile)
+      dmx_defaultpatch(screentiles_x * tilesize_x, screentiles_y * tilesize_y,
+                       firstuniverse);
+  }
+
+  if (!benchmode && !outputname)
+  {
+    matrix = rgb_matrix::CreateMatrixFromOptions(defaults, runtime_defaults);
+    if (matrix == NULL)
+      return usage(argv[0], defaults, runtime_defaults);
+
+//  matrix->ApplyStaticTransformer(rgb_matrix::DoubleAbsenTransformer());
+
+    matrix->Clear();
+    swap_buffer = matrix->CreateFrameCanvas();
+  }
+  outputlsbns = defaults.pwm_lsb_nanoseconds;
+  outputditherbits = defaults.pwm_dither_bits;
   setsignal();
 
 #if 1
@@ -608,6 +2847,21 @@ int main(int argc, char **argv)
     }
 #endif
 
+    // All slabs are created before any thread taking references to tiles
+    // runs; see tileslab.cc.
+    for (int t = 0; t < recvthreadcount; t++)
+      recvthreads[t].slab = tileslab_create(sizeof(framemem_t), mempoolcount);
+    // Each layer's tiles: shown, received for the next pageflip, and held
+    // by the frames.
+    if (layercount > 0)
+      layerslab = tileslab_create(layerdatagram, layercount
+                                  * screentiles_x * screentiles_y
+                                  * (heldframecount + 2));
+    if (shmname)
+      initshm();
+    if (artnet || sacn || ddp)
+      frontendassembler = assembler_create(screentiles_x, screentiles_y);
+
     pthread_t sync_thread;
     pthread_create(&sync_thread, NULL, frametuuperthread, 0);
 
@@ -617,12 +2871,49 @@ int main(int argc, char **argv)
 //    pthread_create(&recv_thread, NULL, living_receiver, 0);
 
     initrecv();
+    initbusypoll();
+
+    pthread_create(&recv1_thread, NULL, recvloop, &recvthreads[0]);
+    if (recvmode != recv_packet)
+      pthread_create(&recv2_thread, NULL, recvloop, &recvthreads[1]);
 
-    pthread_create(&recv1_thread, NULL, recvloop, (void*)"udp: recv1");
-    pthread_create(&recv2_thread, NULL, recvloop, (void*)"udp: recv2");
+    initfrontends();
+    if (frontendcount > 0)
+    {
+      pthread_t frontend_thread;
+      pthread_create(&frontend_thread, NULL, frontendloop, 0);
+    }
+    if (shmring)
+    {
+      pthread_t shm_thread;
+      pthread_create(&shm_thread, NULL, shmloop, 0);
+    }
+    if (layercount > 0)
+      initlayers();
    //pthread_create(&recv3_thread, NULL, recvloop, (void*)"udp: recv3");
 
    pthread_setname_np(pthread_self(), "main thread");
+   lastcpu = cpuseconds();
+   lasttime = nowns();
+   while(!interrupt_received)
+   {
+      sleep(1);
+      if (benchmode)
+        printbenchstats();
+   }
+
+   if (capturefile)
+     capture_close();
+   if (frametimesfile)
+     fflush(frametimesfile);
+
+   if (tracefile)
+   {
+     rgb_matrix::TraceEnable(false);
+     if (rgb_matrix::TraceDump(tracefile))
+       printf("trace written to %s\n", tracefile);
+   }
+
    while(1)
    {
       sleep(10);
@@ -0,0 +1,350 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Load generator for the udp receiver: sends a moving test pattern as tiles
+// and pageflips at a given frame rate, optionally losing tiles, sending
+// parity packets or sending them in paced bursts. Together with
+// "udp --bench" this measures what the receiver can take without a matrix
+// attached:
+//
+// $ ./udp --bench &
+// $ ./udpgen -f 120 -l 1 -b 4
+//
+// With -s it's a local producer drawing into the receiver's shared memory
+// ring instead (udp --shm).
+
+#include "protocol.h"
+#include "shmring.h"
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+const char *host = "127.0.0.1";
+int port = udp_port;
+int fps = 60;
+int wall_x = 4;       // In tiles.
+int wall_y = 3;
+float losspercent = 0;
+int burst = 0;        // Packets per paced group; 0: all back to back.
+long frames = 0;      // 0: forever.
+int paritygroup = 0;  // Tiles per parity packet; 0: no parity.
+const char *shmname = NULL;
+bool control = false;
+controlpayload_t controlpayload;
+
+int usage(const char *progname)
+{
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Options:\n"
+          "\t-t <host>  : Receiver address (Default: 127.0.0.1).\n"
+          "\t-p <port>  : Receiver port (Default: %d).\n"
+          "\t-f <fps>   : Frames per second (Default: 60).\n"
+          "\t-x <tiles> : Wall width in %d pixel tiles (Default: 4).\n"
+          "\t-y <tiles> : Wall height in %d pixel tiles (Default: 3).\n"
+          "\t-l <pct>   : Drop this percentage of the tiles and parity\n"
+          "\t             packets (Default: 0).\n"
+          "\t-r <tiles> : Send a parity packet per <tiles> tiles\n"
+          "\t             (Default: 0, none).\n"
+          "\t-b <count> : Send the packets of a frame in groups of <count>,\n"
+          "\t             spread over the frame time (Default: 0, all at once).\n"
+          "\t-n <count> : Stop after <count> frames (Default: 0, never).\n"
+          "\t-s <name>  : Draw into the receiver's shared memory ring\n"
+          "\t             <name> instead of sending.\n"
+          "\t-c <what>  : Send a control packet instead of frames, e.g.\n"
+          "\t             brightness=50,gamma=2.2,pwmbits=8,dither=1,idle=10\n"
+          "\t             (idle=0: never).\n",
+          udp_port, tilesize_x, tilesize_y);
+  return 1;
+}
+
+uint64_t nowns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t realns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void sleepuntil(uint64_t ns)
+{
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+  {
+  }
+}
+
+// A diagonal gradient moving by one pixel each frame.
+void filltile(uint16_t *payload, long frame, int xt, int yt)
+{
+  for (int y = 0; y < tilesize_y; y++)
+    for (int x = 0; x < tilesize_x; x++)
+    {
+      int px = xt * tilesize_x + x;
+      int py = yt * tilesize_y + y;
+      uint16_t *p = payload + (y * tilesize_x + x) * 3;
+      p[0] = ((px + frame) & 63) * 1000;
+      p[1] = ((py + frame) & 63) * 1000;
+      p[2] = ((px + py) & 63) * 1000;
+    }
+}
+
+// The pattern into a shared memory ring, at "fps".
+int drawshm()
+{
+  shmring_t *r = shmring_open(shmname);
+  if (!r)
+    return 1;
+  const int tiles_x = shmring_width(r) / tilesize_x;
+  const int tiles = tiles_x * (shmring_height(r) / tilesize_y);
+  const uint64_t frame_ns = 1000000000 / fps;
+  uint64_t published = 0, full = 0;
+  uint64_t next = nowns();
+  uint64_t laststats = next;
+  for (long frame = 0; frames == 0 || frame < frames; frame++)
+  {
+    int slot = shmring_acquire(r);
+    if (slot < 0)
+    {
+      full++;
+    }
+    else
+    {
+      uint16_t *pixels = shmring_frame(r, slot);
+      for (int i = 0; i < tiles; i++)
+        filltile(pixels + i * tilepayloadsize / sizeof(uint16_t), frame,
+                 i % tiles_x, i / tiles_x);
+      shmring_publish(r, slot);
+      published++;
+    }
+
+    next += frame_ns;
+    uint64_t now = nowns();
+    if (now - laststats >= 1000000000)
+    {
+      printf("frame %ld: %llu published, %llu with no slot\n", frame,
+             (unsigned long long)published, (unsigned long long)full);
+      fflush(stdout);
+      laststats = now;
+    }
+    if (now < next)
+      sleepuntil(next);
+    else
+      next = now;
+  }
+  shmring_close(r);
+  return 0;
+}
+
+// "<name>=<value>,..." into "controlpayload".
+bool parsecontrol(char *arg)
+{
+  char *save;
+  for (char *field = strtok_r(arg, ",", &save); field;
+       field = strtok_r(NULL, ",", &save))
+  {
+    char *value = strchr(field, '=');
+    if (!value)
+      return false;
+    *value++ = 0;
+    const float v = atof(value);
+    if (strcmp(field, "brightness") == 0 && v >= 1 && v <= 100)
+      controlpayload.brightness = v;
+    else if (strcmp(field, "gamma") == 0 && v > 0 && v < 10)
+      controlpayload.gamma = v * 100 + 0.5;
+    else if (strcmp(field, "pwmbits") == 0 && v >= 1 && v <= 11)
+      controlpayload.pwm_bits = v;
+    else if (strcmp(field, "dither") == 0 && v >= 0 && v <= 2)
+      controlpayload.dither_bits = v + 1;
+    else if (strcmp(field, "idle") == 0 && v >= 0 && v < 65535)
+      controlpayload.idle_s = v > 0 ? v : 65535;
+    else
+      return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "t:p:f:x:y:l:b:n:r:s:c:")) != -1)
+  {
+    switch (opt)
+    {
+    case 't': host = optarg; break;
+    case 'p': port = atoi(optarg); break;
+    case 'f': fps = atoi(optarg); break;
+    case 'x': wall_x = atoi(optarg); break;
+    case 'y': wall_y = atoi(optarg); break;
+    case 'l': losspercent = atof(optarg); break;
+    case 'b': burst = atoi(optarg); break;
+    case 'n': frames = atol(optarg); break;
+    case 'r': paritygroup = atoi(optarg); break;
+    case 's': shmname = optarg; break;
+    case 'c':
+      control = true;
+      if (!parsecontrol(optarg))
+        return usage(argv[0]);
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (fps <= 0 || wall_x <= 0 || wall_y <= 0 || burst < 0 || paritygroup < 0)
+    return usage(argv[0]);
+  if (shmname)
+    return drawshm();
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  char portstr[16];
+  snprintf(portstr, sizeof(portstr), "%d", port);
+  struct addrinfo *addr;
+  int err = getaddrinfo(host, portstr, &hints, &addr);
+  if (err != 0)
+  {
+    fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+    return 1;
+  }
+
+  int s = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s < 0 || connect(s, addr->ai_addr, addr->ai_addrlen) < 0)
+  {
+    perror("socket");
+    return 1;
+  }
+  freeaddrinfo(addr);
+
+  if (control)
+  {
+    packethdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = packettype_control;
+    char packet[sizeof(hdr) + sizeof(controlpayload)];
+    memcpy(packet, &hdr, sizeof(hdr));
+    memcpy(packet + sizeof(hdr), &controlpayload, sizeof(controlpayload));
+    if (send(s, packet, sizeof(packet), 0) < 0)
+    {
+      perror("send");
+      return 1;
+    }
+    close(s);
+    return 0;
+  }
+
+  const int tiles = wall_x * wall_y;
+  const int paritypackets =
+    paritygroup > 0 ? (tiles + paritygroup - 1) / paritygroup : 0;
+  const int packets = tiles + paritypackets + 1;  // And the pageflip.
+  const uint64_t frame_ns = 1000000000 / fps;
+  const int groups = burst > 0 ? (packets + burst - 1) / burst : 1;
+
+  struct
+  {
+    packethdr_t hdr;
+    uint16_t payload[tilepayloadsize / sizeof(uint16_t)];
+  } packet;
+  uint16_t *parity =
+    (uint16_t*)malloc(paritypackets * tilepayloadsize + 1);
+
+  uint64_t sent = 0, dropped = 0, senderrors = 0;
+  uint64_t next = nowns();
+  uint64_t laststats = next;
+  for (long frame = 0; frames == 0 || frame < frames; frame++)
+  {
+    memset(parity, 0, paritypackets * tilepayloadsize);
+    const uint64_t sent_ns = realns();
+    for (int i = 0; i < packets; i++)
+    {
+      if (burst > 0 && i % burst == 0)
+        sleepuntil(next + frame_ns * (i / burst) / groups);
+
+      memset(&packet.hdr, 0, sizeof(packet.hdr));
+      packet.hdr.frame = frame & 255;
+      size_t len = sizeof(packet.hdr);
+      if (i < tiles)
+      {
+        int xt = i % wall_x;
+        int yt = i / wall_x;
+        packet.hdr.type = packettype_tile;
+        packet.hdr.xpos = xt * tilesize_x;
+        packet.hdr.ypos = yt * tilesize_y;
+        filltile(packet.payload, frame, xt, yt);
+        len += tilepayloadsize;
+        if (paritygroup > 0)
+        {
+          uint16_t *p = parity + (i / paritygroup) * tilepayloadsize / 2;
+          for (int w = 0; w < tilepayloadsize / 2; w++)
+            p[w] ^= packet.payload[w];
+        }
+        if (losspercent > 0 && rand() < losspercent / 100 * RAND_MAX)
+        {
+          dropped++;
+          continue;
+        }
+      }
+      else if (i < tiles + paritypackets)
+      {
+        int group = i - tiles;
+        packet.hdr.type = packettype_parity;
+        packet.hdr.xpos = group * paritygroup;
+        packet.hdr.ypos = paritygroup < tiles - group * paritygroup
+          ? paritygroup : tiles - group * paritygroup;
+        memcpy(packet.payload, parity + group * tilepayloadsize / 2,
+               tilepayloadsize);
+        len += tilepayloadsize;
+        if (losspercent > 0 && rand() < losspercent / 100 * RAND_MAX)
+        {
+          dropped++;
+          continue;
+        }
+      }
+      else
+      {
+        packet.hdr.type = packettype_pageflip;
+        pageflippayload_t flip = { sent_ns };
+        memcpy(packet.payload, &flip, sizeof(flip));
+        len += sizeof(flip);
+      }
+
+      if (send(s, &packet, len, 0) < 0)
+        senderrors++;
+      else
+        sent++;
+    }
+
+    next += frame_ns;
+    uint64_t now = nowns();
+    if (now - laststats >= 1000000000)
+    {
+      printf("frame %ld: %llu packets sent, %llu dropped, %llu send errors\n",
+             frame, (unsigned long long)sent, (unsigned long long)dropped,
+             (unsigned long long)senderrors);
+      fflush(stdout);
+      laststats = now;
+    }
+    if (now < next)
+      sleepuntil(next);
+    else
+      next = now;  // Can't keep up; don't try to catch up.
+  }
+
+  free(parity);
+  close(s);
+  return 0;
+}
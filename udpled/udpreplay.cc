@@ -0,0 +1,184 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Send the datagrams captured with "udp --capture=<file>" to a receiver
+// again, with the original timing or faster. The whole capture is read
+// into memory first, so the disk doesn't disturb the timing:
+//
+// $ ./udp --bench &
+// $ ./udpreplay -s 2 wall.cap
+
+#include "protocol.h"
+#include "capture.h"
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+const char *host = "127.0.0.1";
+int port = udp_port;
+float speed = 1;      // 0: as fast as possible.
+int loops = 1;        // 0: forever.
+
+int usage(const char *progname)
+{
+  fprintf(stderr, "usage: %s [options] <capture-file>\n", progname);
+  fprintf(stderr, "Options:\n"
+          "\t-t <host>  : Receiver address (Default: 127.0.0.1).\n"
+          "\t-p <port>  : Receiver port (Default: %d).\n"
+          "\t-s <speed> : Speed relative to the capture; 0 sends as fast\n"
+          "\t             as possible (Default: 1).\n"
+          "\t-l <count> : Play the capture <count> times; 0 loops forever\n"
+          "\t             (Default: 1).\n",
+          udp_port);
+  return 1;
+}
+
+uint64_t nowns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void sleepuntil(uint64_t ns)
+{
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+  {
+  }
+}
+
+typedef struct
+{
+  uint64_t offset_ns;   // Since the first datagram.
+  size_t pos;           // Of the datagram in the capture data.
+  uint32_t len;
+} replaypacket_t;
+
+int main(int argc, char **argv)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "t:p:s:l:")) != -1)
+  {
+    switch (opt)
+    {
+    case 't': host = optarg; break;
+    case 'p': port = atoi(optarg); break;
+    case 's': speed = atof(optarg); break;
+    case 'l': loops = atoi(optarg); break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || speed < 0 || loops < 0)
+    return usage(argv[0]);
+  const char *filename = argv[optind];
+
+  FILE *in = fopen(filename, "rb");
+  if (in == NULL)
+  {
+    perror(filename);
+    return 1;
+  }
+  captureheader_t header;
+  if (fread(&header, sizeof(header), 1, in) != 1
+      || memcmp(header.magic, "UDPCAPT1", sizeof(header.magic)) != 0
+      || header.version != 1)
+  {
+    fprintf(stderr, "%s: not a capture file.\n", filename);
+    return 1;
+  }
+
+  std::vector<char> data;
+  std::vector<replaypacket_t> packets;
+  capturerecord_t rec;
+  while (fread(&rec, sizeof(rec), 1, in) == 1)
+  {
+    replaypacket_t p;
+    p.pos = data.size();
+    p.len = rec.len;
+    p.offset_ns = rec.timestamp_ns;
+    data.resize(data.size() + rec.len);
+    if (fread(&data[p.pos], 1, rec.len, in) != rec.len)
+    {
+      fprintf(stderr, "%s: truncated; replaying %zu packets.\n",
+              filename, packets.size());
+      data.resize(p.pos);
+      break;
+    }
+    packets.push_back(p);
+  }
+  fclose(in);
+  if (packets.empty())
+  {
+    fprintf(stderr, "%s: no packets.\n", filename);
+    return 1;
+  }
+  const uint64_t first_ns = packets[0].offset_ns;
+  for (size_t i = 0; i < packets.size(); i++)
+    packets[i].offset_ns -= first_ns;
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  char portstr[16];
+  snprintf(portstr, sizeof(portstr), "%d", port);
+  struct addrinfo *addr;
+  int err = getaddrinfo(host, portstr, &hints, &addr);
+  if (err != 0)
+  {
+    fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+    return 1;
+  }
+  int s = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s < 0 || connect(s, addr->ai_addr, addr->ai_addrlen) < 0)
+  {
+    perror("socket");
+    return 1;
+  }
+  freeaddrinfo(addr);
+
+  const double duration = packets.back().offset_ns / 1e9;
+  printf("%zu packets, %.2f seconds\n", packets.size(), duration);
+
+  for (int loop = 0; loops == 0 || loop < loops; loop++)
+  {
+    uint64_t senderrors = 0;
+    uint64_t late_ns = 0;
+    const uint64_t start = nowns();
+    for (size_t i = 0; i < packets.size(); i++)
+    {
+      const replaypacket_t &p = packets[i];
+      if (speed > 0)
+      {
+        uint64_t due = start + (uint64_t)(p.offset_ns / speed);
+        uint64_t now = nowns();
+        if (now < due)
+          sleepuntil(due);
+        else if (now - due > late_ns)
+          late_ns = now - due;
+      }
+      if (send(s, &data[p.pos], p.len, 0) < 0)
+        senderrors++;
+    }
+    double took = (nowns() - start) / 1e9;
+    printf("loop %d: %.3f seconds, %.0f packets/s, %llu send errors, "
+           "max %.3f ms late\n", loop, took, packets.size() / took,
+           (unsigned long long)senderrors, late_ns / 1e6);
+    fflush(stdout);
+  }
+
+  close(s);
+  return 0;
+}
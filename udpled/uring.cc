@@ -0,0 +1,302 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+
+#include "uring.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static_assert(sizeof(struct io_uring_recvmsg_out) == uringrecv_headroom,
+              "uringrecv_headroom");
+
+const int bufgroup = 0;
+
+struct uringrecv
+{
+  int fd;
+  int s;
+
+  void *sqring;
+  size_t sqringsize;
+  void *cqring;             // The same as sqring with IORING_FEAT_SINGLE_MMAP.
+  size_t cqringsize;
+  struct io_uring_sqe *sqes;
+  size_t sqessize;
+  unsigned *sqtail;
+  unsigned *sqmask;
+  unsigned *sqarray;
+  unsigned *cqhead;
+  unsigned *cqtail;
+  unsigned *cqmask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_buf_ring *bufring;
+  size_t bufringsize;
+  unsigned bufentries;
+  uint16_t buftail;
+  char *buffers;
+  size_t stride;
+  size_t bufsize;
+
+  struct msghdr msg;        // What the multishot recvmsg reads the
+                            // name and control lengths from.
+  bool armed;
+  bool received;            // Anything yet; failing before is for good.
+  int tosubmit;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned tosubmit, unsigned mincomplete,
+                       unsigned flags, void *arg, size_t argsize)
+{
+  return syscall(__NR_io_uring_enter, fd, tosubmit, mincomplete, flags,
+                 arg, argsize);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned count)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+void uringrecv_close(uringrecv_t *u)
+{
+  if (u->fd >= 0)
+    close(u->fd);
+  if (u->bufring)
+    munmap(u->bufring, u->bufringsize);
+  if (u->sqes)
+    munmap(u->sqes, u->sqessize);
+  if (u->cqring && u->cqring != u->sqring)
+    munmap(u->cqring, u->cqringsize);
+  if (u->sqring)
+    munmap(u->sqring, u->sqringsize);
+  free(u);
+}
+
+uringrecv_t *uringrecv_open(int s, char *buffers, size_t stride,
+                            size_t bufsize, int count, size_t controllen)
+{
+  uringrecv_t *u = (uringrecv_t*)calloc(1, sizeof(uringrecv_t));
+  u->s = s;
+  u->buffers = buffers;
+  u->stride = stride;
+  u->bufsize = bufsize;
+  u->msg.msg_controllen = controllen;
+  u->bufentries = 1;
+  while (u->bufentries < (unsigned)count)
+    u->bufentries *= 2;
+
+  // Completions are only run when we wait for them, on this thread.
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER
+    | IORING_SETUP_DEFER_TASKRUN;
+  p.cq_entries = u->bufentries * 2;
+  u->fd = uring_setup(4, &p);
+  if (u->fd < 0 && errno == EINVAL)
+  {
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = u->bufentries * 2;
+    u->fd = uring_setup(4, &p);
+  }
+  if (u->fd < 0)
+  {
+    printf("no io_uring: %s\n", strerror(errno));
+    uringrecv_close(u);
+    return NULL;
+  }
+
+  u->sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cqringsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (u->cqringsize > u->sqringsize)
+      u->sqringsize = u->cqringsize;
+    u->cqringsize = u->sqringsize;
+  }
+  void *ring = mmap(NULL, u->sqringsize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (ring == MAP_FAILED)
+  {
+    uringrecv_close(u);
+    return NULL;
+  }
+  u->sqring = ring;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    u->cqring = u->sqring;
+  }
+  else
+  {
+    ring = mmap(NULL, u->cqringsize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (ring == MAP_FAILED)
+    {
+      uringrecv_close(u);
+      return NULL;
+    }
+    u->cqring = ring;
+  }
+  u->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring = mmap(NULL, u->sqessize, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (ring == MAP_FAILED)
+  {
+    uringrecv_close(u);
+    return NULL;
+  }
+  u->sqes = (struct io_uring_sqe*)ring;
+
+  char *sq = (char*)u->sqring;
+  char *cq = (char*)u->cqring;
+  u->sqtail = (unsigned*)(sq + p.sq_off.tail);
+  u->sqmask = (unsigned*)(sq + p.sq_off.ring_mask);
+  u->sqarray = (unsigned*)(sq + p.sq_off.array);
+  u->cqhead = (unsigned*)(cq + p.cq_off.head);
+  u->cqtail = (unsigned*)(cq + p.cq_off.tail);
+  u->cqmask = (unsigned*)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  // The buffer ring: page aligned memory we share with the kernel.
+  u->bufringsize = u->bufentries * sizeof(struct io_uring_buf);
+  ring = mmap(NULL, u->bufringsize, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED)
+  {
+    uringrecv_close(u);
+    return NULL;
+  }
+  u->bufring = (struct io_uring_buf_ring*)ring;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)u->bufring;
+  reg.ring_entries = u->bufentries;
+  reg.bgid = bufgroup;
+  if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+  {
+    printf("no io_uring buffer rings: %s\n", strerror(errno));
+    uringrecv_close(u);
+    return NULL;
+  }
+
+  return u;
+}
+
+void uringrecv_release(uringrecv_t *u, int buf)
+{
+  // Not bufring->bufs: in C++ the empty struct __DECLARE_FLEX_ARRAY puts
+  // before it takes room. Only the fields, the first entry's last one is
+  // the ring's tail.
+  struct io_uring_buf *b = (struct io_uring_buf*)u->bufring
+    + (u->buftail & (u->bufentries - 1));
+  b->addr = (uint64_t)(uintptr_t)(u->buffers + buf * u->stride);
+  b->len = u->bufsize;
+  b->bid = buf;
+  u->buftail++;
+  __atomic_store_n(&u->bufring->tail, u->buftail, __ATOMIC_RELEASE);
+}
+
+// Start a multishot recvmsg; it's ended by errors, like running out of
+// buffers, and a full completion queue.
+static void arm(uringrecv_t *u)
+{
+  unsigned tail = *u->sqtail;
+  unsigned idx = tail & *u->sqmask;
+  struct io_uring_sqe *sqe = &u->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = u->s;
+  sqe->addr = (uint64_t)(uintptr_t)&u->msg;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = bufgroup;
+  u->sqarray[idx] = idx;
+  __atomic_store_n(u->sqtail, tail + 1, __ATOMIC_RELEASE);
+  u->tosubmit++;
+  u->armed = true;
+}
+
+int uringrecv_wait(uringrecv_t *u, uringpacket_t *packets, int max,
+                   uint64_t timeout_ns)
+{
+  if (!u->armed)
+    arm(u);
+
+  unsigned head = *u->cqhead;
+  unsigned tail = __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE);
+  if (head == tail || u->tosubmit > 0)
+  {
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout_ns / 1000000000;
+    ts.tv_nsec = timeout_ns % 1000000000;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    int ret = uring_enter(u->fd, u->tosubmit, head == tail ? 1 : 0,
+                          IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                          &arg, sizeof(arg));
+    if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+    {
+      printf("io_uring: %s\n", strerror(errno));
+      return -1;
+    }
+    if (ret > 0)
+      u->tosubmit -= ret;
+    tail = __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE);
+  }
+
+  int n = 0;
+  while (head != tail && n < max)
+  {
+    const struct io_uring_cqe *cqe = &u->cqes[head & *u->cqmask];
+    head++;
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+      u->armed = false;
+    if (cqe->res < 0)
+    {
+      if (cqe->res == -ENOBUFS)
+        continue;
+      if (!u->received)
+      {
+        printf("io_uring recvmsg: %s\n", strerror(-cqe->res));
+        __atomic_store_n(u->cqhead, head, __ATOMIC_RELEASE);
+        return -1;
+      }
+      continue;
+    }
+    if (!(cqe->flags & IORING_CQE_F_BUFFER))
+      continue;
+
+    int buf = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    char *b = u->buffers + buf * u->stride;
+    const struct io_uring_recvmsg_out *out =
+      (const struct io_uring_recvmsg_out*)b;
+    uringpacket_t *packet = &packets[n++];
+    packet->buf = buf;
+    packet->control = b + sizeof(*out) + u->msg.msg_namelen;
+    packet->controllen = out->controllen;
+    packet->data = b + sizeof(*out) + u->msg.msg_namelen
+      + u->msg.msg_controllen;
+    packet->truncated = (out->flags & MSG_TRUNC) != 0;
+    size_t room = u->bufsize - (packet->data - b);
+    packet->len = out->payloadlen < room ? out->payloadlen : room;
+    u->received = true;
+  }
+  __atomic_store_n(u->cqhead, head, __ATOMIC_RELEASE);
+  return n;
+}
@@ -0,0 +1,52 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+Receiving datagrams with io_uring, without liburing.
+
+One multishot recvmsg on the socket writes each datagram straight into a
+buffer of the caller's, taken from a buffer ring, and the completions are
+reaped in batches, so a busy socket costs no syscall per datagram. Each
+buffer gets uringrecv_headroom bytes of io_uring bookkeeping, room for the
+control messages, then the datagram. Buffers are given to the kernel with uringrecv_release(), and
+filled in the order given.
+
+Needs Linux 6.0. uringrecv_open() returns NULL where that, or io_uring at
+all, isn't available, and uringrecv_wait() fails if the kernel turns the
+receive down; the caller then falls back to recvmsg().
+*/
+#ifndef UDPLED_URING_H
+#define UDPLED_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// sizeof(struct io_uring_recvmsg_out).
+const size_t uringrecv_headroom = 16;
+
+typedef struct
+{
+  int buf;                  // Index of the buffer.
+  char *data;               // The datagram, in the buffer.
+  size_t len;
+  char *control;            // Its control messages, in the buffer.
+  size_t controllen;
+  bool truncated;           // Longer than the buffer; the rest is lost.
+} uringpacket_t;
+
+typedef struct uringrecv uringrecv_t;
+
+// Receive from socket "s" into up to "count" buffers of "bufsize" bytes,
+// each "stride" bytes from the one before, starting at "buffers", with
+// "controllen" bytes of them for control messages. None of them are the
+// kernel's yet.
+uringrecv_t *uringrecv_open(int s, char *buffers, size_t stride,
+                            size_t bufsize, int count, size_t controllen);
+
+// Wait up to "timeout_ns" for datagrams and store up to "max" of them in
+// "packets". Returns how many, or -1 if receiving failed for good.
+int uringrecv_wait(uringrecv_t *u, uringpacket_t *packets, int max,
+                   uint64_t timeout_ns);
+
+void uringrecv_release(uringrecv_t *u, int buf);
+
+void uringrecv_close(uringrecv_t *u);
+
+#endif
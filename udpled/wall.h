@@ -0,0 +1,48 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+The LED wall udp and led-refreshd drive: its size in tiles and the matrix
+options it takes.
+*/
+#ifndef UDPLED_WALL_H
+#define UDPLED_WALL_H
+
+#include "led-matrix.h"
+
+#define VALTAVAMATRIISI
+
+#ifdef VALTAVAMATRIISI
+const int screentiles_x = 4;
+const int screentiles_y = 3;
+#else
+const int screentiles_x = 12;
+const int screentiles_y = 6;
+#endif
+
+inline void setmatrixdefaults(rgb_matrix::RGBMatrix::Options *defaults,
+                              rgb_matrix::RuntimeOptions *runtime_defaults)
+{
+  defaults->hardware_mapping = "regular";  // or e.g. "adafruit-hat"
+#ifdef VALTAVAMATRIISI
+  defaults->rows = 16;
+  defaults->cols = 64;
+  defaults->chain_length = 1;
+  defaults->multiplexing = 7;
+  defaults->parallel = 3;
+#else
+  defaults->rows = 32;
+  defaults->cols = 64;
+  defaults->chain_length = 3;
+  defaults->multiplexing = 0;
+  defaults->parallel = 3;
+#endif
+
+  defaults->show_refresh_rate = true;
+  //defaults->pwm_lsb_nanoseconds = 50;
+
+
+ // --led-multiplexing=7 --led-cols=64 --led-rows=16 --led-parallel=3 --led-slowdown-gpio=2 
+
+  runtime_defaults->drop_privileges = 1;
+  runtime_defaults->gpio_slowdown = 3;
+}
+
+#endif
@@ -0,0 +1,250 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Convert a trace written with rgb_matrix::TraceDump() (see include/trace.h)
+// to the Chrome trace event JSON format. Load the result in chrome://tracing
+// or https://ui.perfetto.dev/
+//
+// Each thread becomes a track. The steps of each frame are connected with
+// flow arrows, from the first packet to the first refresh showing it.
+//
+// Compile with
+// $ make trace-to-json
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using rgb_matrix::TraceFileHeader;
+using rgb_matrix::TraceFileRecord;
+using rgb_matrix::TraceFileThread;
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s <trace-file> [<json-output>]\n", progname);
+  fprintf(stderr, "Writes to stdout if no output file is given.\n");
+  return 1;
+}
+
+namespace {
+struct Event {
+  uint32_t tid;
+  TraceFileRecord record;
+};
+
+// Frames are identified by category and frame number; TraceLink() records
+// tell which of them are the same frame.
+class FrameUnion {
+public:
+  int Find(const std::string &key) {
+    std::map<std::string, int>::iterator found = ids_.find(key);
+    if (found == ids_.end()) {
+      const int id = parent_.size();
+      parent_.push_back(id);
+      ids_[key] = id;
+      return id;
+    }
+    int id = found->second;
+    while (parent_[id] != id) {
+      parent_[id] = parent_[parent_[id]];
+      id = parent_[id];
+    }
+    return id;
+  }
+
+  void Union(const std::string &a, const std::string &b) {
+    const int root_a = Find(a);
+    const int root_b = Find(b);
+    if (root_a != root_b) parent_[root_b] = root_a;
+  }
+
+private:
+  std::map<std::string, int> ids_;
+  std::vector<int> parent_;
+};
+
+static bool CompareTime(const Event *a, const Event *b) {
+  return a->record.timestamp_ns < b->record.timestamp_ns;
+}
+}  // anonymous namespace
+
+static std::string FrameKey(const std::string &category, uint32_t frame) {
+  char buffer[16];
+  snprintf(buffer, sizeof(buffer), ":%u", frame);
+  return category + buffer;
+}
+
+// Strings we write come from the traced program; escape them for JSON.
+static std::string JsonString(const std::string &in) {
+  std::string result = "\"";
+  for (size_t i = 0; i < in.size(); ++i) {
+    const unsigned char c = in[i];
+    if (c == '"' || c == '\\') {
+      result.append(1, '\\').append(1, c);
+    } else if (c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      result.append(escaped);
+    } else {
+      result.append(1, c);
+    }
+  }
+  return result + "\"";
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3)
+    return usage(argv[0]);
+
+  FILE *in = fopen(argv[1], "rb");
+  if (in == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  TraceFileHeader header;
+  if (fread(&header, sizeof(header), 1, in) != 1
+      || memcmp(header.magic, "RGBTRACE", sizeof(header.magic)) != 0
+      || header.version != 1) {
+    fprintf(stderr, "%s: not a trace file.\n", argv[1]);
+    return 1;
+  }
+
+  std::vector<std::string> strings;
+  for (uint32_t i = 0; i < header.string_count; ++i) {
+    uint16_t len;
+    if (fread(&len, sizeof(len), 1, in) != 1) {
+      fprintf(stderr, "Short read in string table.\n");
+      return 1;
+    }
+    std::string s(len, ' ');
+    if (len > 0 && fread(&s[0], 1, len, in) != len) {
+      fprintf(stderr, "Short read in string table.\n");
+      return 1;
+    }
+    strings.push_back(s);
+  }
+
+  std::vector<TraceFileThread> threads;
+  std::vector<Event> events;
+  for (uint32_t t = 0; t < header.thread_count; ++t) {
+    TraceFileThread thread;
+    if (fread(&thread, sizeof(thread), 1, in) != 1) {
+      fprintf(stderr, "Short read in thread header.\n");
+      return 1;
+    }
+    threads.push_back(thread);
+    for (uint32_t i = 0; i < thread.record_count; ++i) {
+      Event e;
+      e.tid = thread.tid;
+      if (fread(&e.record, sizeof(e.record), 1, in) != 1) {
+        fprintf(stderr, "Short read in records.\n");
+        return 1;
+      }
+      if (e.record.category >= strings.size()
+          || e.record.name >= strings.size()) {
+        fprintf(stderr, "Invalid string index in record.\n");
+        return 1;
+      }
+      events.push_back(e);
+    }
+  }
+  fclose(in);
+
+  FILE *out = stdout;
+  if (argc == 3) {
+    out = fopen(argv[2], "w");
+    if (out == NULL) {
+      perror(argv[2]);
+      return 1;
+    }
+  }
+
+  // Time relative to the first event, which makes the numbers readable.
+  uint64_t start_ns = UINT64_MAX;
+  for (size_t i = 0; i < events.size(); ++i) {
+    start_ns = std::min(start_ns, events[i].record.timestamp_ns);
+  }
+
+  FrameUnion frames;
+  for (size_t i = 0; i < events.size(); ++i) {
+    const TraceFileRecord &r = events[i].record;
+    if (r.phase == 'L') {
+      frames.Union(FrameKey(strings[r.category], r.frame),
+                   FrameKey(strings[r.name], r.arg));
+    }
+  }
+
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  const char *separator = "";
+  for (size_t t = 0; t < threads.size(); ++t) {
+    std::string name(threads[t].name,
+                     strnlen(threads[t].name, sizeof(threads[t].name)));
+    fprintf(out, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,"
+            "\"tid\":%u,\"args\":{\"name\":%s}}",
+            separator, threads[t].tid, JsonString(name).c_str());
+    separator = ",\n";
+  }
+
+  // Steps of the same frame, to be connected by flow arrows. A frame is
+  // prepared and shown in many refreshes; only the first time per thread
+  // and step is interesting for latency.
+  std::map<int, std::vector<const Event*> > flows;
+  std::set<std::pair<int, std::pair<uint32_t, uint16_t> > > seen_steps;
+  for (size_t i = 0; i < events.size(); ++i) {
+    const Event &e = events[i];
+    const TraceFileRecord &r = e.record;
+    if (r.phase == 'L')
+      continue;
+    const double ts_us = (r.timestamp_ns - start_ns) / 1000.0;
+    const std::string category = JsonString(strings[r.category]);
+    const std::string name = JsonString(strings[r.name]);
+    if (r.phase == 'i') {
+      // As zero-length slice, as flow arrows only attach to slices.
+      fprintf(out, "%s{\"ph\":\"X\",\"dur\":0,\"pid\":1,\"tid\":%u,"
+              "\"ts\":%.3f,\"cat\":%s,\"name\":%s,"
+              "\"args\":{\"frame\":%u,\"arg\":%u}}",
+              separator, e.tid, ts_us, category.c_str(), name.c_str(),
+              r.frame, r.arg);
+    } else {
+      fprintf(out, "%s{\"ph\":\"%c\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+              "\"cat\":%s,\"name\":%s,\"args\":{\"frame\":%u}}",
+              separator, r.phase, e.tid, ts_us, category.c_str(),
+              name.c_str(), r.frame);
+    }
+    if (r.phase == 'E' || r.frame == 0)
+      continue;  // Frame 0: not submitted, e.g. the initial matrix frame.
+    const int flow_id = frames.Find(FrameKey(strings[r.category], r.frame));
+    if (seen_steps.insert(std::make_pair(flow_id,
+                                         std::make_pair(e.tid, r.name))).second) {
+      flows[flow_id].push_back(&e);
+    }
+  }
+
+  for (std::map<int, std::vector<const Event*> >::iterator it = flows.begin();
+       it != flows.end(); ++it) {
+    std::vector<const Event*> &steps = it->second;
+    if (steps.size() < 2)
+      continue;
+    std::sort(steps.begin(), steps.end(), CompareTime);
+    for (size_t i = 0; i < steps.size(); ++i) {
+      const char phase = (i == 0) ? 's' : (i == steps.size() - 1) ? 'f' : 't';
+      fprintf(out, "%s{\"ph\":\"%c\",\"bp\":\"e\",\"id\":%d,\"pid\":1,"
+              "\"tid\":%u,\"ts\":%.3f,\"cat\":\"frame\",\"name\":\"frame\"}",
+              separator, phase, it->first, steps[i]->tid,
+              (steps[i]->record.timestamp_ns - start_ns) / 1000.0);
+    }
+  }
+  fprintf(out, "\n]}\n");
+
+  if (out != stdout && fclose(out) != 0) {
+    perror(argv[2]);
+    return 1;
+  }
+  return 0;
+}